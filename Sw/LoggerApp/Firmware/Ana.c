@@ -39,6 +39,9 @@
 ** V3.36 140114 PB remove calls to FTP_deactivate_retrieval_info()
 **
 ** V4.00 220114 PB disable if HDW_GPS defined
+**
+** V6.03 171026    ANA_retrieve_derived_conversion_data() reads conversion file through a CFS session,
+**				   a line at a time, instead of scanning from start of file for each line
 */
 
 #include <float.h>
@@ -171,15 +174,13 @@ bool ANA_get_adc_values(int index)
 /******************************************************************************
 ** Function:	get one or two values from the line in the ftable file
 **
-** Notes:		returns false if no such line
+** Notes:		reads next line of session's file. returns false if no more lines
 */
-bool ana_get_ftable_values(uint8 channel, int line, float * input, float * output)
+bool ana_get_ftable_values(CFS_session_type * s, float * input, float * output)
 {
 	char * p_line = STR_buffer;
-	char filename[16];
 
-	sprintf(filename, "%u%s", channel+1, (char *)CFS_ftable_name);
-	if (CFS_read_line((char *)CFS_config_path, filename, line, STR_buffer, 140) > 0)
+	if (CFS_session_read_line(s, STR_buffer, 140) > 0)
 	{
 		sscanf(STR_buffer, "%f", input);															// get input value
 		*output = 0.0F;																				// second value is after comma if it exists
@@ -627,6 +628,8 @@ bool ANA_retrieve_derived_conversion_data(uint8 channel, uint8 derived_type)
 	float temp_value;
 	ANA_derived_config_type * p_pointer;
 	char filename[16];
+	CFS_session_type session;
+	bool ok;
 
 	p_pointer = &ANA_derived_config[channel];
 
@@ -642,21 +645,13 @@ bool ANA_retrieve_derived_conversion_data(uint8 channel, uint8 derived_type)
 			sprintf(filename, "%u%s", channel+1, (char *)CFS_venturi_name);
 		if (CFS_file_exists((char *)CFS_config_path, filename))										// check calc file exists
 		{																							// get four values for formula from file
-			if (CFS_read_line((char *)CFS_config_path, filename, 1, STR_buffer, 140) > 0)
-				sscanf(STR_buffer, "%f", &(p_pointer->min_value));
-			else
-				return false;
-			if (CFS_read_line((char *)CFS_config_path, filename, 2, STR_buffer, 140) > 0)
-				sscanf(STR_buffer, "%f", &(p_pointer->max_value));
-			else
-				return false;
-			if (CFS_read_line((char *)CFS_config_path, filename, 3, STR_buffer, 140) > 0)
-				sscanf(STR_buffer, "%f", &(p_pointer->K_value));
-			else
-				return false;
-			if (CFS_read_line((char *)CFS_config_path, filename, 4, STR_buffer, 140) > 0)
-				sscanf(STR_buffer, "%f", &(p_pointer->k_value));
-			else
+			CFS_session_open(&session, (char *)CFS_config_path, filename);
+			ok = ana_get_ftable_values(&session, &(p_pointer->min_value), &temp_value) &&
+				 ana_get_ftable_values(&session, &(p_pointer->max_value), &temp_value) &&
+				 ana_get_ftable_values(&session, &(p_pointer->K_value), &temp_value) &&
+				 ana_get_ftable_values(&session, &(p_pointer->k_value), &temp_value);
+			CFS_session_close(&session);
+			if (!ok)
 				return false;
 		}
 		else
@@ -667,24 +662,27 @@ bool ANA_retrieve_derived_conversion_data(uint8 channel, uint8 derived_type)
 		sprintf(filename, "%u%s", channel+1, (char *)CFS_ftable_name);
 		if (CFS_file_exists((char *)CFS_config_path, filename))										// check table file exists
 		{																							// table is min, max, n points, lines 0 to n-1: input,output 
-			if (!ana_get_ftable_values(channel, 1, &(p_pointer->min_value), &temp_value))
-				return false;
-			if (!ana_get_ftable_values(channel, 2, &(p_pointer->max_value), &temp_value))
-				return false;
-			if (CFS_read_line((char *)CFS_config_path, filename, 3, STR_buffer, 140) > 0)
+			CFS_session_open(&session, (char *)CFS_config_path, filename);
+			ok = ana_get_ftable_values(&session, &(p_pointer->min_value), &temp_value) &&
+				 ana_get_ftable_values(&session, &(p_pointer->max_value), &temp_value) &&
+				 (CFS_session_read_line(&session, STR_buffer, 140) > 0);
+			if (ok)
+			{
 				sscanf(STR_buffer, "%d", &table_points);
-			else
-				return false;
-			if (table_points > ANA_DEPTH_TO_FLOW_POINTS)											// test for too many points
-				return false;
-			p_pointer->K_value = (float)table_points;
+				if (table_points > ANA_DEPTH_TO_FLOW_POINTS)										// test for too many points
+					ok = false;
+				else
+					p_pointer->K_value = (float)table_points;
+			}
 			point = 0;
-			while (point < table_points)															// get table entries
+			while (ok && (point < table_points))													// get table entries
 			{
-				if (!ana_get_ftable_values(channel, 4 + point, &(p_pointer->input_value[point]), &(p_pointer->point_value[point])))
-					return false;
+				ok = ana_get_ftable_values(&session, &(p_pointer->input_value[point]), &(p_pointer->point_value[point]));
 				point++;																			// move up table
 			};
+			CFS_session_close(&session);
+			if (!ok)
+				return false;
 		}
 		else
 			return false;
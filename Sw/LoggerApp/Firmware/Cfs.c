@@ -16,9 +16,32 @@
 **
 ** V4.02 140414 PB  new state CFS_FAILED with a timeout of 2sec, then power CFS down
 ** V4.06 130515 MA	File system modifications for faster creation of new files and avoidance of file system corruption
+**
+** V6.03 171026     directory cache - CFS_chdir() returns to a recently used absolute path without walking it
+**					cache cleared when gDirGeneration changes (mount of a changed card, FSmkdir, FSrmdir etc.),
+**					kept while the card is powered down between uses
+**					cfs_open_file() & CFS_file_exists() use CFS_chdir()
+**					read sessions - CFS_session_xxx() keep a file open between sequential block reads,
+**					only one session file open at a time, suspended by CFS_power_down()
+**					CFS_flush() writes back FSIO sector cache, also done by CFS_power_down()
+**					cfs_init_sd_card() clears gSDStream, as card has been reset
+**					CFS_flush() uses FS_flush(), which also writes back FAT32 FSINFO free count
+**					CFS_session_read_line() reads next line of a session's file, for scripts & config tables,
+**					instead of CFS_read_line() scanning from start of file for each line
+**					cfs_open_file() suspends open session & retries if too many files open
+**					small file cache - CFS_cache_read_line() keeps lines of lookup files in RAM,
+**					checked against size & timestamp once each time file system opened, discarded when written
+**					write sessions - CFS_session_create() preallocates clusters for the expected size,
+**					CFS_session_write() appends, keeping the file open between blocks
+**					CFS_cache_invalidate() takes path, clears alarm level tables if file is in \PROFILES
+**					CFS_session_read_line() scans a block read ahead into cfs_line_block, one FSfread() per block
+**					CFS_block_claim() & CFS_block_release() share one second sector buffer between USB file transfers
+**					& FTP upload
+**					cfs_open_file() made public as CFS_open_file(), for LOG_binary_to_text() which needs both file slots
 */
 
 #include <string.h>
+#include <ctype.h>
 #include "Custom.h"
 #include "compiler.h"
 #include "Tim.h"
@@ -38,15 +61,23 @@
 #include "usb_config.h"
 #include "USB/usb_device.h"
 
+#include "alm.h"
+
 #define extern
 #include "Cfs.h"
 #undef extern
 
-// Low-level function in FSIO.c:
+// Low-level functions in FSIO.c:
 int FS_read_line(FSFILE *stream, int line_number, char *ptr, size_t max_bytes);
+DWORD FS_get_cwd(char * name);
+void FS_set_cwd(DWORD cluster, char * name);
+BYTE FS_flush(void);
+int FS_preallocate(FSFILE * fo, DWORD bytes);
+extern WORD gDirGeneration;
 
 // Low-level function in SD-SPI.c:
 BYTE MDD_SDSPI_ReadMedia(void);
+extern DWORD gSectorReadCount;
 
 #define CFS_POWERING_TIMEOUT_X20MS	2
 #define CFS_INIT_TIMEOUT_X20MS		50
@@ -54,6 +85,65 @@ BYTE MDD_SDSPI_ReadMedia(void);
 #define CFS_STAY_ON_TIMEOUT_X20MS	20		// 400ms
 #define CFS_FAILED_TIMEOUT_X20MS	100		// 2s
 
+#define CFS_DIR_CACHE_SIZE			16		// enough for all LOGDATA, SMSDATA & COPDATA directories in use in a month
+#define CFS_DIR_CACHE_PATH_SIZE		24		// longest is e.g. "\\SMSDATA\\A1D\\2026\\10"
+
+typedef struct
+{
+	char	path[CFS_DIR_CACHE_PATH_SIZE];	// absolute path, '\0' if entry unused
+	char	name[FILE_NAME_SIZE];			// directory name as held in cwd
+	uint8	reads;							// sector reads taken by FSchdir() when entry was made
+	DWORD	cluster;						// start cluster of directory
+} cfs_dir_cache_type;
+
+FAR cfs_dir_cache_type cfs_dir_cache[CFS_DIR_CACHE_SIZE];
+uint8 cfs_dir_cache_next;					// next entry to be replaced
+WORD cfs_dir_cache_generation;				// gDirGeneration when cache last cleared
+
+CFS_session_type * cfs_session_owner;		// session which has its file open, NULL if none
+
+// Second sector buffer for double-buffered USB file transfers & FTP upload - see CFS_block_claim()
+FAR char cfs_block_buffer[CFS_BLOCK_BUFFER_SIZE];
+uint8 cfs_block_owner;						// CFS_BLOCK_FREE, CFS_BLOCK_USB or CFS_BLOCK_FTP
+
+// Read-ahead for CFS_session_read_line(). Shared, as only the session with its file open can use it.
+// Owner's file position is cfs_line_count - cfs_line_index bytes ahead of its pos.
+#define CFS_LINE_BLOCK_SIZE			64
+
+FAR char cfs_line_block[CFS_LINE_BLOCK_SIZE];
+CFS_session_type * cfs_line_owner;			// session whose bytes are in cfs_line_block, NULL if none
+uint8 cfs_line_index;						// next byte of cfs_line_block to scan
+uint8 cfs_line_count;						// bytes in cfs_line_block
+
+// Small file cache: lines of lookup files (units names) kept in RAM with the directory entry of their file
+#define CFS_FILE_CACHE_SIZE			2		// units & volume units files
+#define CFS_FILE_CACHE_PATH_SIZE	16
+#define CFS_LINE_CACHE_SIZE			16		// lines cached
+#define CFS_LINE_CACHE_TEXT			8		// longest line cached, including '\0' - a units name
+
+typedef struct
+{
+	char	path[CFS_FILE_CACHE_PATH_SIZE];
+	char	filename[CFS_FILE_NAME_SIZE];	// '\0' if entry unused
+	uint32	size;
+	uint32	timestamp;						// last modified time in directory entry
+	bool	verified;						// checked against directory entry since file system opened
+} cfs_file_cache_type;
+
+typedef struct
+{
+	uint8	file;							// index in cfs_file_cache[], CFS_LINE_CACHE_FREE if entry unused
+	uint8	n;								// line number
+	char	text[CFS_LINE_CACHE_TEXT];
+} cfs_line_cache_type;
+
+#define CFS_LINE_CACHE_FREE			0xFF
+
+FAR cfs_file_cache_type cfs_file_cache[CFS_FILE_CACHE_SIZE];
+FAR cfs_line_cache_type cfs_line_cache[CFS_LINE_CACHE_SIZE];
+uint8 cfs_file_cache_next;					// next file entry to be replaced
+uint8 cfs_line_cache_next;					// next line entry to be replaced
+
 char cfs_filename[CFS_FILE_NAME_SIZE];
 
 SearchRec cfs_search_result;
@@ -124,6 +214,7 @@ bool cfs_init_sd_card(void)
     }
 
 	gSDMode = SD_MODE_NORMAL;							// by default...
+	gSDStream = SD_STREAM_NONE;							// any multi-block transfer was lost by reset
     response = SendMMCCmd(SEND_IF_COND, 0x1AA);
 	// If the following is true, when we enter CFS_sd_card_ready, assume it's an HC.
 	// Commands we execute then may reveal that it is in fact non-HC.
@@ -298,6 +389,11 @@ MEDIA_INFORMATION * CFS_sd_card_ready(void)
 */
 void CFS_init(void)
 {
+	uint8 i;
+
+	for (i = 0; i < CFS_LINE_CACHE_SIZE; i++)						// small file cache empty
+		cfs_line_cache[i].file = CFS_LINE_CACHE_FREE;
+
 	// Ensure SD card is powered down for about a second, in case we crashed & reset
 	HDW_SD_CARD_ON_N = true;
 	CFS_timer_x20ms = 50;
@@ -438,6 +534,35 @@ void CFS_task(void)
 	}
 }
 
+/******************************************************************************
+** Function:	Close file of session which has its file open, if any
+**
+** Notes:		Session keeps its position, so next CFS_session_read() reopens the file there
+*/
+void cfs_session_suspend(void)
+{
+	if (cfs_session_owner == NULL)
+		return;
+
+	if (cfs_line_owner == cfs_session_owner)		// pos is where reading resumes, so read-ahead just dropped
+		cfs_line_owner = NULL;
+	if (CFS_state == CFS_OPEN)						// else FSInit() will free the file slot
+		FSfclose(cfs_session_owner->f);
+	cfs_session_owner->f = NULL;
+	cfs_session_owner = NULL;
+}
+
+/******************************************************************************
+** Function:	Write back FSINFO & any sectors held in file system sector cache
+**
+** Notes:		Nothing to do if card is not open
+*/
+void CFS_flush(void)
+{
+	if (CFS_state == CFS_OPEN)
+		FS_flush();
+}
+
 /******************************************************************************
 ** Function:	Power down down file system
 **
@@ -445,12 +570,91 @@ void CFS_task(void)
 */
 void CFS_power_down(void)
 {
+	uint8 i;
+
+	cfs_session_suspend();							// before card is switched off
+	CFS_flush();
 	HDW_SD_CARD_ON_N = true;						// switch off
 	HDW_SPI1_SS_N = false;							// CS idles low when powered down
 	SPIENABLE = false;
 	SLP_set_required_clock_speed();
 
-	CFS_state = CFS_OFF;							// re-initialise next time
+	CFS_state = CFS_OFF;							// re-initialise next time - FSInit() checks directory cache still applies
+	for (i = 0; i < CFS_FILE_CACHE_SIZE; i++)		// so check cached files next time card open
+		cfs_file_cache[i].verified = false;
+}
+
+/******************************************************************************
+** Function:	Clear directory cache
+**
+** Notes:		Call if directory tree may have changed
+*/
+void CFS_dir_cache_clear(void)
+{
+	uint8 i;
+
+	for (i = 0; i < CFS_DIR_CACHE_SIZE; i++)
+		cfs_dir_cache[i].path[0] = '\0';
+	cfs_dir_cache_next = 0;
+	cfs_dir_cache_generation = gDirGeneration;
+}
+
+/******************************************************************************
+** Function:	Set working directory, using directory cache if possible
+**
+** Notes:		Returns false if can't. Empty path is root.
+**				Creates the directory if create is true and it does not exist.
+**				Only absolute paths without '.' or '..' are cached.
+**				CFS must be open first.
+*/
+bool CFS_chdir(char * path, bool create)
+{
+	uint8 i;
+	DWORD reads;
+
+	if (*path == '\0')
+		path = "\\";
+
+	if (cfs_dir_cache_generation != gDirGeneration)		// directory tree may have changed
+		CFS_dir_cache_clear();
+
+	for (i = 0; i < CFS_DIR_CACHE_SIZE; i++)
+	{
+		if ((cfs_dir_cache[i].path[0] != '\0') && (strcmp(cfs_dir_cache[i].path, path) == 0))
+		{
+			FS_set_cwd(cfs_dir_cache[i].cluster, cfs_dir_cache[i].name);
+			CFS_dir_cache_hits++;
+			CFS_dir_cache_reads_saved += cfs_dir_cache[i].reads;
+			return true;
+		}
+	}
+
+	CFS_dir_cache_misses++;
+	reads = gSectorReadCount;
+	if (FSchdir(path) != 0)								// can't set working directory
+	{
+		if (!create)
+			return false;
+
+		FSmkdir(path);
+		CFS_dir_cache_clear();							// tree has changed
+		reads = gSectorReadCount;
+		if (FSchdir(path) != 0)							// still can't set working directory
+			return false;
+	}
+																// cache absolute paths which fit
+	if ((path[0] == '\\') && (path[1] != '\0') && (strchr(path, '.') == NULL) && (strlen(path) < CFS_DIR_CACHE_PATH_SIZE))
+	{
+		i = cfs_dir_cache_next;
+		strcpy(cfs_dir_cache[i].path, path);
+		cfs_dir_cache[i].cluster = FS_get_cwd(cfs_dir_cache[i].name);
+		reads = gSectorReadCount - reads;
+		cfs_dir_cache[i].reads = (reads > 255) ? 255 : (uint8)reads;
+		if (++cfs_dir_cache_next >= CFS_DIR_CACHE_SIZE)
+			cfs_dir_cache_next = 0;
+	}
+
+	return true;
 }
 
 /******************************************************************************
@@ -472,29 +676,30 @@ void CFS_close_file(FSFILE *f)
 **
 ** Notes:		Returns NULL if can't. Don't forget to close it.
 */
-FSFILE *cfs_open_file(char * path, char * filename, char *mode)
+FSFILE *CFS_open_file(char * path, char * filename, char *mode)
 {
+	FSFILE *f;
+
 	if (!CFS_open())
 		return NULL;
 
 	if (CFS_state != CFS_OPEN)
 		return NULL;
 
-	if (FSchdir((*path == '\0') ? "\\" : path) != 0)	// can't set working directory
-	{
-		// if we are trying to write the file, create the directory:
-		if ((*mode == 'w') || (*mode == 'a'))
-		{
-			FSmkdir(path);
+	// if we are trying to write the file, create the directory if necessary:
+	if (!CFS_chdir(path, (*mode == 'w') || (*mode == 'a')))	// can't set working directory
+		return NULL;
 
-			if (FSchdir((*path == '\0') ? "\\" : path) != 0)	// still can't set working directory
-				return NULL;
-		}
-		else				// read mode, directory doesn't exist
-			return NULL;
-	}
+	if ((*mode == 'w') || (*mode == 'a'))
+		CFS_cache_invalidate(path, filename);
 
-	return FSfopen(filename, mode);
+	f = FSfopen(filename, mode);
+	if ((f == NULL) && (FSerror() == CE_TOO_MANY_FILES_OPEN) && (cfs_session_owner != NULL))
+	{
+		cfs_session_suspend();						// session reopens at its position when next read
+		f = FSfopen(filename, mode);
+	}
+	return f;
 }
 
 /******************************************************************************
@@ -507,7 +712,7 @@ bool CFS_file_exists(char * path, char * filename)
 	if (CFS_state != CFS_OPEN)
 		return false;
 
-	if (FSchdir((*path == '\0') ? "\\" : path) != 0)	// can't set working directory
+	if (!CFS_chdir(path, false))						// can't set working directory
 		return false;
 
 	if (FindFirst(filename, ATTR_MASK & ~ATTR_DIRECTORY, &cfs_search_result) == 0)	// success
@@ -526,7 +731,7 @@ bool CFS_read_file(char * path, char * filename, char * buffer, int max_bytes)
 {
 	FSFILE *f;
 
-	f = cfs_open_file(path, filename, "r");		// returns NULL if FS not open
+	f = CFS_open_file(path, filename, "r");		// returns NULL if FS not open
 	if (f == NULL)
 		return false;
 
@@ -555,7 +760,7 @@ bool CFS_read_block(char * path, char * filename, char * buffer, long seek_pos,
 	if (bytes == 0)
 		return false;
 
-	f = cfs_open_file(path, filename, "r");
+	f = CFS_open_file(path, filename, "r");
 	if (f == NULL)
 		return false;
 
@@ -575,6 +780,264 @@ bool CFS_read_block(char * path, char * filename, char * buffer, long seek_pos,
 	return true;
 }
 
+/******************************************************************************
+** Function:	Start a read session on a file
+**
+** Notes:		Empty path is root. path & filename must remain valid until session closed.
+**				File is opened by the first CFS_session_read(), then kept open so each
+**				block follows on from the last without walking the path or cluster chain.
+**				Only one session has its file open at a time - reading another session
+**				suspends it, and it is reopened at its saved position when next read.
+*/
+void CFS_session_open(CFS_session_type * s, char * path, char * filename)
+{
+	CFS_session_close(s);
+	s->path = path;
+	s->filename = filename;
+	s->pos = 0;
+}
+
+/******************************************************************************
+** Function:	Give up session's line read-ahead
+**
+** Notes:		Moves file back to session's pos if read-ahead not all scanned. Returns false if can't.
+*/
+bool cfs_line_release(CFS_session_type * s)
+{
+	if (cfs_line_owner != s)
+		return true;
+
+	cfs_line_owner = NULL;
+	if ((cfs_line_index != cfs_line_count) && (s->f != NULL) && (FSfseek(s->f, s->pos, SEEK_SET) != 0))
+	{
+		cfs_session_suspend();								// reopened at pos when next read
+		return false;
+	}
+	return true;
+}
+
+/******************************************************************************
+** Function:	Read next block of a session's file into buffer
+**
+** Notes:		Returns number of bytes read, 0 at end-of-file, or -1 if can't.
+**				Adds '\0' after end-of-file if fewer than bytes read.
+*/
+int CFS_session_read(CFS_session_type * s, char * buffer, int bytes)
+{
+	int n;
+
+	if (bytes <= 0)
+		return 0;
+
+	if (!cfs_line_release(s))
+		return -1;
+
+	if (s->f == NULL)										// not open yet, or suspended
+	{
+		cfs_session_suspend();								// only one session file open at a time
+		s->f = CFS_open_file(s->path, s->filename, "r");	// returns NULL if FS not open
+		if (s->f == NULL)
+			return -1;
+		cfs_session_owner = s;
+
+		if ((s->pos != 0) && (FSfseek(s->f, s->pos, SEEK_SET) != 0))
+		{
+			cfs_session_suspend();
+			return -1;
+		}
+	}
+	else if (CFS_state != CFS_OPEN)
+		return -1;
+
+	n = (int)FSfread(buffer, 1, bytes, s->f);
+	s->pos += n;
+	if (n < bytes)
+		buffer[n] = '\0';
+
+	CFS_timer_x20ms = CFS_STAY_ON_TIMEOUT_X20MS;			// leave file system powered up for a bit
+	return n;
+}
+
+/******************************************************************************
+** Function:	Read next line of a session's file into a string
+**
+** Notes:		Returns string length, or -1 at end-of-file or if can't. Adds '\0' at end of string.
+**				Line ends at '\n'. As CFS_read_line(), anything from '\r' on is ignored, and the line
+**				is truncated to max_bytes - 1 chars. Position is left at start of the next line.
+**				File is read a block at a time into cfs_line_block, so a line usually costs one FSfread().
+*/
+int CFS_session_read_line(CFS_session_type * s, char * buffer, int max_bytes)
+{
+	int i, n;
+	bool copy, found;
+	char c;
+
+	i = 0;
+	copy = true;
+	found = false;
+	for (;;)
+	{
+		if ((cfs_line_owner != s) || (cfs_line_index >= cfs_line_count))	// read-ahead used up
+		{
+			n = CFS_session_read(s, cfs_line_block, CFS_LINE_BLOCK_SIZE);
+			if (n <= 0)										// end-of-file, or can't
+				break;
+			s->pos -= n;									// pos only counts bytes scanned
+			cfs_line_owner = s;
+			cfs_line_count = (uint8)n;
+			cfs_line_index = 0;
+		}
+
+		c = cfs_line_block[cfs_line_index++];
+		s->pos++;
+		found = true;
+		if (c == '\n')
+			break;
+		if ((c == '\r') || (i >= max_bytes - 1))
+			copy = false;
+		if (copy)
+			buffer[i++] = c;
+	}
+
+	buffer[i] = '\0';
+	return found ? i : -1;
+}
+
+/******************************************************************************
+** Function:	Set seek position of next session read
+**
+** Notes:		Returns false if can't
+*/
+bool CFS_session_seek(CFS_session_type * s, long pos)
+{
+	if (!cfs_line_release(s))
+		return false;
+
+	if (pos == s->pos)
+		return true;
+
+	if ((s->f != NULL) && (FSfseek(s->f, pos, SEEK_SET) != 0))
+	{
+		cfs_session_suspend();								// file position now unknown
+		return false;
+	}
+
+	s->pos = pos;
+	return true;
+}
+
+/******************************************************************************
+** Function:	Create a file and start a write session on it
+**
+** Notes:		Replaces any existing file. Clusters preallocated for bytes, so appends don't allocate them
+**				one at a time. File stays open until CFS_session_close(), or another session takes the slot.
+**				Returns false if can't, or not enough space.
+*/
+bool CFS_session_create(CFS_session_type * s, char * path, char * filename, long bytes)
+{
+	CFS_session_open(s, path, filename);
+	if (LOG_state == LOG_BATT_DEAD)							// all writes to SD disabled if battery flat
+		return false;
+
+	cfs_session_suspend();									// only one session file open at a time
+	s->f = CFS_open_file(path, filename, "w");
+	if (s->f == NULL)
+		return false;
+	cfs_session_owner = s;
+
+	if ((bytes > 0) && (FS_preallocate(s->f, (DWORD)bytes) != 0))
+	{
+		CFS_session_close(s);
+		return false;
+	}
+
+	CFS_timer_x20ms = CFS_STAY_ON_TIMEOUT_X20MS;
+	return true;
+}
+
+/******************************************************************************
+** Function:	Append block to a write session's file
+**
+** Notes:		Returns false if can't. Reopens file at its end if the session was suspended.
+*/
+bool CFS_session_write(CFS_session_type * s, char * buffer, int bytes)
+{
+	if (bytes <= 0)
+		return true;
+
+	if (s->f == NULL)										// suspended
+	{
+		if (LOG_state == LOG_BATT_DEAD)
+			return false;
+
+		cfs_session_suspend();
+		s->f = CFS_open_file(s->path, s->filename, "a");
+		if (s->f == NULL)
+			return false;
+		cfs_session_owner = s;
+	}
+	else if (CFS_state != CFS_OPEN)
+		return false;
+
+	if (FSfwrite(buffer, bytes, 1, s->f) != 1)
+		return false;
+
+	s->pos += bytes;
+	CFS_timer_x20ms = CFS_STAY_ON_TIMEOUT_X20MS;			// leave file system powered up for a bit
+	return true;
+}
+
+/******************************************************************************
+** Function:	Get seek position of next session read
+**
+** Notes:
+*/
+long CFS_session_tell(CFS_session_type * s)
+{
+	return s->pos;
+}
+
+/******************************************************************************
+** Function:	End a read or write session
+**
+** Notes:		Closes file if open. Safe to call if already closed.
+*/
+void CFS_session_close(CFS_session_type * s)
+{
+	if (cfs_session_owner == s)
+		cfs_session_suspend();
+	if (cfs_line_owner == s)
+		cfs_line_owner = NULL;
+	s->f = NULL;
+}
+
+/******************************************************************************
+** Function:	Claim the shared second sector buffer
+**
+** Notes:		Returns the buffer, or NULL if the other owner has it - caller then single-buffers.
+**				USB file transfers & FTP upload seldom overlap, so one buffer serves both.
+*/
+char * CFS_block_claim(uint8 owner)
+{
+	if ((cfs_block_owner != CFS_BLOCK_FREE) && (cfs_block_owner != owner))
+		return NULL;
+	// else:
+
+	cfs_block_owner = owner;
+	return cfs_block_buffer;
+}
+
+/******************************************************************************
+** Function:	Give back the shared second sector buffer
+**
+** Notes:		Nothing happens if owner doesn't have it
+*/
+void CFS_block_release(uint8 owner)
+{
+	if (cfs_block_owner == owner)
+		cfs_block_owner = CFS_BLOCK_FREE;
+}
+
 /******************************************************************************
 ** Function:	Get a line of a file into a string
 **
@@ -588,7 +1051,7 @@ int CFS_read_line(char * path, char * filename, int n, char * buffer, int max_by
 	FSFILE *f;
 	int length;
 
-	f = cfs_open_file(path, filename, "r");
+	f = CFS_open_file(path, filename, "r");
 	if (f == NULL)
 	{
 		*buffer = '\0';
@@ -603,6 +1066,190 @@ int CFS_read_line(char * path, char * filename, int n, char * buffer, int max_by
 	return length;
 }
 
+/******************************************************************************
+** Function:	Compare file or path names, ignoring case
+**
+** Notes:
+*/
+bool cfs_name_match(const char * p, const char * q)
+{
+	while (toupper(*p) == toupper(*q))
+	{
+		if (*p == '\0')
+			return true;
+		p++;
+		q++;
+	}
+	return false;
+}
+
+/******************************************************************************
+** Function:	Free a small file cache entry & its cached lines
+**
+** Notes:
+*/
+void cfs_file_cache_free(uint8 file)
+{
+	uint8 i;
+
+	cfs_file_cache[file].filename[0] = '\0';
+	for (i = 0; i < CFS_LINE_CACHE_SIZE; i++)
+	{
+		if (cfs_line_cache[i].file == file)
+			cfs_line_cache[i].file = CFS_LINE_CACHE_FREE;
+	}
+}
+
+/******************************************************************************
+** Function:	Find file in small file cache, adding it if necessary
+**
+** Notes:		Returns index in cfs_file_cache[], or -1 if not cached & can't be - file system not ready or no file.
+**				An entry not checked against its directory entry since file system was powered up
+**				is used as it is if file system not open, else its lines are discarded if size or timestamp changed.
+*/
+int cfs_file_cache_get(char * path, char * filename)
+{
+	cfs_file_cache_type * p;
+	uint8 i;
+
+	if (*path == '\0')
+		path = "\\";
+
+	for (i = 0; i < CFS_FILE_CACHE_SIZE; i++)
+	{
+		if ((cfs_file_cache[i].filename[0] != '\0') && cfs_name_match(cfs_file_cache[i].filename, filename) &&
+			cfs_name_match(cfs_file_cache[i].path, path))
+			break;
+	}
+
+	if ((i < CFS_FILE_CACHE_SIZE) && (cfs_file_cache[i].verified || (CFS_state != CFS_OPEN)))
+		return i;
+	// else:
+
+	if ((CFS_state != CFS_OPEN) || !CFS_chdir(path, false) ||
+		(FindFirst(filename, ATTR_MASK & ~ATTR_DIRECTORY, &cfs_search_result) != 0))
+	{
+		if (i < CFS_FILE_CACHE_SIZE)
+			cfs_file_cache_free(i);								// file has gone
+		return -1;
+	}
+
+	if (i < CFS_FILE_CACHE_SIZE)
+	{
+		p = &cfs_file_cache[i];
+		if ((p->size == cfs_search_result.filesize) && (p->timestamp == cfs_search_result.timestamp))
+		{
+			p->verified = true;									// unchanged
+			return i;
+		}
+		cfs_file_cache_free(i);									// changed: reuse entry
+	}
+	else if ((strlen(path) >= CFS_FILE_CACHE_PATH_SIZE) || (strlen(filename) >= CFS_FILE_NAME_SIZE))
+		return -1;
+	else														// replace oldest entry
+	{
+		i = cfs_file_cache_next;
+		if (++cfs_file_cache_next >= CFS_FILE_CACHE_SIZE)
+			cfs_file_cache_next = 0;
+		cfs_file_cache_free(i);
+	}
+
+	p = &cfs_file_cache[i];
+	strcpy(p->path, path);
+	strcpy(p->filename, filename);
+	p->size = cfs_search_result.filesize;
+	p->timestamp = cfs_search_result.timestamp;
+	p->verified = true;
+	return i;
+}
+
+/******************************************************************************
+** Function:	Get a line of a small file into a string, from file cache if possible
+**
+** Notes:		As CFS_read_line(), for lookup files read repeatedly (units names etc.): returns -1 if no file,
+**				0 if line doesn't exist. Line truncated to max_bytes - 1 chars.
+**				Lines read with max_bytes up to CFS_LINE_CACHE_TEXT are kept in RAM, so the card need not be
+**				powered up to read them again. Others are read with CFS_read_line() every time.
+*/
+int CFS_cache_read_line(char * path, char * filename, int n, char * buffer, int max_bytes)
+{
+	int file, length;
+	uint8 i;
+
+	file = -1;
+	if ((max_bytes <= CFS_LINE_CACHE_TEXT) && (n >= 1) && (n <= 255))
+		file = cfs_file_cache_get(path, filename);
+	if (file < 0)
+		return CFS_read_line(path, filename, n, buffer, max_bytes);
+	// else:
+
+	for (i = 0; i < CFS_LINE_CACHE_SIZE; i++)
+	{
+		if ((cfs_line_cache[i].file == file) && (cfs_line_cache[i].n == n))
+			break;
+	}
+
+	if (i < CFS_LINE_CACHE_SIZE)
+		CFS_file_cache_hits++;
+	else														// read line into oldest entry
+	{
+		i = cfs_line_cache_next;
+		cfs_line_cache[i].file = CFS_LINE_CACHE_FREE;
+		length = CFS_read_line(path, filename, n, cfs_line_cache[i].text, CFS_LINE_CACHE_TEXT);
+		if (length < 0)
+		{
+			*buffer = '\0';
+			return length;
+		}
+		CFS_file_cache_misses++;
+		cfs_line_cache[i].file = file;
+		cfs_line_cache[i].n = n;
+		if (++cfs_line_cache_next >= CFS_LINE_CACHE_SIZE)
+			cfs_line_cache_next = 0;
+	}
+
+	strncpy(buffer, cfs_line_cache[i].text, max_bytes - 1);
+	buffer[max_bytes - 1] = '\0';
+	return strlen(buffer);
+}
+
+/******************************************************************************
+** Function:	Check if path is the alarm profiles directory
+**
+** Notes:		Ignores case & trailing '\'. Either '\' or '/' may separate.
+*/
+bool cfs_profiles_path(const char * path)
+{
+	const char * q = ALM_PROFILES_PATH;
+
+	while ((*q != '\0') && ((toupper(*path) == *q) || ((*path == '/') && (*q == '\\'))))
+	{
+		path++;
+		q++;
+	}
+	return (*path == '\0') && ((*q == '\0') || ((*q == '\\') && (q[1] == '\0')));
+}
+
+/******************************************************************************
+** Function:	Discard file from small file cache
+**
+** Notes:		Call when file written, removed or renamed. Matches filename in any directory.
+**				A file written in \PROFILES also frees alarm level tables, so it takes effect
+**				at the next timeslot rather than the next day.
+*/
+void CFS_cache_invalidate(char * path, char * filename)
+{
+	uint8 i;
+
+	for (i = 0; i < CFS_FILE_CACHE_SIZE; i++)
+	{
+		if (cfs_name_match(cfs_file_cache[i].filename, filename))
+			cfs_file_cache_free(i);
+	}
+	if (cfs_profiles_path(path))
+		ALM_update_profile();
+}
+
 /******************************************************************************
 ** Function:	Write contents of a buffer to a file
 **
@@ -621,7 +1268,7 @@ bool CFS_write_file(char * path, char * filename, char * mode, char * buffer, in
 	if (n_bytes == 0)
 		return true;
 
-	f = cfs_open_file(path, filename, mode);
+	f = CFS_open_file(path, filename, mode);
 	if (f == NULL)
 		return false;
 
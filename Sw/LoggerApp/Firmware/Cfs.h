@@ -40,6 +40,15 @@
 ** V4.06		MA	File system modifications for faster creation of new files and avoidance of file system corruption
 **
 ** V4.11 270814 PB  Add CFS_gps_name "GPS.TXT"
+**
+** V6.03 171026     Add CFS_chdir() with directory cache, CFS_dir_cache_clear() and cache statistics for #FSS
+**					Add CFS_session_type and CFS_session_xxx() functions for sequential block reads
+**					Add CFS_flush() to write back file system sector cache
+**					Add CFS_session_read_line()
+**					Add small file cache - CFS_cache_read_line(), CFS_cache_invalidate()
+**					Add CFS_session_create() & CFS_session_write() for write sessions
+**					Add CFS_block_claim() & CFS_block_release() for shared second sector buffer
+**					Add CFS_open_file(), which suspends an open session if too many files open
 */
 
 #include "MDD File System\FSDefs.h"
@@ -56,6 +65,21 @@
 #define CFS_OPEN			4
 #define CFS_FAILED			5
 
+// Sequential read or write session - see CFS_session_open() & CFS_session_create()
+typedef struct
+{
+	FSFILE *	f;							// open file, NULL if not open yet or suspended
+	char *		path;						// path & filename - must remain valid while session in use
+	char *		filename;
+	long		pos;						// seek position of next read
+} CFS_session_type;
+
+// Owners of the shared second sector buffer - see CFS_block_claim()
+#define CFS_BLOCK_FREE		0
+#define CFS_BLOCK_USB		1
+#define CFS_BLOCK_FTP		2
+#define CFS_BLOCK_BUFFER_SIZE	(512 + 1)	// sector & terminator
+
 extern uint8 CFS_state;
 extern uint8 CFS_first_assert;
 extern uint8 CFS_last_assert;
@@ -64,6 +88,13 @@ extern uint8 CFS_open_counter;
 
 extern int CFS_timer_x20ms;
 
+// Directory & small file cache statistics, reported by #FSS
+extern uint16 CFS_dir_cache_hits;				// CFS_chdir() calls satisfied from cache
+extern uint16 CFS_dir_cache_misses;				// CFS_chdir() calls which walked the path
+extern uint32 CFS_dir_cache_reads_saved;		// sector reads avoided by cache hits
+extern uint16 CFS_file_cache_hits;				// lookup file lines read from RAM
+extern uint16 CFS_file_cache_misses;			// lookup file lines read from card into RAM
+
 extern const char CFS_config_path[]
 #ifdef extern
 = "\\CONFIG"
@@ -215,18 +246,36 @@ extern const char CFS_gps_name[]
 ;
 
 bool CFS_file_exists(char * path, char * filename);
+bool CFS_chdir(char * path, bool create);
+void CFS_dir_cache_clear(void);
 bool CFS_open(void);
+void CFS_flush(void);
 void CFS_power_down(void);
 void CFS_init(void);
 void CFS_task(void);
 MEDIA_INFORMATION * CFS_sd_card_ready(void);
 
+FSFILE *CFS_open_file(char * path, char * filename, char *mode);
 void CFS_close_file(FSFILE *f);
 bool CFS_read_file(char * path, char * filename, char * buffer, int max_bytes);
 bool CFS_read_block(char * path, char * filename, char * buffer, long seek_pos, int bytes);
 int CFS_read_line(char * path, char * filename, int n, char * buffer, int max_bytes);
+int CFS_cache_read_line(char * path, char * filename, int n, char * buffer, int max_bytes);
+void CFS_cache_invalidate(char * path, char * filename);
 bool CFS_write_file(char * path, char * filename, char * mode, char * buffer, int n_bytes);
 
+void CFS_session_open(CFS_session_type * s, char * path, char * filename);
+int  CFS_session_read(CFS_session_type * s, char * buffer, int bytes);
+int  CFS_session_read_line(CFS_session_type * s, char * buffer, int max_bytes);
+bool CFS_session_seek(CFS_session_type * s, long pos);
+bool CFS_session_create(CFS_session_type * s, char * path, char * filename, long bytes);
+bool CFS_session_write(CFS_session_type * s, char * buffer, int bytes);
+long CFS_session_tell(CFS_session_type * s);
+void CFS_session_close(CFS_session_type * s);
+
+char * CFS_block_claim(uint8 owner);
+void CFS_block_release(uint8 owner);
+
 int CFS_find_youngest_file(char * path, char * result);
 int CFS_find_oldest_file(char * path, char * result);
 bool CFS_purge_oldest_file(char * path);
@@ -149,6 +149,22 @@
 ** V5.00 231014 PB  new undocumented command #rhr - read hardware revision bits - return value of bits set with pullups
 **					add hardware/software mismatch tests to cmd_li(), returning new CMD_ERR_INCOMPATIBLE_HARDWARE
 **					field 12 of cmd_li() reply - 'S' for RS485 and 'G' for GPS versions
+**
+** V6.03 171026     new undocumented command #LQS - log queue flush statistics
+**					new undocumented command #FSS - file system statistics (directory cache, sector reads)
+**					#FSS reply adds seek count, FAT links followed & FAT links skipped by seek index
+**					new undocumented command #FSC - file system sector cache statistics
+**					#FSC reply adds SD commands, sectors written & sectors transferred without a command
+**					#FSS reply adds free cluster count, FAT sectors skipped & FAT entries read finding free clusters
+**					new command #LBF - select channels logged to binary day files
+**					new command #LBC - convert binary day file to text day file
+**					#LQS reply adds queue & overflow ring high water marks and values lost
+**					units names read through small file cache, #FSS reply adds file cache hits & misses
+**					#FRD reply over USB adds bytes/s of previous USB file read
+**					new command #FAR - file archive read, streams a directory tree to USB
+**					new command #SYN - incremental sync of data logged since last acknowledged sync, to USB or FTP
+**					new command #FUP - fast USB upload of a file of known size, checked by CRC
+**					cmd_execute() searches command table by first letter, channel suffix grammar held in table
 */
 
 #include <string.h>
@@ -256,6 +272,20 @@ char *cmd_output[CMD_NUM_SOURCES];
 SearchRec cmd_srch;
 
 extern DISK gDiskData;
+extern DWORD gSectorReadCount;
+extern DWORD gSeekCount;
+extern DWORD gSeekClusterHops;
+extern DWORD gSeekClustersSkipped;
+extern DWORD gFreeClusterCount;
+extern DWORD gFreeMapSkips;
+extern DWORD gFreeScanReads;
+extern DWORD gSectorCacheHits;
+extern DWORD gSectorCacheMisses;
+extern DWORD gSectorCacheWrites;
+extern DWORD gSectorCacheWriteBacks;
+extern DWORD gSectorWriteCount;
+extern DWORD gSDCommandCount;
+extern DWORD gSDStreamSectors;
 
 #pragma region Command Table
 
@@ -264,6 +294,7 @@ typedef struct
 	const char *cmd;
 	void (*function)(void);
 	uint8 config_flags;
+	uint8 suffix;
 } cmd_action_type;
 
 // config flag values
@@ -273,6 +304,12 @@ typedef struct
 #define CMD_NO_ACTIVITY_LOG		_B00000100
 #define CMD_TSU					_B10000000
 
+// channel suffix grammar values
+#define CMD_SUFFIX_CHANNEL		0			// optional 1-digit channel number (default)
+#define CMD_SUFFIX_EVENT		1			// event sub-channel Dnx required
+#define CMD_SUFFIX_EVENT_D		2			// as CMD_SUFFIX_EVENT, but the D of Dnx is the last letter of the command (#ECD)
+#define CMD_SUFFIX_ALARM		3			// optional alarm sub-channel An, Dnx, DAn, DSn or Rnx
+
 // Command function prototypes:
 void cmd_abort(void);
 void cmd_abt(void);
@@ -320,21 +357,28 @@ void cmd_ecd(void);
 void cmd_echo(void);
 void cmd_eco(void);
 void cmd_fap(void);
+void cmd_far(void);
 void cmd_fas(void);
 void cmd_fdel(void);
 void cmd_frd(void);
 void cmd_frl(void);
 void cmd_fsh(void);
+void cmd_fss(void);
+void cmd_fsc(void);
 void cmd_ftpc(void);
 void cmd_ftx(void);
+void cmd_fup(void);
 void cmd_fwr(void);
 void cmd_fws(void);
 void cmd_gps(void);
 void cmd_idv(void);
 void cmd_imv(void);
 void cmd_isv(void);
+void cmd_lbc(void);
+void cmd_lbf(void);
 void cmd_li(void);
 void cmd_log(void);
+void cmd_lqs(void);
 void cmd_mkdir(void);
 void cmd_mps(void);
 void cmd_msg(void);
@@ -367,6 +411,7 @@ void cmd_sfp(void);
 void cmd_sigres(void);
 void cmd_sigtst(void);
 void cmd_smsc(void);
+void cmd_syn(void);
 void cmd_tc(void);
 void cmd_tod(void);
 void cmd_tot(void);
@@ -379,7 +424,11 @@ void cmd_frmw(void);
 void cmd_frmr(void);
 void cmd_mod(void);
 
-// third parameter is a flag to indicate whether command alters configuration:
+// third parameter is a flag to indicate whether command alters configuration,
+// fourth is the channel suffix grammar (CMD_SUFFIX_CHANNEL if omitted).
+// Entries must be grouped by first letter: cmd_execute() finds the group by binary search,
+// then takes the first prefix match within it, so a command which is a prefix of another
+// (e.g. #CM and #CMON) must follow it.
 const cmd_action_type cmd_action_table[] =
 {
 	{ "abort",	cmd_abort,	CMD_NON_CFG							},	// abort a test
@@ -389,23 +438,23 @@ const cmd_action_type cmd_action_table[] =
 	{ "aco",	cmd_aco,	CMD_VOLATILE						},	// automatic control output
 	{ "add",	cmd_add,	CMD_VOLATILE						},	// configure analog channel for depth to flow derived data
 	{ "adv",	cmd_adv,	CMD_NON_CFG | CMD_NO_ACTIVITY_LOG	},	// A to D values
-	{ "aeh1",	cmd_aeh1,	CMD_NON_VOLATILE					},	// alarm envelope high qtr day 1
-	{ "aeh2",	cmd_aeh2,	CMD_NON_VOLATILE					},	// alarm envelope high qtr day 2
-	{ "aeh3",	cmd_aeh3,	CMD_NON_VOLATILE					},	// alarm envelope high qtr day 3
-	{ "aeh4",	cmd_aeh4,	CMD_NON_VOLATILE					},	// alarm envelope high qtr day 4
-	{ "ael1",	cmd_ael1,	CMD_NON_VOLATILE					},	// alarm envelope low qtr day 1
-	{ "ael2",	cmd_ael2,	CMD_NON_VOLATILE					},	// alarm envelope low qtr day 2
-	{ "ael3",	cmd_ael3,	CMD_NON_VOLATILE					},	// alarm envelope low qtr day 3
-	{ "ael4",	cmd_ael4,	CMD_NON_VOLATILE					},	// alarm envelope low qtr day 4
-	{ "alm",	cmd_alm,	CMD_VOLATILE						},	// alarm channel config
-	{ "ap1",	cmd_ap1,	CMD_NON_VOLATILE					},	// alarm profile qtr day 1
-	{ "ap2",	cmd_ap2,	CMD_NON_VOLATILE					},	// alarm profile qtr day 2
-	{ "ap3",	cmd_ap3,	CMD_NON_VOLATILE					},	// alarm profile qtr day 3
-	{ "ap4",	cmd_ap4,	CMD_NON_VOLATILE					},	// alarm profile qtr day 4
+	{ "aeh1",	cmd_aeh1,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm envelope high qtr day 1
+	{ "aeh2",	cmd_aeh2,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm envelope high qtr day 2
+	{ "aeh3",	cmd_aeh3,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm envelope high qtr day 3
+	{ "aeh4",	cmd_aeh4,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm envelope high qtr day 4
+	{ "ael1",	cmd_ael1,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm envelope low qtr day 1
+	{ "ael2",	cmd_ael2,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm envelope low qtr day 2
+	{ "ael3",	cmd_ael3,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm envelope low qtr day 3
+	{ "ael4",	cmd_ael4,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm envelope low qtr day 4
+	{ "alm",	cmd_alm,	CMD_VOLATILE,		CMD_SUFFIX_ALARM	},	// alarm channel config
+	{ "ap1",	cmd_ap1,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm profile qtr day 1
+	{ "ap2",	cmd_ap2,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm profile qtr day 2
+	{ "ap3",	cmd_ap3,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm profile qtr day 3
+	{ "ap4",	cmd_ap4,	CMD_NON_VOLATILE,	CMD_SUFFIX_ALARM	},	// alarm profile qtr day 4
 	{ "at",		cmd_at,		CMD_NON_CFG							},	// pass AT command to modem, if it's on
 	{ "bv",		cmd_bv,		CMD_NON_CFG							},	// report battery volts as last measured for alarm
 	{ "calm",	cmd_calm,	CMD_VOLATILE						},	// enable/disable commission mode alarm
-	{ "cec",	cmd_cec,	CMD_VOLATILE						},	// configure event channel
+	{ "cec",	cmd_cec,	CMD_VOLATILE,		CMD_SUFFIX_EVENT	},	// configure event channel
 	{ "cfi",	cmd_cfi,	CMD_NON_CFG							},	// configure file invalid flags
 	{ "clrb",	cmd_clrb,	CMD_NON_CFG							},	// clear RAM bit
 	{ "cmoff",	cmd_cmoff,	CMD_VOLATILE						},	// commissioning mode off
@@ -424,26 +473,36 @@ const cmd_action_type cmd_action_table[] =
 	{ "dst",	cmd_dst,	CMD_VOLATILE						},  // configure doppler sensor temperature
 	{ "dsv",	cmd_dsv,	CMD_VOLATILE						},  // configure doppler sensor velocity
 	{ "dt",		cmd_dt,		CMD_NON_CFG							},	// date/time
-	{ "ecd",	cmd_ecd,	CMD_NON_VOLATILE					},	// event configure: set channel event header string
+	{ "ecd",	cmd_ecd,	CMD_NON_VOLATILE,	CMD_SUFFIX_EVENT_D	},	// event configure: set channel event header string
 	{ "echo",	cmd_echo,	CMD_NON_CFG | CMD_NO_ACTIVITY_LOG	},	// echo events on USB
 	{ "eco",	cmd_eco,	CMD_VOLATILE						},	// event trigger of control output
 	{ "fap",	cmd_fap,	CMD_NON_VOLATILE					},	// file append (USB only)
+	{ "far",	cmd_far,	CMD_NON_CFG	| CMD_NO_ACTIVITY_LOG	},	// file archive read (USB only)
 	{ "fas",	cmd_fas,	CMD_NON_VOLATILE					},	// file append string
 	{ "fdel",	cmd_fdel,	CMD_NON_CFG							},	// file delete
 	{ "frd",	cmd_frd,	CMD_NON_CFG	| CMD_NO_ACTIVITY_LOG	},	// file read
 	{ "frl",	cmd_frl,	CMD_NON_CFG | CMD_NO_ACTIVITY_LOG	},	// file read line
+	{ "frmr",	cmd_frmr,	CMD_NON_CFG							},	// fram read - undocumented
+	{ "frmw",	cmd_frmw,	CMD_NON_CFG,						},	// fram write - undocumented
+	{ "fsc",	cmd_fsc,	CMD_NON_CFG | CMD_NO_ACTIVITY_LOG	},	// file system sector cache statistics - undocumented
 	{ "fsh",	cmd_fsh,	CMD_NON_CFG							},	// file system health
+	{ "fss",	cmd_fss,	CMD_NON_CFG | CMD_NO_ACTIVITY_LOG	},	// file system statistics - undocumented
 	{ "ftpc",	cmd_ftpc,	CMD_NON_VOLATILE					},	// ftp configure; set ftplogon string contents
 	{ "ftx",	cmd_ftx,	CMD_NON_CFG							},	// send file to ftp server
+	{ "fup",	cmd_fup,	CMD_NON_VOLATILE					},	// file upload (USB only)
 	{ "fwr",	cmd_fwr,	CMD_NON_VOLATILE					},	// file write (USB only)
 	{ "fws",	cmd_fws,	CMD_NON_VOLATILE					},	// file write string
 	{ "gps",	cmd_gps,	CMD_NON_CFG							},	// gps control and read
 	{ "idv",	cmd_idv,	CMD_NON_CFG | CMD_NO_ACTIVITY_LOG	},	// immediate derived values
 	{ "imv",	cmd_imv,	CMD_NON_CFG | CMD_NO_ACTIVITY_LOG	},	// immediate values
 	{ "isv",	cmd_isv,	CMD_NON_CFG | CMD_NO_ACTIVITY_LOG	},	// immediate serial port values
+	{ "lbc",	cmd_lbc,	CMD_NON_CFG							},	// convert binary day file to text
+	{ "lbf",	cmd_lbf,	CMD_VOLATILE						},	// log binary format channel mask
 	{ "li",		cmd_li,		CMD_NON_CFG							},	// logger ID
 	{ "log",	cmd_log,	CMD_VOLATILE						},	// logging control
+	{ "lqs",	cmd_lqs,	CMD_NON_CFG | CMD_NO_ACTIVITY_LOG	},	// log queue statistics - undocumented
 	{ "mkdir",	cmd_mkdir,	CMD_NON_CFG							},	// make directory
+	{ "mod",	cmd_mod,	CMD_NON_CFG							},	// MODBUS test command
 	{ "mps",	cmd_mps,	CMD_VOLATILE						},	// modem power schedule
 	{ "msg",	cmd_msg,	CMD_NON_CFG							},	// test message
 	{ "name",	cmd_name,	CMD_VOLATILE						},	// sitename
@@ -475,17 +534,15 @@ const cmd_action_type cmd_action_table[] =
 	{ "sigres",	cmd_sigres,	CMD_NON_CFG							},	// signal test results
 	{ "sigtst",	cmd_sigtst,	CMD_NON_CFG							},	// signal test start
 	{ "smsc",	cmd_smsc,	CMD_VOLATILE						},	// SMS configuration
+	{ "syn",	cmd_syn,	CMD_NON_CFG	| CMD_NO_ACTIVITY_LOG	},	// incremental sync (USB or FTP)
 	{ "tc",		cmd_tc,		CMD_NON_CFG							},	// time change
+	{ "test",	cmd_test,	CMD_NON_CFG,						},	// test command - undocumented
 	{ "tod",	cmd_tod,	CMD_VOLATILE						},	// time of day config & readback
 	{ "tot",	cmd_tot,	CMD_NON_CFG							},	// totaliser config & readback
 	{ "tro",	cmd_tro,	CMD_NON_CFG							},	// trigger control output
 	{ "tstat",	cmd_tstat,	CMD_NON_CFG							},	// time sync report status
 	{ "tsu",	cmd_tsu,	CMD_NON_CFG							},	// transmit set up
-	{ "tsync",	cmd_tsync,	CMD_VOLATILE						},	// time sync - set and report protocol and step
-	{ "test",	cmd_test,	CMD_NON_CFG,						},	// test command - undocumented
-	{ "frmw",	cmd_frmw,	CMD_NON_CFG,						},	// fram write - undocumented
-	{ "frmr",	cmd_frmr,	CMD_NON_CFG							},	// fram read - undocumented
-	{ "mod",	cmd_mod,	CMD_NON_CFG							}	// MODBUS test command
+	{ "tsync",	cmd_tsync,	CMD_VOLATILE						}	// time sync - set and report protocol and step
 };
 
 #pragma endregion
@@ -2765,7 +2822,10 @@ void cmd_fdel(void)
 	else if (FSremove(cmd_filename_ptr) != 0)
 		cmd_error_code = CMD_ERR_FILE_DELETE_FAILED;
 	else
+	{
+		CFS_cache_invalidate(cmd_path, cmd_filename_ptr);
 		sprintf(cmd_out_ptr, "dFDEL=%s", STR_buffer);
+	}
 }
 
 /******************************************************************************
@@ -2806,7 +2866,10 @@ void cmd_frd(void)
 			i = sprintf(cmd_out_ptr, "dFRD=%s,%ld", STR_buffer, f->size);
 			// go do it
 			if (cmd_source_index == CMD_SOURCE_USB)
+			{
+				sprintf(&cmd_out_ptr[i], ",%lu", USB_read_rate);		// bytes/s of previous read
 				USB_transfer_file(cmd_path, cmd_filename_ptr, false);
+			}
 			else if (cmd_source_index == CMD_SOURCE_FTP)
 			{
 				CFS_close_file(f);												// close the file first
@@ -2878,6 +2941,38 @@ void cmd_fsh(void)
 			CFS_first_assert, CFS_last_assert, CFS_init_counter, CFS_open_counter, CFS_state);
 }
 
+/******************************************************************************
+** Function:	File system statistics command - undocumented
+**
+** Notes:		Reports directory cache hits, misses, sector reads saved by hits, total sector reads,
+**				FSfseek calls, FAT links followed by seeks, FAT links skipped by the seek index,
+**				free clusters (4294967295 if not known), full FAT sectors skipped & FAT entries read
+**				when looking for a free cluster, small file cache hits & misses
+*/
+void cmd_fss(void)
+{
+	sprintf(cmd_out_ptr, "dFSS=%u,%u,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%u,%u",
+		CFS_dir_cache_hits, CFS_dir_cache_misses, CFS_dir_cache_reads_saved, gSectorReadCount,
+		gSeekCount, gSeekClusterHops, gSeekClustersSkipped,
+		gFreeClusterCount, gFreeMapSkips, gFreeScanReads,
+		CFS_file_cache_hits, CFS_file_cache_misses);
+}
+
+/******************************************************************************
+** Function:	File system sector cache statistics command - undocumented
+**
+** Notes:		Reports cache read hits, read misses, sector writes by FSIO, sector writes from cache,
+**				then SD commands sent, sectors written to card & sectors sent or received in a
+**				multi-block transfer without a command. With sector reads from #FSS this gives
+**				commands per MB transferred.
+*/
+void cmd_fsc(void)
+{
+	sprintf(cmd_out_ptr, "dFSC=%lu,%lu,%lu,%lu,%lu,%lu,%lu",
+		gSectorCacheHits, gSectorCacheMisses, gSectorCacheWrites, gSectorCacheWriteBacks,
+		gSDCommandCount, gSectorWriteCount, gSDStreamSectors);
+}
+
 /******************************************************************************
 ** Function:	Write string or input buffer to file
 **
@@ -2954,6 +3049,67 @@ void cmd_fap(void)
 	cmd_file_write("a", false);
 }
 
+/******************************************************************************
+** Function:	Convert bcd date to FAT directory entry date
+**
+** Notes:		Bits 9-15 years since 1980, bits 5-8 month, bits 0-4 day
+*/
+uint16 cmd_fat_date(uint8 dd_bcd, uint8 mm_bcd, uint8 yy_bcd)
+{
+	return ((uint16)(((yy_bcd >> 4) * 10) + (yy_bcd & 0x0F) + 20) << 9) |
+		   ((uint16)(((mm_bcd >> 4) * 10) + (mm_bcd & 0x0F)) << 5) |
+		   (uint16)(((dd_bcd >> 4) * 10) + (dd_bcd & 0x0F));
+}
+
+/******************************************************************************
+** Function:	File archive read - stream every file in a directory tree to USB
+**
+** Notes:		#FAR=path,from date,to date. Dates optional, ddmmyy, select files by last modified date.
+**				Each file goes as a header line "path,size,dd/mm/yy,hh:mm:ss\r\n" then exactly size bytes.
+**				'\0' after the last file ends the stream.
+*/
+void cmd_far(void)
+{
+	uint8 dd, mm, yy;
+	uint16 from_date, to_date;
+
+	if (cmd_source_index != CMD_SOURCE_USB)
+	{
+		cmd_error_code = CMD_ERR_REQUIRES_USB;
+		return;
+	}
+
+	if (!cmd_equals)								// assume root directory
+	{
+		cmd_path[0] = '\\';
+		cmd_path[1] = '\0';
+		cmd_filename_ptr = &cmd_path[1];
+	}
+	else
+		cmd_parse_path();							// last part of path is the directory
+
+	from_date = 0;
+	to_date = 0xFFFF;
+	if (cmd_set_date_bcd(&dd, &mm, &yy))
+		from_date = cmd_fat_date(dd, mm, yy);
+	if (cmd_set_date_bcd(&dd, &mm, &yy))
+		to_date = cmd_fat_date(dd, mm, yy);
+	if (cmd_error_code != CMD_ERR_NONE)
+		return;
+
+	(void)CFS_open();
+	if ((CFS_state != CFS_OPEN) || (FSchdir(cmd_path) != 0) ||
+		((*cmd_filename_ptr != '\0') && (FSchdir(cmd_filename_ptr) != 0)))
+	{
+		cmd_error_code = CMD_ERR_INVALID_WORKING_DIRECTORY;
+		return;
+	}
+
+	cmd_get_full_path();							// get full path in STR_buffer
+	sprintf(cmd_out_ptr, "dFAR=%s", STR_buffer);
+	USB_archive(STR_buffer, from_date, to_date);
+}
+
 /******************************************************************************
 ** Function:	Append string to file
 **
@@ -3104,6 +3260,58 @@ void cmd_ftx(void)
 	}
 }
 
+/******************************************************************************
+** Function:	Fast upload of a file from USB
+**
+** Notes:		#FUP=path\filename,size,crc - crc optional, 4 hex digits CRC-16 (MODBUS) of the data.
+**				Host then sends exactly size bytes in 64-byte packets, only the last one short.
+**				Binary safe - no '\0' terminator. A zero-length packet aborts.
+**				File is removed if incomplete or crc doesn't match. #FUP reports last upload as bytes,crc.
+*/
+void cmd_fup(void)
+{
+	uint32 size;
+	uint16 crc;
+	bool check_crc;
+
+	if (cmd_source_index != CMD_SOURCE_USB)
+	{
+		cmd_error_code = CMD_ERR_REQUIRES_USB;
+		return;
+	}
+
+	if (!cmd_equals)											// report last upload
+	{
+		if (!USB_upload_ok)
+			cmd_error_code = CMD_ERR_FILE_WRITE_FAILED;
+		else
+			sprintf(cmd_out_ptr, "dFUP=%lu,%04X", USB_upload_bytes, USB_upload_crc);
+		return;
+	}
+
+	cmd_parse_path();
+	if (!cmd_set_uint32(&size) || (size == 0))
+	{
+		cmd_error_code = CMD_ERR_INVALID_VALUE;
+		return;
+	}
+	crc = 0;
+	check_crc = cmd_set_hex(&crc);
+	if (cmd_error_code != CMD_ERR_NONE)
+		return;
+
+	(void)CFS_open();
+	if (CFS_state != CFS_OPEN)
+		cmd_error_code = CMD_ERR_FILE_OR_DIRECTORY_NOT_FOUND;
+	else if (!USB_upload(cmd_path, cmd_filename_ptr, size, crc, check_crc))
+		cmd_error_code = CMD_ERR_FILE_WRITE_FAILED;
+	else
+	{
+		cmd_get_full_path();
+		sprintf(cmd_out_ptr, "dFUP=%s,%lu", STR_buffer, size);
+	}
+}
+
 /******************************************************************************
 ** Function:	Write USB input to file
 **
@@ -3386,6 +3594,63 @@ void cmd_isv(void)
 #endif
 }
 
+/******************************************************************************
+** Function:	Convert binary day file to text
+**
+** Notes:		#LBC=<path>\<filename>.BIN writes <filename>.TXT in the same directory.
+**				Reply gives the number of records converted.
+*/
+void cmd_lbc(void)
+{
+#ifndef LOG_BINARY_RECORDS
+	cmd_error_code = CMD_ERR_UNRECOGNISED_COMMAND;
+#else
+	int32 count;
+
+	if (!cmd_equals)
+	{
+		cmd_error_code = CMD_ERR_NO_PARAMETERS;
+		return;
+	}
+
+	cmd_parse_path();
+
+	(void)CFS_open();				// keep file system awake
+	if (CFS_state != CFS_OPEN)
+	{
+		cmd_error_code = CMD_ERR_FILE_OR_DIRECTORY_NOT_FOUND;
+		return;
+	}
+
+	count = LOG_binary_to_text((cmd_path[0] == '\0') ? "\\" : cmd_path, cmd_filename_ptr);
+	if (count < 0)
+		cmd_error_code = CMD_ERR_FILE_OR_DIRECTORY_NOT_FOUND;
+	else
+	{
+		cmd_get_full_path();
+		sprintf(cmd_out_ptr, "dLBC=%s,%ld", STR_buffer, count);
+	}
+#endif
+}
+
+/******************************************************************************
+** Function:	Select channels logged to binary day files
+**
+** Notes:		#LBF=<hex mask>, bit n set for channel index n. Activity, event & SMS data always text.
+*/
+void cmd_lbf(void)
+{
+#ifndef LOG_BINARY_RECORDS
+	cmd_error_code = CMD_ERR_UNRECOGNISED_COMMAND;
+#else
+	if (cmd_equals)
+		cmd_set_hex(&LOG_binary_mask);
+
+	if (cmd_error_code == CMD_ERR_NONE)
+		sprintf(cmd_out_ptr, "dLBF=%04X", LOG_binary_mask);
+#endif
+}
+
 /******************************************************************************
 ** Function:	#LI
 **
@@ -3542,6 +3807,18 @@ void cmd_log(void)
 			LOG_config.min_space_remaining);
 }
 
+/******************************************************************************
+** Function:	Log queue statistics command - undocumented
+**
+** Notes:		Reports flushes started, queue entries examined and files appended by the last flush,
+**				then most entries in log queue, most in overflow ring and values lost since reset
+*/
+void cmd_lqs(void)
+{
+	sprintf(cmd_out_ptr, "dLQS=%u,%u,%u,%u,%u,%u", LOG_flush_count, LOG_flush_scan_count, LOG_flush_file_count,
+		LOG_queue_high_water, LOG_spill_high_water, LOG_values_lost);
+}
+
 /******************************************************************************
 ** Function:	Make directory
 **
@@ -4217,7 +4494,7 @@ void cmd_rda(void)
 				{
 					j += sprintf(&cmd_out_ptr[j], "%s=", LOG_channel_id[i + LOG_ANALOGUE_1_INDEX]);
 					j += STR_print_float(&cmd_out_ptr[j], cmd_get_print_value(ANA_channel[i].sample_value));
-					CFS_read_line("\\Config", "Units.txt", ANA_config[i].units_index + 1, STR_buffer, 8);
+					CFS_cache_read_line("\\Config", "Units.txt", ANA_config[i].units_index + 1, STR_buffer, 8);
 					j += sprintf(&cmd_out_ptr[j], "%s,", STR_buffer);
 				}
 				else
@@ -4259,7 +4536,7 @@ void cmd_rda(void)
 				{
 					j += sprintf(&cmd_out_ptr[j], "%s=", LOG_channel_id[i + LOG_ANALOGUE_1_INDEX]);
 					j += STR_print_float(&cmd_out_ptr[j], cmd_get_print_value(ANA_channel[i].sample_value));
-					CFS_read_line("\\Config", "Units.txt", ANA_config[i].units_index + 1, STR_buffer, 8);
+					CFS_cache_read_line("\\Config", "Units.txt", ANA_config[i].units_index + 1, STR_buffer, 8);
 					j += sprintf(&cmd_out_ptr[j], "%s,", STR_buffer);
 				}
 				else
@@ -4315,7 +4592,7 @@ void cmd_rda(void)
 				{
 					j += sprintf(&cmd_out_ptr[j], "%s=", LOG_channel_id[i + LOG_ANALOGUE_1_INDEX + 11]);
 					j += STR_print_float(&cmd_out_ptr[j], cmd_get_print_value(ANA_channel[i].derived_sample_value));
-					CFS_read_line("\\Config", "Units.txt", ANA_config[i].derived_units_index + 1, STR_buffer, 8);
+					CFS_cache_read_line("\\Config", "Units.txt", ANA_config[i].derived_units_index + 1, STR_buffer, 8);
 					j += sprintf(&cmd_out_ptr[j], "%s,", STR_buffer);
 				}
 				else
@@ -4357,7 +4634,7 @@ void cmd_rda(void)
 				{
 					j += sprintf(&cmd_out_ptr[j], "%s=", LOG_channel_id[i + LOG_ANALOGUE_1_INDEX + 11]);
 					j += STR_print_float(&cmd_out_ptr[j], cmd_get_print_value(ANA_channel[i].derived_sample_value));
-					CFS_read_line("\\Config", "Units.txt", ANA_config[i].derived_units_index + 1, STR_buffer, 8);
+					CFS_cache_read_line("\\Config", "Units.txt", ANA_config[i].derived_units_index + 1, STR_buffer, 8);
 					j += sprintf(&cmd_out_ptr[j], "%s,", STR_buffer);
 				}
 				else
@@ -4383,7 +4660,7 @@ void cmd_rda(void)
 			{
 				j += sprintf(&cmd_out_ptr[j], "%s=", LOG_channel_id[1]);
 				j += STR_print_float(&cmd_out_ptr[j], cmd_get_print_value(DOP_channel.velocity_value));
-				CFS_read_line("\\Config", "Units.txt", DOP_config.velocity_units_index + 1, STR_buffer, 8);
+				CFS_cache_read_line("\\Config", "Units.txt", DOP_config.velocity_units_index + 1, STR_buffer, 8);
 				j += sprintf(&cmd_out_ptr[j], "%s,", STR_buffer);
 			}
 			else
@@ -4392,7 +4669,7 @@ void cmd_rda(void)
 			{
 				j += sprintf(&cmd_out_ptr[j], "%s=", LOG_channel_id[2]);
 				j += STR_print_float(&cmd_out_ptr[j], cmd_get_print_value(DOP_channel.temperature_value));
-				CFS_read_line("\\Config", "Units.txt", DOP_config.temperature_units_index + 1, STR_buffer, 8);
+				CFS_cache_read_line("\\Config", "Units.txt", DOP_config.temperature_units_index + 1, STR_buffer, 8);
 				j += sprintf(&cmd_out_ptr[j], "%s,", STR_buffer);
 			}
 			else
@@ -4401,7 +4678,7 @@ void cmd_rda(void)
 			{
 				j += sprintf(&cmd_out_ptr[j], "%s=", LOG_channel_id[3]);
 				j += STR_print_float(&cmd_out_ptr[j], cmd_get_print_value(DOP_channel.depth_value));
-				CFS_read_line("\\Config", "Units.txt", DOP_config.depth_units_index + 1, STR_buffer, 8);
+				CFS_cache_read_line("\\Config", "Units.txt", DOP_config.depth_units_index + 1, STR_buffer, 8);
 				j += sprintf(&cmd_out_ptr[j], "%s", STR_buffer);
 			}
 		}
@@ -4421,7 +4698,7 @@ void cmd_rda(void)
 			{
 				j += sprintf(&cmd_out_ptr[j], "%s=", LOG_channel_id[12]);
 				j += STR_print_float(&cmd_out_ptr[j], cmd_get_print_value(DOP_channel.derived_flow_value));
-				CFS_read_line("\\Config", "Units.txt", DOP_config.flow_units_index + 1, STR_buffer, 8);
+				CFS_cache_read_line("\\Config", "Units.txt", DOP_config.flow_units_index + 1, STR_buffer, 8);
 				j += sprintf(&cmd_out_ptr[j], "%s", STR_buffer);
 			}
 		}
@@ -4794,6 +5071,66 @@ void cmd_smsc(void)
 	}
 }
 
+/******************************************************************************
+** Function:	Incremental sync - send data logged since the client's watermarks
+**
+** Notes:		#SYN sends what has been added to each channel's day files since the last acknowledged sync
+**				by the requesting client, USB or FTP. #SYN=ddmmyy starts from the beginning of that date's files.
+**				Each day file goes as a header line "path\name,offset,length\r\n" then length bytes. '\0' ends.
+**				USB gets the stream after the reply, FTP gets it as uploaded file SYNCDATA.TXT.
+**				#SYN=ACK moves the client's watermarks to the end of the last stream it was sent.
+*/
+void cmd_syn(void)
+{
+	RTC_type date;
+	uint8 client;
+
+	if (cmd_source_index == CMD_SOURCE_USB)
+		client = FTP_SYNC_USB;
+	else if (cmd_source_index == CMD_SOURCE_FTP)
+		client = FTP_SYNC_FTP;
+	else
+	{
+		cmd_error_code = CMD_ERR_INVALID_DESTINATION;
+		return;
+	}
+
+	if (FTP_sync_busy())
+	{
+		cmd_error_code = CMD_ERR_SYNC_IN_PROGRESS;
+		return;
+	}
+
+	if (cmd_equals && STR_match(cmd_input_ptr, "ack"))
+	{
+		if (!FTP_sync_ack(client))
+			cmd_error_code = CMD_ERR_INVALID_VALUE;
+		else
+			sprintf(cmd_out_ptr, "dSYN=ACK");
+		return;
+	}
+
+	date.reg32[1] = 0;
+	if (cmd_equals && !cmd_set_date_bcd(&date.day_bcd, &date.mth_bcd, &date.yr_bcd))
+	{
+		if (cmd_error_code == CMD_ERR_NONE)
+			cmd_error_code = CMD_ERR_INVALID_DATE;
+		return;
+	}
+
+	sprintf(cmd_out_ptr, "dSYN");
+	if (client == FTP_SYNC_FTP)
+		FTP_sync_send((date.reg32[1] == 0) ? NULL : &date);
+	else
+	{
+		LOG_flush();
+		if (FTP_sync_start(FTP_SYNC_USB, (date.reg32[1] == 0) ? NULL : &date))
+			USB_sync();
+		else
+			cmd_error_code = CMD_ERR_FILE_OR_DIRECTORY_NOT_FOUND;
+	}
+}
+
 /******************************************************************************
 ** Function:	#tc
 **
@@ -5188,14 +5525,28 @@ void cmd_tsync(void)
 /******************************************************************************
 ** Function:	Execute command pointed to by cmd_input_ptr
 **
-** Notes:
+** Notes:		Binary search for the group of commands with the same first letter,
+**				then first prefix match within the group
 */
 void cmd_execute(void)
 {
-	int i;
+	int i, lo, hi;
+	char c;
 
 	cmd_command_string = cmd_input_ptr;
-	for (i = 0; i < sizeof(cmd_action_table) / sizeof(cmd_action_table[0]); i++)
+	c = *cmd_input_ptr | _B00100000;																	// table names are lower case
+	lo = 0;
+	hi = sizeof(cmd_action_table) / sizeof(cmd_action_table[0]);
+	while (lo < hi)
+	{
+		i = (lo + hi) >> 1;
+		if (cmd_action_table[i].cmd[0] < c)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	for (i = lo; (i < sizeof(cmd_action_table) / sizeof(cmd_action_table[0])) && (cmd_action_table[i].cmd[0] == c); i++)
 	{
 		if (STR_match(cmd_input_ptr, cmd_action_table[i].cmd))
 		{
@@ -5206,10 +5557,9 @@ void cmd_execute(void)
 																										// Default is channel 1, which is index 0.
 			cmd_channel_index = 0;
 																										// if #EC or #CEC allow sub-channel Dnx only
-			if ((cmd_action_table[i].function == cmd_ecd) || 
-				(cmd_action_table[i].function == cmd_cec))
+			if ((cmd_action_table[i].suffix == CMD_SUFFIX_EVENT) || (cmd_action_table[i].suffix == CMD_SUFFIX_EVENT_D))
 			{
-				if (cmd_action_table[i].function == cmd_ecd)											// if #ECD decrement input pointer to point at D of Dnx
+				if (cmd_action_table[i].suffix == CMD_SUFFIX_EVENT_D)									// if #ECD decrement input pointer to point at D of Dnx
 					 cmd_input_ptr--;
 				if ((*cmd_input_ptr | _B00100000) == 'd')
 				{
@@ -5232,9 +5582,7 @@ void cmd_execute(void)
 					return;
 				}
 			}
-			else if ((cmd_action_table[i].function == cmd_alm) || 
-				((cmd_action_table[i].cmd[0] == 'a') &&
-				 (((cmd_action_table[i].cmd[1] == 'e') || (cmd_action_table[i].cmd[1] == 'p')))))
+			else if (cmd_action_table[i].suffix == CMD_SUFFIX_ALARM)
 			{
 				// #ALM, #AEH, #AEL or #AP allow sub-channel An or Dnx, and derived channels DDnx and DAn
 				switch (*cmd_input_ptr | _B00100000)													// Exit from this switch pointing to the '=' or end of string
@@ -5338,7 +5686,7 @@ void cmd_execute(void)
 					break;
 #endif
 				case '=':																				// assume D1A unless EC or CEC
-					if ((cmd_action_table[i].function == cmd_ecd) || (cmd_action_table[i].function == cmd_cec))
+					if ((cmd_action_table[i].suffix == CMD_SUFFIX_EVENT) || (cmd_action_table[i].suffix == CMD_SUFFIX_EVENT_D))
 					{
 						cmd_error_code = CMD_ERR_INVALID_CHANNEL_NUMBER;
 						*cmd_input_ptr = '\0';															// string terminate cmd_command_string
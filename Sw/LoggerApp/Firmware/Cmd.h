@@ -16,6 +16,8 @@
 ** V4.00 220114 PB if HDW_GPS disable all analogue calls and functions
 **
 ** V5.00 231014 PB new CMD_ERR_INCOMPATIBLE_HARDWARE
+**
+** V6.03 171026    new CMD_ERR_SYNC_IN_PROGRESS
 */
 
 #include "HardwareProfile.h"				// Needed to determine command character
@@ -58,6 +60,7 @@
 #define CMD_ERR_SERIAL_COMMS_FAIL			26
 #define CMD_ERR_NIVUS_BUSY					27
 #define CMD_ERR_INCOMPATIBLE_HARDWARE		28
+#define CMD_ERR_SYNC_IN_PROGRESS			29
 #define CMD_ERR_INTERNAL					255
 
 // Pending command flags:
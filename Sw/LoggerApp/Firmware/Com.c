@@ -124,6 +124,13 @@
 ** V3.31 131113 PB  reposition com_day_bcd = RTC_now.day_bcd at end of COM_task and in COM_init
 **
 ** V3.32 201113 PB  return com_day_bcd = RTC_now.day_bcd to com_new_day_task()
+**
+** V6.03 171026     FTP file and data transmission read blocks through a CFS session - file stays open between blocks
+**					SMS messages queued while the modem is on are sent back to back without the 1s wait before each
+**					FTP upload double-buffered: next block read from SD while current block goes out, and only the first
+**					block of a file waits before tx. Block size set by modem type.
+**					Second FTP upload buffer is the CFS shared sector buffer - if a USB transfer has it, blocks are
+**					read into MDM_tx_buffer once the previous block has gone
 */
 
 #include "custom.h"
@@ -155,6 +162,7 @@
 #undef extern
 
 #define COM_NO_CARRIER_TIMEOUT_X20MS	(60 * 50)
+#define COM_BATCH_DELAY_X20MS			5			// delay before next sms of a batch, modem already signed on
 
 #ifndef HDW_PRIMELOG_PLUS
 // States:
@@ -235,7 +243,12 @@
 // Gap
 #define COM_SD_CARD_FAILED		100
 
-#define COM_FTP_FILE_BLOCK_SIZE	512
+// FTP upload block size: each block is read from SD while the previous one is transmitted
+#ifdef HDW_MODEM_GE864
+#define COM_FTP_FILE_BLOCK_SIZE	256			// 19200 baud - 133ms to send a block, longer than reading the next
+#else
+#define COM_FTP_FILE_BLOCK_SIZE	512			// 115200 baud - fewer, larger blocks. No more than MDM_tx_buffer
+#endif
 
 // COM_sign_on_status values
 #define COM_STATUS_NO_UPDATE		0
@@ -285,7 +298,8 @@ int com_msg_body_index;				// points to current position in tx message body duri
 
 uint16 com_ftp_sequence;
 
-unsigned long com_ftp_block_size;
+unsigned long com_ftp_block_size;			// size of block in com_ftp_fill_ptr, 0 if no more
+uint16 com_ftp_block_count;					// blocks of current file sent
 unsigned long com_ftp_file_seek_pos;
 unsigned long com_ftp_file_end_pos;
 unsigned long com_ftp_bytes_sent;
@@ -305,6 +319,9 @@ struct
 } com_time;
 
 FAR	char com_ftp_path[32];
+FAR CFS_session_type com_ftp_session;		// read session on file being sent by FTP
+char * com_ftp_buffer;						// ftp upload blocks alternate between this & MDM_tx_buffer, NULL if single-buffered
+char * com_ftp_fill_ptr;					// buffer next block is read into
 FAR char com_server_filename[128];
 
 FAR RTC_type com_ftp_timestamp;
@@ -550,6 +567,80 @@ void com_finished(void)
 	com_sms_rx_second_shot = false;										// clear second shot flag
 }
 
+/******************************************************************************
+** Function:	Open a file to be sent by ftp, and set up double buffering of its blocks
+**
+** Notes:		First block goes into com_ftp_buffer, as MDM_tx_buffer may be sending a block header.
+**				If the shared second buffer is in use by USB, all blocks go into MDM_tx_buffer.
+*/
+void com_ftp_open_file(char * path, char * filename)
+{
+	CFS_session_open(&com_ftp_session, path, filename);
+	com_ftp_buffer = CFS_block_claim(CFS_BLOCK_FTP);
+	com_ftp_fill_ptr = (com_ftp_buffer != NULL) ? com_ftp_buffer : MDM_tx_buffer;
+	com_ftp_block_ready = false;
+	com_ftp_block_count = 0;
+}
+
+/******************************************************************************
+** Function:	Check if next block of file being sent by ftp can be read
+**
+** Notes:		Not while it would overwrite the block being transmitted, when single-buffered
+*/
+bool com_ftp_fill_free(void)
+{
+	return (com_ftp_buffer != NULL) || (MDM_tx_ptr == NULL);
+}
+
+/******************************************************************************
+** Function:	Read next block of file being sent by ftp into the buffer not being transmitted
+**
+** Notes:		Sets com_ftp_block_size to size read, 0 if no more (end pos and seek pos are inclusive)
+*/
+void com_ftp_read_block(void)
+{
+	com_ftp_block_size = 0;
+	if (com_ftp_file_end_pos >= com_ftp_file_seek_pos)
+	{
+		com_ftp_block_size = com_ftp_file_end_pos - com_ftp_file_seek_pos + 1;
+		// limit size of block to get
+		if (com_ftp_block_size > COM_FTP_FILE_BLOCK_SIZE)
+			com_ftp_block_size = COM_FTP_FILE_BLOCK_SIZE;
+	}
+	// if get a block or part of a block successfully
+	if ((com_ftp_block_size != 0) && CFS_session_seek(&com_ftp_session, com_ftp_file_seek_pos) &&
+		(CFS_session_read(&com_ftp_session, com_ftp_fill_ptr, com_ftp_block_size) > 0))
+	{
+		com_ftp_fill_ptr[com_ftp_block_size] = '\0';	// terminate block (partial block will be terminated with eof '\0')
+		com_ftp_file_seek_pos += com_ftp_block_size;	// next block
+	}
+	else
+		com_ftp_block_size = 0;
+	com_ftp_block_ready = true;
+}
+
+/******************************************************************************
+** Function:	Send block read by com_ftp_read_block() and swap buffers
+**
+** Notes:		First block of a file waits 500ms after CONNECT or block header. Later blocks
+**				follow straight on.
+*/
+void com_ftp_send_block(void)
+{
+	if (com_ftp_block_count++ == 0)
+	{
+		MDM_tx_delay_timer_x20ms = 25;					// wait 500ms
+		MDM_send_cmd(com_ftp_fill_ptr);
+		MDM_retry_ptr = NULL;							// only 1 attempt
+	}
+	else
+		MDM_send_data(com_ftp_fill_ptr);
+
+	if (com_ftp_buffer != NULL)
+		com_ftp_fill_ptr = (com_ftp_fill_ptr == com_ftp_buffer) ? MDM_tx_buffer : com_ftp_buffer;
+	com_ftp_block_ready = false;
+}
+
 /******************************************************************************
 ** Function:	Start reading the SMS in the next slot
 **
@@ -1474,6 +1565,7 @@ void COM_task(void)
 {
 #ifndef HDW_PRIMELOG_PLUS
 	bool   derived;
+	bool   batch;
 	char * cptr;
 	char * dptr;
 #ifndef HDW_RS485
@@ -1505,6 +1597,12 @@ void COM_task(void)
 
 	COM_schedule_control();
 
+	if ((com_ftp_buffer != NULL) && ((com_state < COM_TX_FTP_3) || (com_state > COM_TX_FTP_DATA_MDM)))
+	{
+		CFS_block_release(CFS_BLOCK_FTP);	// ftp upload over - free shared buffer for USB
+		com_ftp_buffer = NULL;
+	}
+
 	switch(com_state)
 	{
 	case COM_IDLE:							// can sleep in this state
@@ -1548,6 +1646,9 @@ void COM_task(void)
 		if (!CFS_open())																	// stay here until file system is open
 			break;
 
+		batch = com_sms_batch && (MDM_state == MDM_ON);										// last sms went and modem still on
+		com_sms_batch = false;
+
 		LOG_flush();																		// ensure files of logged data are up to date
 		if (com_pending_ftp_tx)
 		{
@@ -1573,7 +1674,7 @@ void COM_task(void)
 				if (!MSG_get_message_to_tx(SMS_OUTBOX))										// get next sms message
 					com_state = COM_IDLE;													// if no file system, we haven't got a logger!
 				{
-					MDM_cmd_timer_x20ms = 50;												// transmit it - 1s delay before tx
+					MDM_cmd_timer_x20ms = batch ? COM_BATCH_DELAY_X20MS : 50;				// transmit it - 1s delay before tx unless batching
 					com_state = COM_TX_WAIT;
 				}
 				break;
@@ -1734,6 +1835,7 @@ void COM_task(void)
 
 					com_log_error((uint16)__LINE__, COM_STATUS_NO_UPDATE);	// SMS success
 					MDM_tx_delay_timer_x20ms = 25;		// tx delay of 500ms
+					com_sms_batch = true;				// send any more straight away
 					com_finished();
 				}
 				else
@@ -2189,6 +2291,7 @@ void COM_task(void)
 				}
 				else
 				{
+					com_ftp_open_file(com_ftp_path, COM_ftp_filename);
 					MDM_cmd_timer_x20ms = 1 * 50;	// 1s delay
 					com_state = COM_TX_FTP_5;
 				}
@@ -2243,11 +2346,15 @@ void COM_task(void)
 		break;
 
 	case COM_TX_FTP_MDM_WAIT:
-		// wait for modem tx buffer to be empty
-		if (MDM_tx_ptr == NULL)
+		// read next block while modem transmits this one, then wait for modem tx buffer to be empty
+		if (!com_ftp_block_ready)
 		{
-			// then set a small delay
-			MDM_cmd_timer_x20ms = 10;						// 200s timeout
+			if (com_ftp_fill_free())
+				com_ftp_read_block();
+		}
+		else if (MDM_tx_ptr == NULL)
+		{
+			MDM_cmd_timer_x20ms = 0;						// send next block straight away
 			com_state = COM_TX_FTP_5;
 		}
 		break;
@@ -2256,29 +2363,21 @@ void COM_task(void)
 		// getting file contents
 		if (MDM_cmd_timer_x20ms == 0)
 		{
-			com_ftp_block_size = 0;
-			// check if any more to get (end pos and seek pos are inclusive)
-			if (com_ftp_file_end_pos >= com_ftp_file_seek_pos)
+			if (!com_ftp_block_ready)						// first block
 			{
-				com_ftp_block_size = com_ftp_file_end_pos - com_ftp_file_seek_pos + 1;
-				// limit size of block to get
-				if (com_ftp_block_size > COM_FTP_FILE_BLOCK_SIZE)
-				{
-					com_ftp_block_size = COM_FTP_FILE_BLOCK_SIZE;
-				}
+				if (!com_ftp_fill_free())
+					break;
+				com_ftp_read_block();
 			}
-			// if get a block or part of a block successfully
-			if (CFS_read_block(com_ftp_path, COM_ftp_filename, MDM_tx_buffer, com_ftp_file_seek_pos, com_ftp_block_size) == true)
+			// if got a block or part of a block
+			if (com_ftp_block_size != 0)
 			{
-				MDM_tx_buffer[com_ftp_block_size] = '\0';		// terminate block (partial block will be terminated with eof '\0')
-				MDM_tx_delay_timer_x20ms = 25;					// wait 500ms
-				MDM_send_cmd(MDM_tx_buffer);
-				MDM_retry_ptr = NULL;							// only 1 attempt
-				com_ftp_file_seek_pos += com_ftp_block_size;	// next block
+				com_ftp_send_block();
 				com_state = COM_TX_FTP_MDM_WAIT;				// go and wait for modem tx buffer to empty
 			}
 			else	// no more blocks in file
 			{
+				CFS_session_close(&com_ftp_session);
 				// complete tx
 				MDM_cmd_timer_x20ms = 50;		// 1s delay
 				com_state = COM_TX_FTP_6;
@@ -2303,6 +2402,7 @@ void COM_task(void)
 				// if it exists (double check)
 				if (com_ftp_file_end_pos > 0)
 				{
+					com_ftp_open_file(FTP_path_str, FTP_filename_str);
 					// set FTP_MDM state
 					com_state = COM_TX_FTP_DATA_MDM;
 					break;
@@ -2353,6 +2453,7 @@ void COM_task(void)
 				// if it exists (double check)
 				if (com_ftp_file_end_pos > 0)
 				{
+					com_ftp_open_file(FTP_path_str, FTP_filename_str);
 					// if seek pos non zero
 					if (com_ftp_file_seek_pos != 0)
 					{
@@ -2406,11 +2507,15 @@ void COM_task(void)
 		break;
 
 	case COM_TX_FTP_DATA_MDM:
-		// wait for modem tx buffer to be empty
-		if (MDM_tx_ptr == NULL)
+		// read next block while modem transmits block header or previous block, then wait for modem tx buffer to be empty
+		if (!com_ftp_block_ready)
 		{
-			// then set a small delay
-			MDM_cmd_timer_x20ms = 10;						// 200s timeout
+			if (com_ftp_fill_free())
+				com_ftp_read_block();
+		}
+		else if (MDM_tx_ptr == NULL)
+		{
+			MDM_cmd_timer_x20ms = 0;						// send next block straight away
 			com_state = COM_TX_FTP_DATA_2;
 		}
 		break;
@@ -2423,29 +2528,21 @@ void COM_task(void)
 				// get and send file block by block from current seek pos
 				// set FTP_MDM between blocks
 
-			com_ftp_block_size = 0;
-			// check if any more to get (end pos and seek pos are inclusive)
-			if (com_ftp_file_end_pos >= com_ftp_file_seek_pos)
+			if (!com_ftp_block_ready)
 			{
-				com_ftp_block_size = com_ftp_file_end_pos - com_ftp_file_seek_pos + 1;
-				// limit size of block to get
-				if (com_ftp_block_size > COM_FTP_FILE_BLOCK_SIZE)
-				{
-					com_ftp_block_size = COM_FTP_FILE_BLOCK_SIZE;
-				}
+				if (!com_ftp_fill_free())
+					break;
+				com_ftp_read_block();
 			}
-			// if get a block or part of a block successfully
-			if (CFS_read_block(FTP_path_str, FTP_filename_str, MDM_tx_buffer, com_ftp_file_seek_pos, com_ftp_block_size) == true)
+			// if got a block or part of a block
+			if (com_ftp_block_size != 0)
 			{
-				MDM_tx_buffer[com_ftp_block_size] = '\0';		// terminate block (partial block will be terminated with eof '\0')
-				MDM_tx_delay_timer_x20ms = 25;					// wait 500ms
-				MDM_send_cmd(MDM_tx_buffer);
-				MDM_retry_ptr = NULL;							// only 1 attempt
-				com_ftp_file_seek_pos += com_ftp_block_size;	// next block
+				com_ftp_send_block();
 				com_state = COM_TX_FTP_DATA_MDM;				// go and wait for modem tx buffer to empty
 				break;
 			}
 			// (else no more blocks in file)
+			CFS_session_close(&com_ftp_session);
 
 			// until no more blocks
 
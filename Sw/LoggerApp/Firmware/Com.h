@@ -21,6 +21,8 @@
 ** V3.04 050112 PB  Waste Water - add extra standby window and period
 **
 ** V3.17 091012 PB  Bring up to date with Xilog+ V3.06 - new fn COM_long_interval()
+**
+** V6.03 171026     add com_sms_batch & com_ftp_block_ready flags
 */
 
 // Put this value into COM_reset_logger and logger will reset
@@ -40,6 +42,8 @@
 #define com_pending_check_dflags		COM_flags_1.b11
 #define com_pending_tsync				COM_flags_1.b12
 #define com_ftp_slow_server				COM_flags_1.b13
+#define com_sms_batch					COM_flags_1.b14
+#define com_ftp_block_ready				COM_flags_1.b15
 
 // Modem window for Tx, Rx or standby:
 typedef struct
@@ -63,6 +63,8 @@
 **
 ** V4.10 040614 PB				in channel task only set up event times if event sensor enabled and valid
 **
+** V6.03 171026					units & volume units names read through CFS small file cache
+**
 */
 
 #include <math.h>
@@ -2509,7 +2511,7 @@ void DIG_print_immediate_values(int index, bool units_as_strings)
 					{
 						i = sprintf(STR_buffer, "%s=", LOG_channel_id[(2 * index) + 1]);
 						i += STR_print_float(&STR_buffer[i], value);
-						CFS_read_line((char *)CFS_config_path, (char *)CFS_units_name, p_config->ec[0].output_units_index + 1, &STR_buffer[400], 8);
+						CFS_cache_read_line((char *)CFS_config_path, (char *)CFS_units_name, p_config->ec[0].output_units_index + 1, &STR_buffer[400], 8);
 						i += sprintf(&STR_buffer[i], "%s,",&STR_buffer[400]);
 					}
 					else
@@ -2563,7 +2565,7 @@ void DIG_print_immediate_values(int index, bool units_as_strings)
 			{
 				i = sprintf(STR_buffer, "%s=", LOG_channel_id[(2 * index) + 1]);
 				i += STR_print_float(&STR_buffer[i], DIG_volume_to_rate_enum(value, p_config->sample_interval, p_config->rate_enumeration));
-				CFS_read_line((char *)CFS_config_path, (char *)CFS_units_name, p_config->units_index + 1, &STR_buffer[400], 8);
+				CFS_cache_read_line((char *)CFS_config_path, (char *)CFS_units_name, p_config->units_index + 1, &STR_buffer[400], 8);
 				i += sprintf(&STR_buffer[i], "%s,",&STR_buffer[400]);
 			}
 			else
@@ -2592,7 +2594,7 @@ void DIG_print_immediate_values(int index, bool units_as_strings)
 						{
 							i += sprintf(&STR_buffer[i], "%s=", LOG_channel_id[(2 * index) + 2]);
 							i += STR_print_float(&STR_buffer[i], value);
-							CFS_read_line((char *)CFS_config_path, (char *)CFS_units_name, p_config->ec[1].output_units_index + 1, &STR_buffer[400], 8);
+							CFS_cache_read_line((char *)CFS_config_path, (char *)CFS_units_name, p_config->ec[1].output_units_index + 1, &STR_buffer[400], 8);
 							i += sprintf(&STR_buffer[i], "%s,",&STR_buffer[400]);
 						}
 						else
@@ -2696,7 +2698,7 @@ void DIG_print_immediate_derived_values(int index, bool units_as_strings)
 			{
 				i = sprintf(STR_buffer, "%s=", LOG_channel_id[(2 * index) + 12]);
 				i += STR_print_float(&STR_buffer[i], value);
-				CFS_read_line((char *)CFS_config_path, (char *)CFS_volunits_name, p_channel->sub[0].totaliser.units_enumeration + 1, &STR_buffer[400], 8);
+				CFS_cache_read_line((char *)CFS_config_path, (char *)CFS_volunits_name, p_channel->sub[0].totaliser.units_enumeration + 1, &STR_buffer[400], 8);
 				i += sprintf(&STR_buffer[i], "%s,",&STR_buffer[400]);
 			}
 			else
@@ -54,7 +54,8 @@
 // Takes up static memory. If you do not need to open more than one
 // file at the same time, then you should set this to 1 to reduce
 // memory usage
-#define FS_MAX_FILES_OPEN 	1
+// V6.03: 2 - one for a CFS read session, which may stay open between calls, and one for everything else
+#define FS_MAX_FILES_OPEN 	2
 /************************************************************************/
 
 // The size of a sector
@@ -63,6 +64,28 @@
 #define MEDIA_SECTOR_SIZE 		512
 /************************************************************************/
 
+// V6.03: sparse seek index held in each FSFILE, so FSfseek() on a large file does not
+// walk the FAT chain from the first cluster every time. Every FS_SEEK_INDEX_INTERVAL'th
+// cluster is remembered, up to FS_SEEK_INDEX_SIZE entries. Comment out to remove.
+#define FS_SEEK_INDEX_SIZE		16
+#define FS_SEEK_INDEX_INTERVAL	4
+/************************************************************************/
+
+// V6.03: LRU sector cache between FSIO and the SD card, FS_SECTOR_CACHE_SIZE sectors of
+// MEDIA_SECTOR_SIZE bytes each. Writes are held until the sector is evicted or the cache
+// is flushed by FSfclose(), CFS_power_down() or a flat battery. Each sector costs 512 bytes
+// of data memory, which is nearly full - one sector absorbs repeated writes to the FAT or
+// directory sector during a log flush. Comment out to remove.
+#define FS_SECTOR_CACHE_SIZE	1
+/************************************************************************/
+
+// V6.03: free-space map - one bit per FAT sector, set when the sector is known to have no
+// free clusters, so FATfindEmptyCluster() can skip it. 256 bytes covers 2048 FAT sectors,
+// i.e. a 4GB FAT32 card with 16K clusters. Later FAT sectors are always scanned.
+// Comment out to remove.
+#define FS_FREE_MAP_BYTES		256
+/************************************************************************/
+
 
 
 /* *******************************************************************************************************/
@@ -165,8 +188,20 @@ MEDIA_INFORMATION * CFS_sd_card_ready(void);				// prototype for CFS function
 
     #define MDD_MediaInitialize     CFS_sd_card_ready		// previously MDD_SDSPI_MediaInitialize
     #define MDD_MediaDetect         MDD_SDSPI_MediaDetect
+    #define MDD_MediaSectorRead     MDD_SDSPI_SectorRead	// physical sector access, used by sector cache
+    #define MDD_MediaSectorWrite    MDD_SDSPI_SectorWrite
+    #define MDD_MediaSync           MDD_SDSPI_StreamStop	// complete any multi-block transfer
+    #define MDD_MediaWriteHint      MDD_SDSPI_WriteHint		// number of consecutive sectors about to be written
+    #define MDD_MediaReadHint       MDD_SDSPI_ReadHint		// number of consecutive sectors about to be read
+#ifdef FS_SECTOR_CACHE_SIZE
+BYTE FS_cache_sector_read(DWORD sector_addr, BYTE* buffer);	// sector cache in FSIO.c
+BYTE FS_cache_sector_write(DWORD sector_addr, BYTE* buffer, BYTE allowWriteToZero);
+    #define MDD_SectorRead          FS_cache_sector_read
+    #define MDD_SectorWrite         FS_cache_sector_write
+#else
     #define MDD_SectorRead          MDD_SDSPI_SectorRead
     #define MDD_SectorWrite         MDD_SDSPI_SectorWrite
+#endif
     #define MDD_InitIO()            //MDD_SDSPI_InitIO - not used
     #define MDD_ShutdownMedia       MDD_SDSPI_ShutdownMedia
     #define MDD_WriteProtectState   MDD_SDSPI_WriteProtectState
@@ -77,6 +77,32 @@
 ** V4.00 010514 PB  remove gps trigger at midnight
 **
 ** V4.11 270814 PB  add GPS.TXT to headers if file exists if not a GPS product
+**
+** V6.03 171026     single-pass demultiplexing of the write queue when a flush starts - entries for each
+**					destination file are chained together, so log_write_to_file() walks only its own chain
+**					LOG_task() writes all pending files in one pass rather than one file per pass
+**					flush statistics LOG_flush_count, LOG_flush_scan_count, LOG_flush_file_count for #LQS
+**					log_write_to_file() uses CFS_chdir() - directory cache saves walking the path on every append
+**					directory cache cleared at month rollover in log_new_day_task()
+**					day file preallocation - new day files given clusters for yesterday's size plus 1/8,
+**					files written during the day trimmed to size by log_trim_day_files() when it closes
+**					list of files written kept in \LOGDATA\PREALLOC.DAT, so files preallocated before a reset
+**					are trimmed by log_prealloc_recover() after it
+**					log_day_file_name() generates path & filename, shared by log_write_to_file()
+**					and log_trim_day_files(), which opens existing files only and never recreates them
+**					binary day files - channels selected by LOG_binary_mask (#LBF) written as packed records
+**					to .BIN files, LOG_binary_to_text() (#LBC) renders them in the text format on demand
+**					log_block_footer() & log_totaliser_line() shared by text & binary paths
+**					time index - position, time & interval of each block header written to .IDX file
+**					alongside each text day file, LOG_index_find() looks up block for a given time
+**					overflow ring - values enqueued while queue full & flush in progress are held in log_spill[]
+**					and moved into the new active queue when it is switched, high water marks for #LQS
+**					journal - queued values copied to \LOGDATA\JOURNAL.DAT by LOG_task, checkpointed as each day file
+**					of a flush is written, replayed into the write queue after reset so day files have no gaps.
+**					Replay goes before any other flush. Journal appended to, and only rewritten when full.
+**					Journal only written while SD card is powered for something else - never powers it up
+**					log_write_to_file() builds up STR_buffer across headers, footers & events and writes it
+**					in whole sectors, aligned to the file's sector boundaries
 */
 
 #include "float.h"
@@ -111,6 +137,10 @@
 
 #include "MDD File System/FSIO.h"
 
+// Low-level functions in FSIO.c:
+int FS_preallocate(FSFILE * fo, DWORD bytes);
+int FS_trim(FSFILE * fo);
+
 #define extern
 #include "Log.h"
 #undef extern
@@ -120,6 +150,26 @@
 // potentially compromising logging rate accuracy.
 #define LOG_QUEUE_SIZE		128
 
+// Second tier, used when the active queue is full and the other is still being written to file.
+// Oldest entries are moved into the active queue each time the queues are switched.
+// Only needed when a flush outlasts 126 enqueued values, so a short ring covers the slow card case.
+// #LQS reports its high water mark & values lost.
+#define LOG_SPILL_SIZE		32
+
+// Day file writes: STR_buffer is written to file in whole sectors when it has less than this room left.
+// Largest single item is a pre-fetched event header (log_use_string).
+#define LOG_WRITE_SECTOR_SIZE	512
+#define LOG_WRITE_ITEM_MAX		200
+
+// Journal of queued values not yet written to day files, replayed after reset.
+// Header, then enqueued entries in order. From header's start: write queue (if flush in progress) then active queue.
+// Entries before start are already in day files - new entries are appended until LOG_JOURNAL_ENTRIES, then
+// the journal is rewritten from the start of the file.
+// Updated only while the SD card is already on (flush, commands, FTP...), so costs no extra card power-ups.
+#define LOG_JOURNAL
+#define LOG_JOURNAL_ENTRIES		(4 * LOG_QUEUE_SIZE)
+#define LOG_JOURNAL_MAGIC		0x4A4D
+
 // Values enqueued here, so file system can be updated before they are logged
 // Not really a queue - just a holding buffer. 
 typedef struct
@@ -129,6 +179,61 @@ typedef struct
 	int32 value;
 } log_queue_type;
 
+// Destination files for one flush: 16 functions for each of normal, SMS, derived and derived SMS data,
+// then the control output files
+#define LOG_NUM_DEST_FILES			((LOG_NUM_FUNCTIONS * 4) + LOG_NUM_CONTROL_CHANNELS)
+#define LOG_CONTROL_DEST_INDEX		(LOG_NUM_FUNCTIONS * 4)
+#define LOG_CHAIN_END				-1
+
+#ifdef LOG_JOURNAL
+typedef struct
+{
+	uint16 magic;
+	uint16 start;				// first entry not yet written to day files
+	uint16 count;				// entries in journal, including those before start
+	uint16 flush;				// entries from start being flushed, 0 if none
+	uint8 day_bcd;				// date of day files the entries belong to
+	uint8 mth_bcd;
+	uint8 yr_bcd;
+	uint8 spare;
+	uint8 done[(LOG_NUM_DEST_FILES + 7) / 8];	// destination files the flush has written, bit per log_dest_index()
+} log_journal_header_type;
+#endif
+
+// Preallocate clusters for each new day file, so appends don't allocate clusters one at a time.
+// Comment out to remove.
+#define LOG_PREALLOCATE_DAY_FILES
+#define LOG_PREALLOCATE_MAX_BYTES	0x40000L
+#define LOG_PREALLOCATE_FILE		"PREALLOC.DAT"		// in \LOGDATA: log date, then log_day_file_index[]
+
+#ifdef LOG_BINARY_RECORDS
+// Binary day file records. Top 3 bits of first byte give the record type:
+//	value:			3 bytes: 21-bit compressed value, MS byte first
+//	file header:	5 bytes: type, day, month & year (BCD) of file, channel name index
+//	block header:	9 bytes: type, timestamp (RTC_type.reg32[0]) & header params, both little endian
+//	text:			2 + n bytes: type, n, n chars of footer or totaliser line
+// Values are fixed size, so value k of a block is at a known offset from its block header.
+#define LOG_BIN_VALUE				0x00
+#define LOG_BIN_FILE_HEADER			0x20
+#define LOG_BIN_BLOCK_HEADER		0x40
+#define LOG_BIN_TEXT				0x60
+#define LOG_BIN_TYPE_MASK			0xE0
+
+#define LOG_BINARY_FILE				0x80		// file index flag for log_day_file_name()
+#endif
+
+#ifdef LOG_TIME_INDEX
+#define LOG_INDEX_FILE				0x100		// file index flag for log_day_file_name()
+#define LOG_INDEX_ENTRIES			8			// block headers indexed per file per flush
+
+// .IDX file record for each block header of a day file:
+typedef struct
+{
+	uint32 offset;								// file position of block header
+	uint32 time;								// bits 0-16: header time, secs after midnight. Bits 24-31: log interval enum
+} log_index_type;
+#endif
+
 BITFIELD log_flags;
 
 #define log_a_active				log_flags.b0	// ping-pong flag
@@ -138,6 +243,10 @@ BITFIELD log_flags;
 #define log_new_day					log_flags.b4	// get midnight measurements & write to file
 #define log_close_old_day			log_flags.b5
 #define log_pending_flush			log_flags.b6
+#define log_pending_demux			log_flags.b7	// write queue not yet chained per destination file
+#define log_journal_replay			log_flags.b8	// journal to be replayed after reset
+#define log_prealloc_changed		log_flags.b9	// log_day_file_index[] to be saved to LOG_PREALLOCATE_FILE
+#define log_prealloc_check			log_flags.b10	// trim files listed in LOG_PREALLOCATE_FILE after reset
 
 int log_20ms_timer;
 
@@ -147,6 +256,18 @@ uint8 log_day_bcd;
 
 int log_queue_tail;		// head always 0
 
+int log_spill_head;		// oldest entry in log_spill[]
+int log_spill_count;
+
+#ifdef LOG_JOURNAL
+uint16 log_swap_count;		// incremented each time queues are switched
+uint16 log_journal_swaps;	// log_swap_count when journal last brought up to date
+int log_journal_w;			// write queue entries in journal
+int log_journal_a;			// active queue entries in journal
+log_journal_header_type log_journal_header;	// as last written, except start advanced by flush completed since
+uint8 log_journal_date[3];	// log date while journal replayed from its own date
+#endif
+
 // length of queue when flush to file begins:
 int log_write_length;
 
@@ -167,9 +288,29 @@ uint16 log_control_write_mask;
 
 FAR log_queue_type log_queue_a[LOG_QUEUE_SIZE + 1];		// overspill of 1 entry
 FAR log_queue_type log_queue_b[LOG_QUEUE_SIZE + 1];		// overspill of 1 entry
+FAR log_queue_type log_spill[LOG_SPILL_SIZE];				// ring, in order of enqueueing
 
 FAR uint8 log_char_count[LOG_NUM_FUNCTIONS + LOG_SMS_MASK + LOG_DERIVED_MASK];
 
+// Chains of write queue entries per destination file, built in one pass when the flush starts
+FAR int16 log_chain_head[LOG_NUM_DEST_FILES];
+FAR int16 log_chain_tail[LOG_NUM_DEST_FILES];
+FAR int16 log_chain_next[LOG_QUEUE_SIZE + 1];
+
+#ifdef LOG_BINARY_RECORDS
+uint16 LOG_binary_mask;
+#endif
+
+#ifdef LOG_TIME_INDEX
+FAR log_index_type log_index_entry[LOG_INDEX_ENTRIES];		// block headers written to current file by this flush
+uint8 log_index_count;
+#endif
+
+#ifdef LOG_PREALLOCATE_DAY_FILES
+FAR uint32 log_day_file_bytes[LOG_NUM_DEST_FILES];		// size each destination file reached yesterday, 0 if not known
+FAR uint8 log_day_file_index[LOG_NUM_DEST_FILES];		// file index + 1 of each destination file written today, 0 if not written
+#endif
+
 const char LOG_channel_id[LOG_NUM_FUNCTIONS + 11 + 3][4] =
 {
 	"ACT", 
@@ -295,15 +436,154 @@ void LOG_flush(void)
 	log_pending_flush = true;
 }
 
+/******************************************************************************
+** Function:	Get destination file index of an enqueued channel number
+**
+** Notes:		0..63 for logged channels (bits 4 & 5 of channel number select SMS and derived),
+**				then the control outputs. Returns LOG_CHAIN_END if channel number invalid.
+*/
+int log_dest_index(uint8 channel_number)
+{
+	uint8 control;
+
+	if ((channel_number & LOG_CONTROL_MASK) == LOG_CONTROL_MASK)
+	{
+		control = channel_number & 0x03;
+		if ((control == 0) || (control > LOG_NUM_CONTROL_CHANNELS))
+			return LOG_CHAIN_END;
+		return LOG_CONTROL_DEST_INDEX + control - 1;
+	}
+
+	return (((channel_number >> 4) & 0x03) * LOG_NUM_FUNCTIONS) + (channel_number & 0x0F);
+}
+
+/******************************************************************************
+** Function:	Chain together the write queue entries for each destination file
+**
+** Notes:		Walks the write queue once, so each file is then written from its own chain
+**				without scanning the whole queue again.
+**				Called from LOG_task rather than log_immediate_flush, so the walk is done once the
+**				flush is under way instead of delaying the queue switch.
+*/
+void log_demultiplex_queue(void)
+{
+	log_queue_type *p;
+	int i;
+	int dest;
+
+	p = log_a_active ? log_queue_b : log_queue_a;								// the queue we're not logging into
+
+	for (i = 0; i < LOG_NUM_DEST_FILES; i++)
+		log_chain_head[i] = LOG_CHAIN_END;
+
+	for (i = 0; i < log_write_length; i++)
+	{
+		log_chain_next[i] = LOG_CHAIN_END;
+		dest = log_dest_index(p[i].channel_number);
+		if (dest == LOG_CHAIN_END)
+			continue;
+
+		if (log_chain_head[dest] == LOG_CHAIN_END)
+			log_chain_head[dest] = i;
+		else
+			log_chain_next[log_chain_tail[dest]] = i;
+		log_chain_tail[dest] = i;
+	}
+
+	LOG_flush_count++;
+	LOG_flush_scan_count = log_write_length;
+	LOG_flush_file_count = 0;
+	log_pending_demux = false;
+}
+
+/******************************************************************************
+** Function:	Set active or write mask bit for an enqueued channel number
+**
+** Notes:		So the channel's file is written by the next flush, or by the flush in progress if write true
+*/
+void log_mark(uint8 channel_number, bool write)
+{
+	uint16 mask;
+
+	if ((channel_number & LOG_CONTROL_MASK) == LOG_CONTROL_MASK)
+	{
+		mask = 0x0001 << ((channel_number & 0x03) - 1);
+		if (write)
+			log_control_write_mask |= mask;
+		else
+			log_control_active_mask |= mask;													// data in queue for control output
+		return;
+	}
+
+	mask = 1 << (channel_number & 0x0F);
+	if ((channel_number & LOG_SMS_MASK) == 0)
+	{
+		if ((channel_number & LOG_DERIVED_MASK) == 0)
+		{
+			if (write)
+				log_write_mask |= mask;
+			else
+				log_active_mask |= mask;														// normal data in queue for this channel
+		}
+		else if (write)
+			log_derived_write_mask |= mask;
+		else
+			log_derived_active_mask |= mask;													// derived data in queue for this channel
+	}
+	else																						// else SMS data
+	{
+		if ((channel_number & LOG_DERIVED_MASK) == 0)
+		{
+			if (write)
+				log_sms_write_mask |= mask;
+			else
+				log_sms_active_mask |= mask;													// sms data in queue for this channel
+		}
+		else if (write)
+			log_derived_sms_write_mask |= mask;
+		else
+			log_derived_sms_active_mask |= mask;												// derived sms data in queue for this channel
+	}
+}
+
+/******************************************************************************
+** Function:	Move oldest entries from overflow ring into active queue
+**
+** Notes:		Called when queues have just been switched. Leaves room for the flush threshold,
+**				so a further flush is set pending if entries remain.
+*/
+void log_drain_spill(void)
+{
+	log_queue_type *p;
+
+	p = log_a_active ? log_queue_a : log_queue_b;											// the queue we're logging into
+	while ((log_spill_count != 0) && (log_queue_tail < LOG_QUEUE_SIZE - 32))
+	{
+		p[log_queue_tail] = log_spill[log_spill_head];
+		log_mark(p[log_queue_tail].channel_number, false);
+		log_queue_tail++;
+		if (++log_spill_head >= LOG_SPILL_SIZE)
+			log_spill_head = 0;
+		log_spill_count--;
+	}
+
+	if (log_spill_count != 0)
+		LOG_flush();
+}
+
 /******************************************************************************
 ** Function:	Start log flush immediately and switch logging queue buffer
 **
-** Notes:	
+** Notes:		Returns false if flush already in progress
 */
-void log_immediate_flush(void)
+bool log_immediate_flush(void)
 {
 	if ((log_write_mask | log_sms_write_mask | log_derived_write_mask | log_derived_sms_write_mask | log_control_write_mask)!= 0x0000)
-		return;																	// return if flush already in progress
+		return false;															// return if flush already in progress
+#ifdef LOG_JOURNAL
+	if (log_journal_replay)
+		return false;															// or values from before reset still to write
+#endif
 																				// else:
 	log_a_active = !log_a_active;
 	log_write_length = log_queue_tail;
@@ -320,7 +600,270 @@ void log_immediate_flush(void)
 	log_derived_sms_active_mask = 0x0000;
 	log_control_write_mask = log_control_active_mask;							// control outputs
 	log_control_active_mask = 0x0000;
+	log_pending_demux = true;													// chain entries per file at mainloop level
+#ifdef LOG_JOURNAL
+	log_swap_count++;
+#endif
+	log_drain_spill();															// older values first
+	return true;
+}
+
+#ifdef LOG_JOURNAL
+/******************************************************************************
+** Function:	Open journal file, creating it if necessary
+**
+** Notes:		File system must be open. Returns NULL if can't.
+*/
+FSFILE * log_journal_open(bool create)
+{
+	FSFILE *f;
+
+	if (!CFS_chdir((char *)"\\LOGDATA", create))
+		return NULL;
+	f = FSfopen((char *)"JOURNAL.DAT", "r+");
+	if ((f == NULL) && create)
+		f = FSfopen((char *)"JOURNAL.DAT", "w+");
+	return f;
+}
+
+/******************************************************************************
+** Function:	Write journal header
+**
+** Notes:		Closes file, which flushes sector cache
+*/
+void log_journal_write_header(FSFILE *f)
+{
+	log_journal_header.magic = LOG_JOURNAL_MAGIC;
+	FSfseek(f, 0, SEEK_SET);
+	FSfwrite(&log_journal_header, sizeof(log_journal_header), 1, f);
+	CFS_close_file(f);
+}
+
+/******************************************************************************
+** Function:	Bring journal up to date with log queues
+**
+** Notes:		Appends entries enqueued since last update. If rebuild, queues have been switched
+**				other than once since the journal was written, or the file has reached LOG_JOURNAL_ENTRIES,
+**				rewrites it from the start with the write queue (if flush in progress) and active queue.
+**				Returns false if file system not ready.
+*/
+bool log_journal_update(bool rebuild)
+{
+	FSFILE *f;
+	log_queue_type *p;
+	uint16 swaps;
+	int tail, write_length, w, a;
+	bool a_active;
+
+	swaps = log_swap_count;																	// queue state to bring journal up to
+	tail = log_queue_tail;
+	a_active = log_a_active;
+	write_length = ((log_write_mask | log_sms_write_mask | log_derived_write_mask | log_derived_sms_write_mask | log_control_write_mask) != 0x0000) ?
+				   log_write_length : 0;
+
+	w = log_journal_w;
+	a = log_journal_a;
+	if (swaps != log_journal_swaps)
+	{
+		if (((uint16)(swaps - log_journal_swaps) == 1) && (w == 0))							// active queue entries now in write queue
+		{
+			w = a;
+			a = 0;
+		}
+		else
+			rebuild = true;
+		memset(log_journal_header.done, 0, sizeof(log_journal_header.done));				// new flush
+	}
+	if ((w > write_length) ||																// write queue entries already in day files
+		(log_journal_header.start + write_length + tail > LOG_JOURNAL_ENTRIES))				// no room to append
+		rebuild = true;
+	if (rebuild)
+	{
+		w = 0;
+		a = 0;
+		log_journal_header.start = 0;
+	}
+	else if ((w == write_length) && (a == tail))											// nothing to add
+	{
+		log_journal_swaps = swaps;
+		log_journal_w = w;
+		return true;
+	}
+
+	if (!CFS_open())
+		return false;
+	f = log_journal_open(true);
+	if (f == NULL)
+		return false;
+
+	FSfseek(f, sizeof(log_journal_header) + (long)(log_journal_header.start + w + a) * sizeof(log_queue_type), SEEK_SET);
+	p = a_active ? log_queue_b : log_queue_a;												// write queue
+	if (w < write_length)
+		FSfwrite(&p[w], sizeof(log_queue_type), write_length - w, f);
+	p = a_active ? log_queue_a : log_queue_b;												// active queue
+	if (a < tail)
+		FSfwrite(&p[a], sizeof(log_queue_type), tail - a, f);
+
+	log_journal_header.count = log_journal_header.start + write_length + tail;				// entries now valid
+	log_journal_header.flush = write_length;
+	log_journal_header.day_bcd = log_day_bcd;
+	log_journal_header.mth_bcd = log_mth_bcd;
+	log_journal_header.yr_bcd = log_yr_bcd;
+	log_journal_write_header(f);
+
+	log_journal_swaps = swaps;
+	log_journal_w = write_length;
+	log_journal_a = tail;
+	return true;
+}
+
+/******************************************************************************
+** Function:	Journal newly enqueued values
+**
+** Notes:		Called from LOG_task. Only writes if SD card is already on for something else:
+**				powering it up per value would cost more battery than the journal saves.
+*/
+void log_journal_task(void)
+{
+	if (log_journal_replay || (LOG_state == LOG_BATT_DEAD) || (CFS_state != CFS_OPEN))
+		return;
+
+	if ((log_swap_count != log_journal_swaps) || (log_queue_tail != log_journal_a))			// values not yet journaled
+		log_journal_update(false);
+}
+
+/******************************************************************************
+** Function:	Record in journal that a day file of the flush in progress has been written
+**
+** Notes:		Called after each file is written, so a reset part way through a flush doesn't
+**				write that file's values again on replay. Only if journal holds the whole write queue.
+*/
+void log_journal_checkpoint(int dest)
+{
+	FSFILE *f;
+
+	if (dest == LOG_CHAIN_END)
+		return;
+	// else:
+
+	log_journal_header.done[dest >> 3] |= 1 << (dest & 0x07);
+	if (!log_journal_replay && ((log_journal_swaps != log_swap_count) || (log_journal_w != log_write_length)))
+		return;																				// next update writes done[] with write queue
+	// else:
+
+	f = log_journal_open(false);
+	if (f != NULL)
+		log_journal_write_header(f);
+}
+
+/******************************************************************************
+** Function:	Advance journal past a completed flush
+**
+** Notes:		Only in RAM - written with the next update or checkpoint. If reset first, replay finds
+**				every file of the flush marked done.
+*/
+void log_journal_flushed(void)
+{
+	log_journal_header.start += log_journal_w;
+	log_journal_header.flush = 0;
+	memset(log_journal_header.done, 0, sizeof(log_journal_header.done));
+	log_journal_w = 0;
+}
+
+/******************************************************************************
+** Function:	Skip destination files already written by the flush being replayed
+**
+** Notes:		Call after log_demultiplex_queue()
+*/
+void log_journal_skip_done(void)
+{
+	int i;
+
+	for (i = 0; i < LOG_NUM_DEST_FILES; i++)
+	{
+		if ((log_journal_header.done[i >> 3] & (1 << (i & 0x07))) != 0)
+			log_chain_head[i] = LOG_CHAIN_END;
+	}
+}
+
+/******************************************************************************
+** Function:	Replay next part of journal after reset
+**
+** Notes:		Loads the flush in progress at reset, or up to a queue of entries, into the write queue
+**				and starts a flush of them. Log date is set from the journal, so the values go to the
+**				day files they were logged for, then restored. When all replayed, the journal is rewritten
+**				with current queues. Called when no flush in progress and file system open.
+*/
+void log_journal_load(void)
+{
+	FSFILE *f;
+	log_queue_type *p;
+	int n, i;
+
+	f = log_journal_open(false);
+	n = 0;
+	if (f != NULL)
+	{
+		if (log_journal_header.magic != LOG_JOURNAL_MAGIC)									// first part - header left by reset
+		{
+			log_journal_date[0] = log_day_bcd;
+			log_journal_date[1] = log_mth_bcd;
+			log_journal_date[2] = log_yr_bcd;
+			if ((FSfread(&log_journal_header, sizeof(log_journal_header), 1, f) == 1) &&
+				(log_journal_header.magic == LOG_JOURNAL_MAGIC))
+			{
+				log_day_bcd = log_journal_header.day_bcd;									// values belong to journal's date
+				log_mth_bcd = log_journal_header.mth_bcd;
+				log_yr_bcd = log_journal_header.yr_bcd;
+			}
+			else
+				log_journal_header.count = 0;
+		}
+
+		if ((log_journal_header.magic == LOG_JOURNAL_MAGIC) && (log_journal_header.start < log_journal_header.count))
+		{
+			n = log_journal_header.count - log_journal_header.start;
+			if ((log_journal_header.flush != 0) && (log_journal_header.flush <= n))			// flush in progress at reset
+				n = log_journal_header.flush;
+			if (n > LOG_QUEUE_SIZE)
+			{
+				n = LOG_QUEUE_SIZE;
+				memset(log_journal_header.done, 0, sizeof(log_journal_header.done));
+			}
+			p = log_a_active ? log_queue_b : log_queue_a;									// write queue
+			if (FSfseek(f, sizeof(log_journal_header) + (long)log_journal_header.start * sizeof(log_queue_type), SEEK_SET) == 0)
+				n = FSfread(p, sizeof(log_queue_type), n, f);
+			else
+				n = 0;
+		}
+		CFS_close_file(f);
+	}
+
+	if (n <= 0)																				// all replayed
+	{
+		if (log_journal_header.magic == LOG_JOURNAL_MAGIC)									// log date back to current day
+		{
+			log_day_bcd = log_journal_date[0];
+			log_mth_bcd = log_journal_date[1];
+			log_yr_bcd = log_journal_date[2];
+		}
+		log_journal_replay = false;
+		memset(&log_journal_header, 0, sizeof(log_journal_header));
+		log_journal_w = 0;
+		log_journal_a = 0;
+		log_journal_swaps = log_swap_count;
+		log_journal_update(true);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		log_mark(p[i].channel_number, true);
+	log_write_length = n;
+	log_pending_demux = true;
+	log_journal_header.flush = n;
+	log_journal_w = n;																		// advanced past by log_journal_flushed()
 }
+#endif
 
 /******************************************************************************
 ** Function:	Check whether a flush is in progress, or channels updating
@@ -351,46 +894,55 @@ bool LOG_busy(void)
 /******************************************************************************
 ** Function:	Enqueue one data item (timestamp for header, or logged data)
 **
-** Notes:	
+** Notes:		Goes to overflow ring if queue full & flush in progress, or if ring not empty,
+**				so order of entries is kept.
 */
 void log_enqueue(uint8 channel_number, uint8 data_type, int32 value)
 {
 	log_queue_type *p;
+	bool full = false;
 
 	if (log_queue_tail >= LOG_QUEUE_SIZE - 32)		// flush to file when queue nearly full
 	{
 		if (log_queue_tail >= LOG_QUEUE_SIZE - 2)	// queue full
-		{
-			log_immediate_flush();
-			if (log_queue_tail != 0)				// we were unable to flush
-			{
-				log_queue_overflow = true;
-				return;
-			}
-		}
+			full = !log_immediate_flush();			// true if we were unable to flush
 		else
 			LOG_flush();							// set pending flush
 	}
 
-	p = log_a_active ? &log_queue_a[log_queue_tail] : &log_queue_b[log_queue_tail];
+	if (full || (log_spill_count != 0))				// queue full, or older values waiting in overflow ring
+	{
+		if (log_spill_count >= LOG_SPILL_SIZE)		// overflow ring full too
+		{
+			log_queue_overflow = true;
+			LOG_values_lost++;
+			return;
+		}
+		p = &log_spill[(log_spill_head + log_spill_count) % LOG_SPILL_SIZE];
+		log_spill_count++;
+		if (log_spill_count > LOG_spill_high_water)
+			LOG_spill_high_water = log_spill_count;
+	}
+	else
+	{
+		p = log_a_active ? &log_queue_a[log_queue_tail] : &log_queue_b[log_queue_tail];
+		log_queue_tail++;
+		if (log_queue_tail > LOG_queue_high_water)
+			LOG_queue_high_water = log_queue_tail;
+	}
+
 	p->channel_number = channel_number;
 	p->data_type = data_type;
 	p->value = value;
-
-	log_queue_tail++;
 }
 
 /******************************************************************************
-** Function:	Compress one 32 bit floating point value (cast as int32) into 3 extended-ASCII chars
+** Function:	Code 21 bit compressed value into 3 extended-ASCII chars
 **
 ** Notes:		returns length of string (3)	
 */
-int log_compress_value(char * buffer_p, uint32 value)
+int log_code_21(char * buffer_p, uint32 mask21)
 {
-	uint32 mask21;
-
-	mask21 = STR_float_32_to_21(value);
-
 	// convert to ascii in buffer - little endian
 	*buffer_p = (uint8)(mask21) & 0x7F;
 	*buffer_p += (*buffer_p < 64) ? 48 : 112;
@@ -406,6 +958,16 @@ int log_compress_value(char * buffer_p, uint32 value)
 	return 3; 
 }
 
+/******************************************************************************
+** Function:	Compress one 32 bit floating point value (cast as int32) into 3 extended-ASCII chars
+**
+** Notes:		returns length of string (3)	
+*/
+int log_compress_value(char * buffer_p, uint32 value)
+{
+	return log_code_21(buffer_p, STR_float_32_to_21(value));
+}
+
 /******************************************************************************
 ** Function:	Code 28 bit value (int32) into 4 extended-ASCII chars
 **
@@ -650,22 +1212,7 @@ bool LOG_enqueue_value(uint8 channel_number, uint8 data_type, int32 value)
 		if (LOG_state != LOG_LOGGING)											// not logging
 			return false;
 
-		mask = 1 << (channel_number & 0x0F);
-		if ((channel_number & LOG_SMS_MASK) == 0)
-		{
-			if ((channel_number & LOG_DERIVED_MASK) == 0)
-				log_active_mask |= mask;										// normal data in queue for this channel
-			else
-				log_derived_active_mask |= mask;								// derived data in queue for this channel
-		}
-		else																	// else SMS data
-		{
-			if ((channel_number & LOG_DERIVED_MASK) == 0)
-				log_sms_active_mask |= mask;									// sms data in queue for this channel
-			else
-				log_derived_sms_active_mask |= mask;							// derived sms data in queue for this channel
-		}
-	
+		log_mark(channel_number, false);										// data in queue for this channel
 		log_enqueue(channel_number, data_type, value);
 		if (data_type == LOG_BLOCK_HEADER_TIMESTAMP)							// timestamp - need to enqueue channel parameters at time of enqueueing also
 			log_enqueue(channel_number, LOG_BLOCK_HEADER_PARAMS, log_create_block_header_params(channel_number));
@@ -885,268 +1432,766 @@ int LOG_create_block_header(char * buffer_p, int channel_index, RTC_type * time_
 }
 
 /******************************************************************************
-** Function:	Write enqueued values to file system from log_queue_a or _b
-**
-** Notes:		Example path for normal logged data:	\LOGDATA\D1A\2009\05
-**														|-------|---|----|--|
-**														    A     B    C   D
-**				A = fixed path, B = channel id, C = year, D = month
-**				For SMS data, field A is \SMSDATA
-**				For control data, field A is \COPDATA 
+** Function:	Create block footer for a channel
 **
-**				Filenames include channel id, day & month, e.g. D1A-2705.TXT	NB changed from '_' to '-' 010909 PB
+** Notes:		Serial channels only - resets their min & max. Returns length, 0 if no footer.
 */
-void log_write_to_file(int channel_index)
+int log_block_footer(char * buffer_p, int channel_index)
 {
-	FSFILE *f;
-	int len;
-	int i;
-	int file_index;
-	int name_index = 0;
-	uint32 j;
-	log_queue_type *p;
-	float fpn;
-	RTC_type time_stamp;
-																								// File system already opened by LOG_task.
-	if ((LOG_state == LOG_BATT_DEAD) || (CFS_state != CFS_OPEN))
-		return;
+	int len = 0;
 
-	// get contents of GPS.TXT if it exists
-	//CFS_read_line((char *)CFS_config_path, (char *)CFS_gps_name, 1, log_gps_string, 40);
+	if ((channel_index >= LOG_SERIAL_1_INDEX) && (channel_index < LOG_ANALOGUE_1_INDEX))
+	{
+		uint8 channel = channel_index - LOG_SERIAL_1_INDEX;
+		len = LOG_print_footer_min_max(buffer_p, &MOD_channel_mins_time[channel], MOD_channel_mins[channel],
+													&MOD_channel_maxes_time[channel], MOD_channel_maxes[channel]);
+		MOD_channel_mins[channel] = FLT_MAX;
+		memset(&MOD_channel_mins_time[channel], 0, sizeof(RTC_hhmmss_type));
+		MOD_channel_maxes[channel] = -FLT_MAX;
+		memset(&MOD_channel_maxes_time[channel], 0, sizeof(RTC_hhmmss_type));
+	}
+/*
+#ifndef HDW_RS485
+	if ((channel_index >= LOG_DIGITAL_1A_INDEX) && (channel_index <= LOG_DIGITAL_2B_INDEX))
+	{
+		len = DIG_create_block_footer(buffer_p, channel_index - LOG_DIGITAL_1A_INDEX, log_write_sms, log_write_derived); 
+#else
+	if ((channel_index >= LOG_SERIAL_1_INDEX) && (channel_index < LOG_ANALOGUE_1_INDEX))
+	{
+		len = DOP_create_block_footer(buffer_p, channel_index - LOG_SERIAL_1_INDEX, log_write_derived); 
+#endif
 
-	p = log_a_active ? log_queue_b : log_queue_a;												// get pointer to the write queue, i.e. the one we're not logging into
+		// Add signal strength & batt volts to end of digital footer:
+		len += sprintf(&buffer_p[len], ",%4.2f,%4.2f,%d%%\r\n",
+					(double)PWR_int_bat_volts, (double)PWR_ext_supply_volts, (COM_csq * 100) / 31);
+	}
+#ifndef HDW_GPS
+	else if ((channel_index >= LOG_ANALOGUE_1_INDEX) && (channel_index <= LOG_ANALOGUE_7_INDEX))
+		len = ANA_create_block_footer(buffer_p, channel_index - LOG_ANALOGUE_1_INDEX, log_write_derived); 
+#endif
+*/
+
+	return len;
+}
+
+#ifndef HDW_RS485
+/******************************************************************************
+** Function:	Create totaliser line for a digital channel
+**
+** Notes:		Timestamp from enqueued value, current totaliser value. Returns length.
+*/
+int log_totaliser_line(char * buffer_p, int channel_index, int32 value)
+{
+	uint32 j;
+	int len;
+	int fraction;
+
+	j = RTC_sec_to_bcd(value & 0x0001FFFF);
+	len = sprintf(buffer_p, "$%02x:%02x:%02x,", BITS16TO23(j), BITS8TO15(j), BITS0TO7(j));
+
+	len += DIG_print_totaliser_int(&buffer_p[len],
+		&DIG_channel[(channel_index - 1) >> 1].sub[(channel_index - 1) & 1].totaliser.value_x10000);
+	fraction = DIG_channel[(channel_index - 1) >> 1].sub[(channel_index - 1) & 1].totaliser.value_x10000 % 10000;
+	len += sprintf(&buffer_p[len], ".%04d\r\n", fraction);
+
+	return len;
+}
+#endif
+
+/******************************************************************************
+** Function:	Generate path & filename of a day file
+**
+** Notes:		file_index is the channel index with SMS, derived or control bits set.
+**				Changes directory to the path, creating it if create is true, and leaves the filename in STR_buffer.
+**				Returns false if the directory does not exist and create is false, or can't be created.
+**				Uses the date of the log files, log_yr_bcd etc.
+**				If LOG_BINARY_FILE bit set, filename has .BIN extension instead of .TXT
+**				If LOG_INDEX_FILE bit set, filename has .IDX extension
+*/
+bool log_day_file_name(int file_index, bool create)
+{
+	int channel_index;
+	int name_index;
+	bool found;
 
+	channel_index = file_index & ~(LOG_SMS_MASK | LOG_DERIVED_MASK);
+#ifdef LOG_BINARY_RECORDS
+	channel_index &= ~LOG_BINARY_FILE;
+#endif
+#ifdef LOG_TIME_INDEX
+	channel_index &= ~LOG_INDEX_FILE;
+#endif
 	if (channel_index == LOG_ACTIVITY_INDEX)													// Generate full path to file where data will be written
 	{
 		sprintf(STR_buffer, "\\ACTIVITY\\20%02X\\%02X", log_yr_bcd, log_mth_bcd);				// generate path and check for its existence
-		if (FSchdir(STR_buffer) != 0)				// can't cd
-		{
-			FSmkdir(STR_buffer);
-			FSchdir(STR_buffer);
-		}
+		found = CFS_chdir(STR_buffer, create);													// cd, creating path if necessary
 		sprintf(STR_buffer, "ACT-%02X%02X.TXT", log_day_bcd, log_mth_bcd);						// Generate logged activity filename, e.g. ACT-2705.TXT:
 	}
 	else if ((channel_index & LOG_CONTROL_MASK) == LOG_CONTROL_MASK)
 	{
 		sprintf(STR_buffer, "\\COPDATA\\%u\\20%02X\\%02X", 										// generate path for control data and check for its existence
 				channel_index & 0x03, log_yr_bcd, log_mth_bcd);
-		if (FSchdir(STR_buffer) != 0)				// can't cd
-		{
-			FSmkdir(STR_buffer);
-			FSchdir(STR_buffer);
-		}
+		found = CFS_chdir(STR_buffer, create);													// cd, creating path if necessary
 		sprintf(STR_buffer, "%u-%02X%02X.TXT", 													// Generate logged activity filename, e.g. 1-2705.TXT:
 				channel_index & 0x03, log_day_bcd, log_mth_bcd);
 	}
 	else if ((channel_index >= LOG_EVENT_1A_INDEX) && (channel_index <= LOG_EVENT_2B_INDEX))
 	{
-		// pre-fetch event header in case we need it
-		// have to do this here as it needs data from event configure file and we cannot have two files open at once
-		time_stamp.yr_bcd = log_yr_bcd;															// pack header date into RTC_type
-		time_stamp.mth_bcd = log_mth_bcd;
-		time_stamp.day_bcd = log_day_bcd;
-																								// create event header
-		len = LOG_create_event_header(STR_buffer, channel_index, &time_stamp);
-		strcpy(log_use_string, STR_buffer); 
 																								// generate path for event data and check for its existence
 		sprintf(STR_buffer, "\\LOGDATA\\%s\\20%02X\\%02X", 
 				LOG_channel_id[channel_index - LOG_EVENT_1A_INDEX + 1], log_yr_bcd, log_mth_bcd);
-		if (FSchdir(STR_buffer) != 0)															// can't cd
-		{
-			FSmkdir(STR_buffer);
-			FSchdir(STR_buffer);
-		}
+		found = CFS_chdir(STR_buffer, create);													// cd, creating path if necessary
 		sprintf(STR_buffer, "%s-%02X%02X.TXT", 													// Generate logged event filename, e.g. D1A-2705.TXT:
 				LOG_channel_id[channel_index - LOG_EVENT_1A_INDEX + 1], log_day_bcd, log_mth_bcd);
 	}
 	else
 	{
 																								// generate path for data and check for its existence
-		name_index = log_write_derived ? channel_index + 11 : channel_index;
-		if (log_write_sms)
+		name_index = ((file_index & LOG_DERIVED_MASK) != 0) ? channel_index + 11 : channel_index;
+		if ((file_index & LOG_SMS_MASK) != 0)
 			sprintf(STR_buffer, "\\%s\\%s\\20%02X\\%02X", "SMSDATA", LOG_channel_id[name_index], log_yr_bcd, log_mth_bcd);
 		else
 			sprintf(STR_buffer, "\\%s\\%s\\20%02X\\%02X", "LOGDATA", LOG_channel_id[name_index], log_yr_bcd, log_mth_bcd);
 
-		if (FSchdir(STR_buffer) != 0)															// can't cd
-		{
-			FSmkdir(STR_buffer);
-			FSchdir(STR_buffer);
-		}
+		found = CFS_chdir(STR_buffer, create);													// cd, creating path if necessary
 																								// Generate logged data filename, e.g. D1A-2705.TXT:
 		sprintf(STR_buffer, "%s-%02X%02X.TXT", LOG_channel_id[name_index], log_day_bcd, log_mth_bcd);
 	}
+#ifdef LOG_BINARY_RECORDS
+	if ((file_index & LOG_BINARY_FILE) != 0)
+		strcpy(&STR_buffer[strlen(STR_buffer) - 3], "BIN");
+#endif
+#ifdef LOG_TIME_INDEX
+	if ((file_index & LOG_INDEX_FILE) != 0)
+		strcpy(&STR_buffer[strlen(STR_buffer) - 3], "IDX");
+#endif
+	return found;
+}
+
+#ifdef LOG_TIME_INDEX
+/******************************************************************************
+** Function:	Append block headers written by this flush to a day file's .IDX file
+**
+** Notes:		Called after the day file is closed, as only two files can be open at once.
+*/
+void log_write_index(int day_file)
+{
+	FSFILE *f;
 
+	log_day_file_name(day_file | LOG_INDEX_FILE, true);
 	f = FSfopen(STR_buffer, "a");
+	if (f != NULL)
+	{
+		FSfwrite(log_index_entry, sizeof(log_index_type), log_index_count, f);
+		CFS_close_file(f);
+	}
+	log_index_count = 0;
+}
+
+/******************************************************************************
+** Function:	Find the block of a day file holding the reading at a given time
+**
+** Notes:		Uses the .IDX file alongside the day file. Target time is time_secs less n_before intervals,
+**				using the interval of each block. Returns file position of the last block header whose first
+**				reading is no later than the target, or 0 if none, or no index - parse from start of file.
+**				File system must be open. Changes working directory.
+*/
+long LOG_index_find(char * path, char * filename, uint32 time_secs, uint16 n_before)
+{
+	FSFILE *f;
+	log_index_type entry;
+	char name[13];
+	uint32 interval, span;
+	uint8 time_enum;
+	long pos;
+	int n;
+
+	n = strlen(filename);
+	if ((n < 5) || (n > sizeof(name) - 1) || !CFS_chdir(path, false))
+		return 0;
+	strcpy(name, filename);
+	strcpy(&name[n - 3], "IDX");
+	f = FSfopen(name, "r");
 	if (f == NULL)
-		return;																					// not a lot we can do
-																								// else print values to STR_buffer, then dump STR_buffer to file:
+		return 0;
 
-	// NB no returns from here on, as we must close the file.
+	pos = 0;
+	while (FSfread(&entry, sizeof(entry), 1, f) == 1)
+	{
+		time_enum = (uint8)(entry.time >> 24);
+		if ((time_enum == 0) || (time_enum >= sizeof(LOG_interval_sec) / sizeof(LOG_interval_sec[0])))
+			continue;
+		interval = LOG_interval_sec[time_enum];
+		span = (uint32)n_before * interval;
+		if ((time_secs >= span) && ((entry.time & 0x0001FFFF) + interval <= time_secs - span))
+			pos = entry.offset;
+	}
+
+	CFS_close_file(f);
+	return pos;
+}
+#endif
+
+#ifdef LOG_BINARY_RECORDS
+/******************************************************************************
+** Function:	Check if a destination file is written as binary records
+**
+** Notes:		Only normal & derived logged data, not SMS, activity, control or event files.
+*/
+bool log_binary_file(int file_index)
+{
+	int channel_index;
+
+	if ((file_index & (LOG_SMS_MASK | LOG_CONTROL_MASK)) != 0)
+		return false;
+
+	channel_index = file_index & ~LOG_DERIVED_MASK;
+	if ((channel_index == LOG_ACTIVITY_INDEX) || ((channel_index >= LOG_EVENT_1A_INDEX) && (channel_index <= LOG_EVENT_2B_INDEX)))
+		return false;
+
+	return ((LOG_binary_mask & (1 << channel_index)) != 0);
+}
+
+/******************************************************************************
+** Function:	Add a write queue entry to STR_buffer as a binary record
+**
+** Notes:		len is number of chars already in STR_buffer. Returns new length.
+*/
+int log_binary_record(log_queue_type * p, int i, int file_index, int len)
+{
+	uint32 value;
+	int next;
+	int n;
+	int channel_index;
+
+	channel_index = file_index & ~LOG_DERIVED_MASK;
+	switch (p[i].data_type)
+	{
+	case LOG_DATA_VALUE:
+		value = STR_float_32_to_21((uint32)p[i].value);											// 21-bit value, MS byte first, type in top 3 bits
+		STR_buffer[len++] = LOG_BIN_VALUE | (uint8)((value >> 16) & 0x1F);
+		STR_buffer[len++] = (uint8)(value >> 8);
+		STR_buffer[len++] = (uint8)value;
+		if (++log_char_count[file_index] >= 26)													// track text line length for totaliser lines
+			log_char_count[file_index] = 0;
+		break;
+
+	case LOG_BLOCK_HEADER_TIMESTAMP:
+		next = log_chain_next[i];																// get parameters from next queue item for this file
+		if ((next != LOG_CHAIN_END) && (p[next].data_type == LOG_BLOCK_HEADER_PARAMS))
+			value = p[next].value;
+		else
+			value = log_create_block_header_params(file_index);									// get current parameters of channel
+		STR_buffer[len] = LOG_BIN_BLOCK_HEADER;
+		memcpy(&STR_buffer[len + 1], &p[i].value, 4);
+		memcpy(&STR_buffer[len + 5], &value, 4);
+		len += 9;
+		log_char_count[file_index] = 0;
+		break;
+
+	case LOG_BLOCK_FOOTER:
+#ifndef HDW_RS485
+	case LOG_TOTALISER_TIMESTAMP:
+#endif
+		n = 0;
+#ifndef HDW_RS485
+		if (p[i].data_type == LOG_TOTALISER_TIMESTAMP)
+		{
+			if (log_char_count[file_index] != 0)												// terminate line of values, as text file does
+				n = sprintf(&STR_buffer[len + 2], "\r\n");
+			n += log_totaliser_line(&STR_buffer[len + 2 + n], channel_index, p[i].value);
+		}
+		else
+#endif
+			n = log_block_footer(&STR_buffer[len + 2], channel_index);
+		if (n != 0)
+		{
+			STR_buffer[len] = LOG_BIN_TEXT;
+			STR_buffer[len + 1] = (uint8)n;
+			len += n + 2;
+		}
+		log_char_count[file_index] = 0;
+		break;
+
+	default:
+		break;
+	}
+
+	return len;
+}
+
+/******************************************************************************
+** Function:	Render a binary day file in the text format
+**
+** Notes:		Writes the .TXT file of the same name in the same directory, replacing any existing one,
+**				so host software can read the day's data as before. File system must be open. Uses STR_buffer.
+**				Needs both file slots, so files opened by CFS_open_file(), which suspends any open session.
+**				Returns number of records converted, or -1 if failed.
+*/
+int32 LOG_binary_to_text(char * path, char * filename)
+{
+	FSFILE *in, *out;
+	char name[13];
+	uint8 record[9];
+	RTC_type time_stamp;
+	uint32 value;
+	int32 count;
+	int len, n;
+	int name_index;
+	uint8 char_count;
+	bool ok;
+
+	n = strlen(filename);
+	if ((n < 5) || (n > sizeof(name) - 1) || !STR_match(&filename[n - 4], ".bin"))
+		return -1;
+	strcpy(name, filename);
+	in = CFS_open_file(path, name, "r");
+	if (in == NULL)
+		return -1;
+	strcpy(&name[n - 3], "TXT");
+	out = CFS_open_file(path, name, "w");													// also drops any cached copy
+	if (out == NULL)
+	{
+		CFS_close_file(in);
+		return -1;
+	}
+
+	memset(&time_stamp, 0, sizeof(time_stamp));
+	name_index = 0;
+	char_count = 0;
+	count = 0;
 	len = 0;
-	for (i = 0; i < log_write_length; i++)
+	ok = true;
+	while (ok && (FSfread(record, 1, 1, in) == 1))
 	{
-		file_index = channel_index;
-		if (log_write_sms)																		// look for SMS data for this channel
-			file_index |= LOG_SMS_MASK;
-		if (log_write_derived)																	// look for DERIVED data for this channel
-			file_index |= LOG_DERIVED_MASK;
-																								// print no more than 20 chars at a time, without flushing to file first
-																								// otherwise STR_buffer may overflow
-		if (p[i].channel_number == file_index)
+		switch (record[0] & LOG_BIN_TYPE_MASK)
 		{
-			if (file_index == LOG_ACTIVITY_INDEX)
+		case LOG_BIN_VALUE:
+			ok = (FSfread(&record[1], 1, 2, in) == 2);
+			if (ok)
 			{
-				if (len > 0)																	// go back to start of STR_buffer
-					FSfwrite(STR_buffer, len, 1, f);
-				j = RTC_sec_to_bcd(p[i].value & 0x0001FFFF);									// decode timestamp
-				len = sprintf(STR_buffer, "%02x%02x%02x ", BITS16TO23(j), BITS8TO15(j), BITS0TO7(j)); 
-				if (p[i].data_type > LOG_NUM_C_FILES)
-					p[i].data_type = LOG_NUM_C_FILES;			// decode file id
-				len += sprintf(&STR_buffer[len], " %s ", log_c_file[p[i].data_type]);			// add to output string
-																								// decode line number
-				len += sprintf(&STR_buffer[len], "%ld\r\n", (p[i].value >> 17) & 0x00007FFF);	// add to output string
+				value = ((uint32)(record[0] & 0x1F) << 16) | ((uint32)record[1] << 8) | record[2];
+				len += log_code_21(&STR_buffer[len], value);									// convert value to compressed ASCII
+				if (++char_count >= 26)															// add CRLF every 26 from last header
+				{
+					char_count = 0;
+					len += sprintf(&STR_buffer[len], "\r\n");
+				}
 			}
-			else if ((file_index & LOG_CONTROL_MASK) == LOG_CONTROL_MASK)						// if control logging
+			break;
+
+		case LOG_BIN_FILE_HEADER:
+			ok = (FSfread(&record[1], 1, 4, in) == 4);
+			if (ok)
 			{
-				if (len > 0)																	// go back to start of STR_buffer
-					FSfwrite(STR_buffer, len, 1, f);
-				j = RTC_sec_to_bcd(p[i].value & 0x0001FFFF);									// decode timestamp
-				len = sprintf(STR_buffer, "%02x:%02x:%02x,", BITS16TO23(j), BITS8TO15(j), BITS0TO7(j)); 
-				len += COP_value_to_string((uint8)((p[i].value >> 17) & 0x0000FF));				// add letters decoded from value and "\r\n" 
+				time_stamp.day_bcd = record[1];													// date & name for block headers
+				time_stamp.mth_bcd = record[2];
+				time_stamp.yr_bcd = record[3];
+				name_index = record[4];
 			}
-			else
+			break;
+
+		case LOG_BIN_BLOCK_HEADER:
+			ok = (FSfread(&record[1], 1, 8, in) == 8);
+			if (ok)
 			{
-				switch (p[i].data_type)
-				{
-				case LOG_DATA_VALUE:
-					if (log_write_sms)
-					{
-						fpn = *(float *)&p[i].value;											// write sms data uncompressed, one value per line
-						len += sprintf(&STR_buffer[len], "%1.3G\r\n", (double)fpn);
-					}
-					else
-					{
-						len += log_compress_value(&STR_buffer[len], (uint32)p[i].value);		// convert value to compressed ASCII
-						if (++log_char_count[file_index] >= 26)									// add CRLF every 26 from last header - separate counts for each channel
-						{
-							log_char_count[file_index] = 0;
-							len += sprintf(&STR_buffer[len], "\r\n");
-						}
-					}
-					break;
+				memcpy(&time_stamp.reg32[0], &record[1], 4);
+				memcpy(&value, &record[5], 4);
+				len += log_create_enqueued_block_header(&STR_buffer[len], name_index, &time_stamp, value);
+				char_count = 0;
+			}
+			break;
 
-				case LOG_EVENT_TIMESTAMP:
-					if (len > 0)																// go back to start of STR_buffer
-						FSfwrite(STR_buffer, len, 1, f);
-																								// encode event timestamp into 7 bit ASCII
-																								// convert value to compressed ASCII
-					len = log_code_event_value(STR_buffer, p[i].value);
-					if (++log_char_count[file_index] >= 20)										// add CRLF every 20 from last header - separate counts for each channel
-					{
-						log_char_count[file_index] = 0;
-						len += sprintf(&STR_buffer[len], "\r\n");
-					}
-					break;
-	
-				case LOG_EVENT_HEADER:
-																								// write single line event header
-					if (len > 0)																// go back to start of STR_buffer
-						FSfwrite(STR_buffer, len, 1, f);
-					strcpy(STR_buffer, log_use_string);											// get pre-fetched header
-					len = strlen(STR_buffer);
-					log_char_count[file_index] = 0;												// reset character counts for CRLF for file formatting
-					break;
-	
-				case LOG_BLOCK_HEADER_TIMESTAMP:												// write single line data header
-					if (len > 0)																// go back to start of STR_buffer
-						FSfwrite(STR_buffer, len, 1, f);
-					time_stamp.yr_bcd = log_yr_bcd;												// pack header date and time into RTC_type
-					time_stamp.mth_bcd = log_mth_bcd;
-					time_stamp.day_bcd = log_day_bcd;
-					time_stamp.reg32[0] = p[i].value;
-																								// get parameters from next queue item 
-																								// (will always be block header parameters for this channel, 
-																								// but better check)
-					if ((p[i+1].data_type == LOG_BLOCK_HEADER_PARAMS) && (p[i+1].channel_number == file_index))
-						j = p[i + 1].value;
-					else
-						j = log_create_block_header_params(file_index);							// get current parameters of channel
-																								// create block header
-					len = log_create_enqueued_block_header(STR_buffer, name_index, &time_stamp, j); 
-					log_char_count[file_index] = 0;												// reset character counts for CRLF for file formatting
-					break;
-	
+		case LOG_BIN_TEXT:
+			if (len > 0)																		// go back to start of STR_buffer
+				FSfwrite(STR_buffer, len, 1, out);
+			len = 0;
+			ok = (FSfread(record, 1, 1, in) == 1);
+			if (ok)
+			{
+				n = record[0];
+				ok = (FSfread(STR_buffer, 1, n, in) == n);
+				if (ok)
+					len = n;
+			}
+			char_count = 0;
+			break;
 
-				case LOG_BLOCK_FOOTER:															// write single line data footer
-					if (len > 0)																// go back to start of STR_buffer
-						FSfwrite(STR_buffer, len, 1, f);
-					len = 0;
-																								// fetch block footer
+		default:																				// not a binary day file
+			ok = false;
+			break;
+		}
 
-					if ((channel_index >= LOG_SERIAL_1_INDEX) && (channel_index < LOG_ANALOGUE_1_INDEX))
-					{
-						uint8 channel = channel_index - LOG_SERIAL_1_INDEX;
-						len = LOG_print_footer_min_max(STR_buffer, &MOD_channel_mins_time[channel], MOD_channel_mins[channel],
-																	&MOD_channel_maxes_time[channel], MOD_channel_maxes[channel]);
-						MOD_channel_mins[channel] = FLT_MAX;
-						memset(&MOD_channel_mins_time[channel], 0, sizeof(RTC_hhmmss_type));
-						MOD_channel_maxes[channel] = -FLT_MAX;
-						memset(&MOD_channel_maxes_time[channel], 0, sizeof(RTC_hhmmss_type));
-					}
-/*
-#ifndef HDW_RS485
-					if ((channel_index >= LOG_DIGITAL_1A_INDEX) && (channel_index <= LOG_DIGITAL_2B_INDEX))
-					{
-						len = DIG_create_block_footer(STR_buffer, channel_index - LOG_DIGITAL_1A_INDEX, log_write_sms, log_write_derived); 
-#else
-					if ((channel_index >= LOG_SERIAL_1_INDEX) && (channel_index < LOG_ANALOGUE_1_INDEX))
-					{
-						len = DOP_create_block_footer(STR_buffer, channel_index - LOG_SERIAL_1_INDEX, log_write_derived); 
+		if (ok)
+			count++;
+		if (len > sizeof(STR_buffer) - 80)														// no more room in STR_buffer
+		{
+			FSfwrite(STR_buffer, len, 1, out);
+			len = 0;
+		}
+	}
+
+	if (len > 0)																				// Write any remaining chars
+		FSfwrite(STR_buffer, len, 1, out);
+
+	CFS_close_file(out);
+	CFS_close_file(in);
+	return count;
+}
 #endif
 
-						// Add signal strength & batt volts to end of digital footer:
-						len += sprintf(&STR_buffer[len], ",%4.2f,%4.2f,%d%%\r\n",
-									(double)PWR_int_bat_volts, (double)PWR_ext_supply_volts, (COM_csq * 100) / 31);
-					}
-#ifndef HDW_GPS
-					else if ((channel_index >= LOG_ANALOGUE_1_INDEX) && (channel_index <= LOG_ANALOGUE_7_INDEX))
-						len = ANA_create_block_footer(STR_buffer, channel_index - LOG_ANALOGUE_1_INDEX, log_write_derived); 
+#ifdef LOG_PREALLOCATE_DAY_FILES
+/******************************************************************************
+** Function:	Trim day files written today back to their size
+**
+** Notes:		Called when the day closes, before the log date changes. Releases clusters
+**				preallocated but not used, and keeps each file's size as tomorrow's estimate.
+**				Returns false if file system not ready yet - call again.
+**				Only opens files that still exist - never recreates a file or directory deleted since.
+**				List is cleared even if there is no card, so it is not carried into the next day.
+*/
+bool log_trim_day_files(void)
+{
+	int i;
+	FSFILE *f;
+
+	for (i = 0; i < LOG_NUM_DEST_FILES; i++)
+	{
+		if (log_day_file_index[i] == 0)
+		{
+			log_day_file_bytes[i] = 0;															// not written today - no estimate
+			continue;
+		}
+
+		if (!CFS_open())
+			return false;																		// wait for file system
+
+		log_day_file_bytes[i] = 0;
+		if ((CFS_state == CFS_OPEN) &&															// no card - nothing to trim
+			log_day_file_name(log_day_file_index[i] - 1, false))
+		{
+			f = FSfopen(STR_buffer, "r+");														// existing file only
+			if (f != NULL)
+			{
+				FS_trim(f);
+				log_day_file_bytes[i] = f->size;
+				CFS_close_file(f);
+			}
+		}
+		log_day_file_index[i] = 0;
+	}
+
+	if ((CFS_state == CFS_OPEN) && CFS_chdir((char *)"\\LOGDATA", false))												// all trimmed - list not needed
+		FSremove((char *)LOG_PREALLOCATE_FILE);
+	log_prealloc_changed = false;
+	return true;
+}
+
+/******************************************************************************
+** Function:	Save list of day files written today
+**
+** Notes:		Written when a new file is preallocated, so files left with clusters beyond
+**				their end by a reset can be trimmed after it. File system must be open.
+*/
+void log_prealloc_save(void)
+{
+	FSFILE *f;
+	uint8 date[4];
+
+	log_prealloc_changed = false;
+	if (!CFS_chdir((char *)"\\LOGDATA", true))
+		return;
+	f = FSfopen((char *)LOG_PREALLOCATE_FILE, "w");
+	if (f == NULL)
+		return;
+
+	date[0] = log_day_bcd;
+	date[1] = log_mth_bcd;
+	date[2] = log_yr_bcd;
+	date[3] = 0;
+	FSfwrite(date, sizeof(date), 1, f);
+	FSfwrite(log_day_file_index, sizeof(log_day_file_index), 1, f);
+	CFS_close_file(f);
+}
+
+/******************************************************************************
+** Function:	Trim day files preallocated before a reset
+**
+** Notes:		Called once after reset, before any day file is written. Trims the files listed in
+**				LOG_PREALLOCATE_FILE, using the log date they were written for. File system must be open.
+*/
+void log_prealloc_recover(void)
+{
+	FSFILE *f;
+	uint8 date[4];
+	uint8 day, mth, yr;
+
+	if (CFS_state != CFS_OPEN)																	// card failed - try again later
+		return;
+	// else:
+
+	log_prealloc_check = false;
+	if (!CFS_chdir((char *)"\\LOGDATA", false))
+		return;
+	f = FSfopen((char *)LOG_PREALLOCATE_FILE, "r");
+	if (f == NULL)																				// nothing preallocated
+		return;
+	if ((FSfread(date, sizeof(date), 1, f) != 1) ||
+		(FSfread(log_day_file_index, sizeof(log_day_file_index), 1, f) != 1))
+	{
+		memset(log_day_file_index, 0, sizeof(log_day_file_index));
+		memset(date, 0, sizeof(date));
+	}
+	CFS_close_file(f);
+
+	day = log_day_bcd;
+	mth = log_mth_bcd;
+	yr = log_yr_bcd;
+	log_day_bcd = date[0];																		// day file names are for their log date
+	log_mth_bcd = date[1];
+	log_yr_bcd = date[2];
+	log_trim_day_files();																		// also removes list
+	log_day_bcd = day;
+	log_mth_bcd = mth;
+	log_yr_bcd = yr;
+}
 #endif
+
+/******************************************************************************
+** Function:	Write STR_buffer to day file in whole sectors
+**
+** Notes:		First write brings the file to a sector boundary, so each sector is written once.
+**				Remaining chars are moved to start of STR_buffer. If they still leave no room for
+**				another item (file just past a boundary), they are written as well. Returns new length.
 */
-					log_char_count[file_index] = 0;												// reset character counts for CRLF for file formatting
-					break;
+int log_write_sectors(FSFILE * f, int len)
+{
+	int n;
 
-#ifndef HDW_RS485
-				case LOG_TOTALISER_TIMESTAMP:
-					if (len > 0)																// go back to start of STR_buffer
+	n = LOG_WRITE_SECTOR_SIZE - (int)(f->size % LOG_WRITE_SECTOR_SIZE);						// chars to next sector boundary
+	while (len >= n)
+	{
+		FSfwrite(STR_buffer, n, 1, f);
+		len -= n;
+		memmove(STR_buffer, &STR_buffer[n], len);
+		n = LOG_WRITE_SECTOR_SIZE;
+	}
+
+	if (len > sizeof(STR_buffer) - LOG_WRITE_ITEM_MAX)
+	{
+		FSfwrite(STR_buffer, len, 1, f);
+		len = 0;
+	}
+	STR_buffer[len] = '\0';																	// COP_value_to_string() appends with strcat
+	return len;
+}
+
+/******************************************************************************
+** Function:	Write enqueued values to file system from log_queue_a or _b
+**
+** Notes:		Example path for normal logged data:	\LOGDATA\D1A\2009\05
+**														|-------|---|----|--|
+**														    A     B    C   D
+**				A = fixed path, B = channel id, C = year, D = month
+**				For SMS data, field A is \SMSDATA
+**				For control data, field A is \COPDATA 
+**
+**				Filenames include channel id, day & month, e.g. D1A-2705.TXT	NB changed from '_' to '-' 010909 PB
+*/
+void log_write_to_file(int channel_index)
+{
+	FSFILE *f;
+	int len;
+	int i;
+	int next;
+	int file_index;
+	int day_file;
+	int name_index = 0;
+#ifdef LOG_BINARY_RECORDS
+	bool binary;
+#endif
+	uint32 j;
+	log_queue_type *p;
+	float fpn;
+	RTC_type time_stamp;
+																								// File system already opened by LOG_task.
+	if ((LOG_state == LOG_BATT_DEAD) || (CFS_state != CFS_OPEN))
+		return;
+
+	// get contents of GPS.TXT if it exists
+	//CFS_read_line((char *)CFS_config_path, (char *)CFS_gps_name, 1, log_gps_string, 40);
+
+	p = log_a_active ? log_queue_b : log_queue_a;												// get pointer to the write queue, i.e. the one we're not logging into
+
+	file_index = channel_index;
+	if (log_write_sms)																			// look for SMS data for this channel
+		file_index |= LOG_SMS_MASK;
+	if (log_write_derived)																		// look for DERIVED data for this channel
+		file_index |= LOG_DERIVED_MASK;
+	if (log_chain_head[log_dest_index(file_index)] == LOG_CHAIN_END)
+		return;																					// nothing queued for this file
+
+	if ((channel_index >= LOG_EVENT_1A_INDEX) && (channel_index <= LOG_EVENT_2B_INDEX))
+	{
+		// pre-fetch event header in case we need it
+		// have to do this here as it needs data from event configure file and we cannot have two files open at once
+		time_stamp.yr_bcd = log_yr_bcd;															// pack header date into RTC_type
+		time_stamp.mth_bcd = log_mth_bcd;
+		time_stamp.day_bcd = log_day_bcd;
+																								// create event header
+		len = LOG_create_event_header(STR_buffer, channel_index, &time_stamp);
+		strcpy(log_use_string, STR_buffer); 
+	}
+	else if ((channel_index != LOG_ACTIVITY_INDEX) && ((channel_index & LOG_CONTROL_MASK) != LOG_CONTROL_MASK))
+		name_index = log_write_derived ? channel_index + 11 : channel_index;
+
+	day_file = file_index;
+#ifdef LOG_BINARY_RECORDS
+	binary = log_binary_file(file_index);
+	if (binary)
+		day_file |= LOG_BINARY_FILE;
+#endif
+	log_day_file_name(day_file, true);														// cd to path & get filename in STR_buffer
+	f = FSfopen(STR_buffer, "a");
+	if (f == NULL)
+		return;																					// not a lot we can do
+	LOG_flush_file_count++;
+#ifdef LOG_PREALLOCATE_DAY_FILES
+	i = log_dest_index(file_index);
+	if ((f->size == 0) && (log_day_file_bytes[i] != 0))										// new day file: preallocate yesterday's size + 1/8
+	{
+		j = log_day_file_bytes[i] + (log_day_file_bytes[i] >> 3);
+		FS_preallocate(f, (j > LOG_PREALLOCATE_MAX_BYTES) ? LOG_PREALLOCATE_MAX_BYTES : j);
+		log_prealloc_changed = true;
+	}
+	log_day_file_index[i] = day_file + 1;
+#endif
+																								// else print values to STR_buffer, then dump STR_buffer to file:
+
+	// NB no returns from here on, as we must close the file.
+	len = 0;
+#ifdef LOG_BINARY_RECORDS
+	if (binary && (f->size == 0))																// new binary file starts with its date & channel name
+	{
+		STR_buffer[0] = LOG_BIN_FILE_HEADER;
+		STR_buffer[1] = log_day_bcd;
+		STR_buffer[2] = log_mth_bcd;
+		STR_buffer[3] = log_yr_bcd;
+		STR_buffer[4] = (char)name_index;
+		len = 5;
+	}
+#endif
+	for (i = log_chain_head[log_dest_index(file_index)]; i != LOG_CHAIN_END; i = log_chain_next[i])
+	{
+		LOG_flush_scan_count++;
+																								// make room for the largest item (event header)
+		if (len > sizeof(STR_buffer) - LOG_WRITE_ITEM_MAX)
+			len = log_write_sectors(f, len);
+#ifdef LOG_BINARY_RECORDS
+		if (binary)
+			len = log_binary_record(p, i, file_index, len);
+		else
+#endif
+		if (file_index == LOG_ACTIVITY_INDEX)
+		{
+			j = RTC_sec_to_bcd(p[i].value & 0x0001FFFF);									// decode timestamp
+			len += sprintf(&STR_buffer[len], "%02x%02x%02x ", BITS16TO23(j), BITS8TO15(j), BITS0TO7(j)); 
+			if (p[i].data_type > LOG_NUM_C_FILES)
+				p[i].data_type = LOG_NUM_C_FILES;			// decode file id
+			len += sprintf(&STR_buffer[len], " %s ", log_c_file[p[i].data_type]);			// add to output string
+																							// decode line number
+			len += sprintf(&STR_buffer[len], "%ld\r\n", (p[i].value >> 17) & 0x00007FFF);	// add to output string
+		}
+		else if ((file_index & LOG_CONTROL_MASK) == LOG_CONTROL_MASK)						// if control logging
+		{
+			j = RTC_sec_to_bcd(p[i].value & 0x0001FFFF);									// decode timestamp
+			len += sprintf(&STR_buffer[len], "%02x:%02x:%02x,", BITS16TO23(j), BITS8TO15(j), BITS0TO7(j)); 
+			len += COP_value_to_string((uint8)((p[i].value >> 17) & 0x0000FF));				// add letters decoded from value and "\r\n" 
+		}
+		else
+		{
+			switch (p[i].data_type)
+			{
+			case LOG_DATA_VALUE:
+				if (log_write_sms)
+				{
+					fpn = *(float *)&p[i].value;											// write sms data uncompressed, one value per line
+					len += sprintf(&STR_buffer[len], "%1.3G\r\n", (double)fpn);
+				}
+				else
+				{
+					len += log_compress_value(&STR_buffer[len], (uint32)p[i].value);		// convert value to compressed ASCII
+					if (++log_char_count[file_index] >= 26)									// add CRLF every 26 from last header - separate counts for each channel
 					{
-						FSfwrite(STR_buffer, len, 1, f);
-						len = sprintf(STR_buffer, "\r\n");
+						log_char_count[file_index] = 0;
+						len += sprintf(&STR_buffer[len], "\r\n");
 					}
-					else
-						len = 0;
+				}
+				break;
 
+			case LOG_EVENT_TIMESTAMP:
+																							// encode event timestamp into 7 bit ASCII
+																							// convert value to compressed ASCII
+				len += log_code_event_value(&STR_buffer[len], p[i].value);
+				if (++log_char_count[file_index] >= 20)										// add CRLF every 20 from last header - separate counts for each channel
+				{
 					log_char_count[file_index] = 0;
-					
-					j = RTC_sec_to_bcd(p[i].value & 0x0001FFFF);
-					len += sprintf(&STR_buffer[len], "$%02x:%02x:%02x,", BITS16TO23(j), BITS8TO15(j), BITS0TO7(j));
-
-					len += DIG_print_totaliser_int(&STR_buffer[len],
-						&DIG_channel[(channel_index - 1) >> 1].sub[(channel_index - 1) & 1].totaliser.value_x10000);
-					i = DIG_channel[(channel_index - 1) >> 1].sub[(channel_index - 1) & 1].totaliser.value_x10000 % 10000;
-					len += sprintf(&STR_buffer[len], ".%04d\r\n", i);
-					break;
-#endif
+					len += sprintf(&STR_buffer[len], "\r\n");
+				}
+				break;
 
-				default:
-					break;
+			case LOG_EVENT_HEADER:
+																							// write single line event header
+				strcpy(&STR_buffer[len], log_use_string);									// get pre-fetched header
+				len += strlen(&STR_buffer[len]);
+				log_char_count[file_index] = 0;												// reset character counts for CRLF for file formatting
+				break;
+
+			case LOG_BLOCK_HEADER_TIMESTAMP:												// write single line data header
+				time_stamp.yr_bcd = log_yr_bcd;												// pack header date and time into RTC_type
+				time_stamp.mth_bcd = log_mth_bcd;
+				time_stamp.day_bcd = log_day_bcd;
+				time_stamp.reg32[0] = p[i].value;
+																							// get parameters from next queue item for this file
+																							// (will always be block header parameters for this channel, 
+																							// but better check)
+				next = log_chain_next[i];
+				if ((next != LOG_CHAIN_END) && (p[next].data_type == LOG_BLOCK_HEADER_PARAMS))
+					j = p[next].value;
+				else
+					j = log_create_block_header_params(file_index);							// get current parameters of channel
+#ifdef LOG_TIME_INDEX
+				if (log_index_count < LOG_INDEX_ENTRIES)									// header goes after chars buffered so far
+				{
+					log_index_entry[log_index_count].offset = f->size + len;
+					log_index_entry[log_index_count].time = (j & 0x00FF0000) << 8;
+					log_index_entry[log_index_count].time |= RTC_bcd_time_to_sec(time_stamp.hr_bcd, time_stamp.min_bcd, time_stamp.sec_bcd);
+					log_index_count++;
 				}
-			}
-			if (len > sizeof(STR_buffer) - 80)													// no more room in STR_buffer
-			{
-				FSfwrite(STR_buffer, len, 1, f);
-				len = 0;
+#endif
+																							// create block header
+				len += log_create_enqueued_block_header(&STR_buffer[len], name_index, &time_stamp, j); 
+				log_char_count[file_index] = 0;												// reset character counts for CRLF for file formatting
+				break;
+
+
+			case LOG_BLOCK_FOOTER:															// write single line data footer
+				len += log_block_footer(&STR_buffer[len], channel_index);					// fetch block footer
+				log_char_count[file_index] = 0;												// reset character counts for CRLF for file formatting
+				break;
+
+#ifndef HDW_RS485
+			case LOG_TOTALISER_TIMESTAMP:
+				if (log_char_count[file_index] != 0)										// end line of values - len may be 0 mid-line
+					len += sprintf(&STR_buffer[len], "\r\n");								// after log_write_sectors()
+
+				log_char_count[file_index] = 0;
+				len += log_totaliser_line(&STR_buffer[len], channel_index, p[i].value);
+				break;
+#endif
+
+			default:
+				break;
 			}
 		}
 	}
@@ -1155,6 +2200,17 @@ void log_write_to_file(int channel_index)
 		FSfwrite(STR_buffer, len, 1, f);
 
 	CFS_close_file(f);
+#ifdef LOG_JOURNAL
+	log_journal_checkpoint(log_dest_index(file_index));
+#endif
+#ifdef LOG_TIME_INDEX
+	if (log_index_count != 0)
+		log_write_index(day_file);
+#endif
+#ifdef LOG_PREALLOCATE_DAY_FILES
+	if (log_prealloc_changed)
+		log_prealloc_save();
+#endif
 }
 
 /******************************************************************************
@@ -1214,6 +2270,10 @@ void log_new_day_task(void)
 	}
 	else if ((log_write_mask | log_sms_write_mask | log_derived_write_mask | log_derived_sms_write_mask | log_control_write_mask) == 0x0000)	// all writes to file done
 	{
+#ifdef LOG_PREALLOCATE_DAY_FILES
+		if (!log_trim_day_files())																// release unused preallocated clusters
+			return;																			// wait for file system
+#endif
 		if ((COM_commissioning_mode == 1) && ALM_com_mode_alarm_enable) 						// check on commissioning status and enable flag
 		{
 			j = sprintf(STR_buffer, "dALARM=%02X%02X%02X,%02X:%02X:%02X,%s,",					// if 1, send the CM=1 alarm to all alarm numbers
@@ -1241,6 +2301,8 @@ void log_new_day_task(void)
 		if ((PWR_measurement_flags & PWR_MASK_BATT_ALARM_SENT) != 0)
 			PWR_tx_internal_batt_alarm();
 
+		if (log_mth_bcd != RTC_now.mth_bcd)														// new month - last month's directories no longer needed
+			CFS_dir_cache_clear();
 		log_yr_bcd = RTC_now.yr_bcd;															// Generate date used in logging path & filename for today
 		log_mth_bcd = RTC_now.mth_bcd;															// (also indicates that routine has run to completion)
 		log_day_bcd = RTC_now.day_bcd;
@@ -1345,14 +2407,37 @@ void LOG_task(void)
 		ALM_update_profile();														// trigger alarm profile fetch
 	}
 
-	if ((log_day_bcd != RTC_now.day_bcd) ||											// date has changed (normally midnight
-		(log_mth_bcd != RTC_now.mth_bcd) || 										// but also when power up and put date in)
-		(log_yr_bcd != RTC_now.yr_bcd))
+#ifdef LOG_PREALLOCATE_DAY_FILES
+	if (log_prealloc_check &&														// files preallocated before reset to trim
+		((log_write_mask | log_sms_write_mask | log_derived_write_mask | log_derived_sms_write_mask | log_control_write_mask) == 0x0000) &&
+		CFS_open())
+		log_prealloc_recover();
+#endif
+
+#ifdef LOG_JOURNAL
+	if (log_journal_replay &&														// values from before reset to write first
+		((log_write_mask | log_sms_write_mask | log_derived_write_mask | log_derived_sms_write_mask | log_control_write_mask) == 0x0000) &&
+		CFS_open())
+		log_journal_load();
+#endif
+
+#ifdef LOG_JOURNAL
+	if (!log_journal_replay &&														// log date is journal's while replaying
+#else
+	if (
+#endif
+		((log_day_bcd != RTC_now.day_bcd) ||										// date has changed (normally midnight
+		 (log_mth_bcd != RTC_now.mth_bcd) || 										// but also when power up and put date in)
+		 (log_yr_bcd != RTC_now.yr_bcd)))
 	{
 		log_new_day_task();															// does an immediate flush if required
 	}
 
+#ifdef LOG_JOURNAL
+	if (log_pending_flush && !log_journal_replay)									// replay goes before any other flush
+#else
 	if (log_pending_flush)
+#endif
 	{
 		
 #ifndef HDW_RS485
@@ -1370,6 +2455,9 @@ void LOG_task(void)
 		}
 		
 	}
+#ifdef LOG_JOURNAL
+	log_journal_task();
+#endif
 																					// if no pending writes to file
 	if ((log_write_mask | log_sms_write_mask | log_derived_write_mask | log_derived_sms_write_mask | log_control_write_mask) == 0x0000)
 		return;
@@ -1382,59 +2470,77 @@ void LOG_task(void)
 		log_queue_overflow = false;
 	}
 
-	mask = 0x0001;																	// find next log function which needs writing, & write it:
-	for (channel_index = 0; channel_index < LOG_NUM_FUNCTIONS; channel_index++)
+	if (log_pending_demux)															// flush just started
 	{
-		if ((log_write_mask & mask) != 0x0000)
-		{
-			log_write_to_file(channel_index);
-			log_write_mask &= ~mask;
-			break;
-		}
-		mask <<= 1;
+		log_demultiplex_queue();
+#ifdef LOG_JOURNAL
+		if (log_journal_replay)
+			log_journal_skip_done();													// files written before reset
+#endif
 	}
-																					// if we've finished emptying the write queue
-	if (log_write_mask == 0x0000)
+
+	do																				// write all pending files in this pass
 	{
-		if (log_sms_write_mask != 0x0000)											// if SMS to write
-		{
-			log_write_sms = true;													// do SMS data next
-			log_write_derived = false;
-			log_write_mask = log_sms_write_mask;
-			log_sms_write_mask = 0x0000;											// don't do them again
-		}
-		else if (log_derived_write_mask != 0x0000)									// if derived data to write
+		mask = 0x0001;																	// find next log function which needs writing, & write it:
+		for (channel_index = 0; channel_index < LOG_NUM_FUNCTIONS; channel_index++)
 		{
-			log_write_derived = true;												// then do derived data
-			log_write_sms = false;
-			log_write_mask = log_derived_write_mask;
-			log_derived_write_mask = 0x0000;										// don't do them again
+			if ((log_write_mask & mask) != 0x0000)
+			{
+				log_write_to_file(channel_index);
+				log_write_mask &= ~mask;
+				break;
+			}
+			mask <<= 1;
 		}
-		else if (log_derived_sms_write_mask != 0x0000)								// if derived sms data to write
+																						// if we've finished emptying the write queue
+		if (log_write_mask == 0x0000)
 		{
-			log_write_derived = true;												// then do derived SMS data
-			log_write_sms = true;
-			log_write_mask = log_derived_sms_write_mask;
-			log_derived_sms_write_mask = 0x0000;									// don't do them again
+			if (log_sms_write_mask != 0x0000)											// if SMS to write
+			{
+				log_write_sms = true;													// do SMS data next
+				log_write_derived = false;
+				log_write_mask = log_sms_write_mask;
+				log_sms_write_mask = 0x0000;											// don't do them again
+			}
+			else if (log_derived_write_mask != 0x0000)									// if derived data to write
+			{
+				log_write_derived = true;												// then do derived data
+				log_write_sms = false;
+				log_write_mask = log_derived_write_mask;
+				log_derived_write_mask = 0x0000;										// don't do them again
+			}
+			else if (log_derived_sms_write_mask != 0x0000)								// if derived sms data to write
+			{
+				log_write_derived = true;												// then do derived SMS data
+				log_write_sms = true;
+				log_write_mask = log_derived_sms_write_mask;
+				log_derived_sms_write_mask = 0x0000;									// don't do them again
+			}
 		}
-	}
-																					// if all data logging is done
-	if ((log_write_mask | log_sms_write_mask | log_derived_write_mask | log_derived_sms_write_mask) == 0x0000)
-	{
-		log_write_sms = false;														// clear sms and derived flags	
-		log_write_derived = false;
-		mask = 0x0001;																// find next control output log function which needs writing, & write it:
-		for (channel_index = 1; channel_index <= LOG_NUM_CONTROL_CHANNELS; channel_index++)
+																						// if all data logging is done
+		if ((log_write_mask | log_sms_write_mask | log_derived_write_mask | log_derived_sms_write_mask) == 0x0000)
 		{
-			if ((log_control_write_mask & mask) != 0x0000)
+			log_write_sms = false;														// clear sms and derived flags	
+			log_write_derived = false;
+			mask = 0x0001;																// find next control output log function which needs writing, & write it:
+			for (channel_index = 1; channel_index <= LOG_NUM_CONTROL_CHANNELS; channel_index++)
 			{
-				log_write_to_file(LOG_CONTROL_MASK | channel_index);
-				log_control_write_mask &= ~mask;
-				break;
+				if ((log_control_write_mask & mask) != 0x0000)
+				{
+					log_write_to_file(LOG_CONTROL_MASK | channel_index);
+					log_control_write_mask &= ~mask;
+					break;
+				}
+				mask <<= 1;
 			}
-			mask <<= 1;
+			if (channel_index > LOG_NUM_CONTROL_CHANNELS)								// no valid control output bits left
+				log_control_write_mask = 0x0000;
 		}
-	}
+	} while ((log_write_mask | log_sms_write_mask | log_derived_write_mask | log_derived_sms_write_mask | log_control_write_mask) != 0x0000);
+
+#ifdef LOG_JOURNAL
+	log_journal_flushed();																// journal's write queue entries now in day files
+#endif
 }
 
 /******************************************************************************
@@ -1468,6 +2574,17 @@ void LOG_init(void)
 	log_yr_bcd = RTC_now.yr_bcd;
 	log_mth_bcd = RTC_now.mth_bcd;
 	log_day_bcd = RTC_now.day_bcd;
+
+#ifdef LOG_PREALLOCATE_DAY_FILES
+	log_prealloc_check = true;														// trim files preallocated before reset
+#endif
+#ifdef LOG_JOURNAL
+	log_journal_replay = true;														// write values left in journal by reset
+	log_journal_header.magic = 0;													// header to be read from journal
+	log_journal_w = 0;
+	log_journal_a = 0;
+	log_journal_swaps = log_swap_count;
+#endif
 }
 
 /******************************************************************************
@@ -18,6 +18,10 @@
 **
 ** V3.33 251113 PB change control output logging indices and masks
 **
+** V6.03 171026    add flush statistics for #LQS
+**					add LOG_binary_mask & LOG_binary_to_text() for binary day files
+**					add LOG_index_find() for time-indexed day files
+**					add log queue high water marks & lost value count for #LQS
 */
 
 // Logging function indices:
@@ -108,6 +112,14 @@
 #define LOG_TOTALISER_LS			8		// integer part LS 32 bits
 #define LOG_TOTALISER_MS			9		// integer part MS 32 bits
 
+// Binary day files - not for GPS product, whose block headers include live GPS data
+#ifndef HDW_GPS
+#define LOG_BINARY_RECORDS
+#endif
+
+// Sidecar .IDX file for each text day file, giving position & time of each block header
+#define LOG_TIME_INDEX
+
 // Logging states:
 #define LOG_BATT_DEAD				0		// danger of corrupting file system
 #define LOG_STOPPED					1		// transducers off, no measurement
@@ -132,8 +144,21 @@ extern uint16 LOG_derived_sms_header_mask;
 
 extern uint32 LOG_wakeup_time;
 
+// Flush statistics, reported by #LQS
+extern uint16 LOG_flush_count;			// flushes started
+extern uint16 LOG_flush_scan_count;		// queue entries examined by the last flush
+extern uint16 LOG_flush_file_count;		// files appended by the last flush
+extern uint16 LOG_queue_high_water;		// most entries in active log queue
+extern uint16 LOG_spill_high_water;		// most entries in overflow ring
+extern uint16 LOG_values_lost;			// values dropped because queue and overflow ring full
+
 extern LOG_config_type LOG_config;
 
+#ifdef LOG_BINARY_RECORDS
+// Bit set for each channel index whose logged data is written to a binary .BIN day file, set by #LBF
+extern uint16 LOG_binary_mask;
+#endif
+
 #ifndef extern
 extern const char LOG_channel_id[LOG_NUM_FUNCTIONS][4];
 extern const uint32 LOG_interval_sec[];
@@ -151,6 +176,12 @@ bool LOG_busy(void);
 void LOG_init(void);
 void LOG_task(void);
 int LOG_print_footer_min_max(char * string, RTC_hhmmss_type *p_t1, float v1, RTC_hhmmss_type *p_t2, float v2);
+#ifdef LOG_BINARY_RECORDS
+int32 LOG_binary_to_text(char * path, char * filename);
+#endif
+#ifdef LOG_TIME_INDEX
+long LOG_index_find(char * path, char * filename, uint32 time_secs, uint16 n_before);
+#endif
 
 
 
@@ -34,6 +34,11 @@
 **					call PWR_set_pending_batt_test() when ignite modem
 **
 ** V3.31 141113 PB  in MDM_task state MDM_CONFIG shut down if file system not open
+**
+** V6.03 171026     mdm_do_next_line() reads AT script through a CFS session instead of CFS_read_line()
+**					new fn MDM_send_data() for blocks of data in data mode
+**					strings sent to modem by U2 TX interrupt instead of one char per MDM_task() call
+**					MDM_CONFIG sets \CONFIG as working folder before renaming mdmcfg.ats, as the script session doesn't
 */
 
 #include <string.h>
@@ -122,12 +127,16 @@ uint32 mdm_time_on;
 int mdm_20ms_timer;
 
 int mdm_line_number;	// used for scripts, and as index into mdm_init_commands
+FAR CFS_session_type mdm_script_session;	// position in script file
 
 uint8 mdm_wait_count;
 uint8 mdm_previous_state_flag;
 
 char *mdm_monitor_ptr;
 
+char * volatile mdm_tx_isr_ptr;		// next char to send from TX interrupt, NULL when string sent
+bool mdm_tx_active;					// TX interrupt started on string at MDM_tx_ptr
+
 const char mdm_config_script[] = "mdmcfg.ats";
 const char mdm_config_script_done[] = "mdmdone.ats";
 
@@ -154,6 +163,29 @@ void __attribute__((__interrupt__, no_auto_psv)) _U2RXInterrupt(void)
 		mdm_rx_index++;
 	MDM_rx_buffer[mdm_rx_index] = '\0';				// string terminate it
 }
+
+/******************************************************************************
+** Function:	Modem serial transmit interrupt
+**
+** Notes:		Keeps TX FIFO full until end of string, then disables itself.
+**				CTS flow control holds the FIFO if the modem is busy.
+**				auto_psv as string may be a constant in program memory.
+*/
+void __attribute__((__interrupt__, auto_psv)) _U2TXInterrupt(void)
+{
+	_U2TXIF = false;
+
+	while (!U2STAbits.UTXBF)						// fill TX FIFO
+	{
+		if (*mdm_tx_isr_ptr == '\0')				// finished transmitting string
+		{
+			mdm_tx_isr_ptr = NULL;
+			_U2TXIE = false;
+			break;
+		}
+		U2TXREG = *mdm_tx_isr_ptr++;
+	}
+}
 #endif
 /******************************************************************************
 ** Function:	Change in time within same day action
@@ -261,6 +293,9 @@ bool MDM_log_use(void)
 */
 void mdm_tx_string(char *s)
 {
+	_U2TXIE = false;								// abandon any string still going
+	mdm_tx_isr_ptr = NULL;
+	mdm_tx_active = false;
 	MDM_tx_ptr = s;
 	USB_monitor_string(s);
 }
@@ -300,6 +335,21 @@ void MDM_send_cmd(char *p)
 #endif
 }
 
+/******************************************************************************
+** Function:	Send next block of data to modem in data mode
+**
+** Notes:		No delay before tx and no retry - follows straight on from the previous
+**				block, with the modem pacing the UART by CTS flow control
+*/
+void MDM_send_data(char *p)
+{
+#ifndef HDW_PRIMELOG_PLUS
+	MDM_send_cmd(p);
+	MDM_retry_ptr = NULL;
+	MDM_tx_delay_timer_x20ms = 0;
+#endif
+}
+
 /******************************************************************************
 ** Function:	Poll for response to modem command
 **
@@ -377,8 +427,10 @@ bool mdm_do_next_line(const char *filename)
 {
 	int i;
 
-	i = CFS_read_line((char *)CFS_config_path, (char *)filename, mdm_line_number++,
-					  MDM_tx_buffer, sizeof(MDM_tx_buffer));
+	if (mdm_line_number == 1)				// start of script
+		CFS_session_open(&mdm_script_session, (char *)CFS_config_path, (char *)filename);
+	i = CFS_session_read_line(&mdm_script_session, MDM_tx_buffer, sizeof(MDM_tx_buffer));
+	mdm_line_number++;
 	
 	if ((i > 0) && (i < sizeof(MDM_tx_buffer) - 1))	// got a line
 	{
@@ -390,6 +442,7 @@ bool mdm_do_next_line(const char *filename)
 		return true;
 	}
 	// else									// no script, or finished config commands
+	CFS_session_close(&mdm_script_session);
 
 	if (mdm_line_number == 2)				// we failed to get the first line
 		mdm_line_number = 0;
@@ -583,8 +636,8 @@ bool MDM_ready(bool ignore_registration)
 			{
 				if (mdm_line_number > 0)											// script must exist, so rename
 				{
-					if (CFS_state == CFS_OPEN)
-					{																					// Working folder has already been set by cfs_open_file
+					if ((CFS_state == CFS_OPEN) && CFS_chdir((char *)CFS_config_path, false))	// script session doesn't leave working folder set
+					{
 						FSremove(mdm_config_script_done);								// Remove any old ones prior to renaming this
 						f = FSfopen(mdm_config_script, "r");
 						if (f != NULL)
@@ -794,6 +847,8 @@ void MDM_power_off(void)
 	USB_monitor_prompt("Modem power OFF");
 	LOG_enqueue_value(LOG_ACTIVITY_INDEX, LOG_MDM_FILE, __LINE__);				// Modem power OFF
 	U2MODEbits.UARTEN = false;
+	_U2TXIE = false;
+	mdm_tx_active = false;
 	MDM_tx_ptr = NULL;
 	MDM_state = MDM_OFF;
 #endif
@@ -896,8 +951,8 @@ void MDM_task(void)
 			MDM_cmd_timer_x20ms--;
 	}
 	
-	// If we have a char to tx, check if tx buffer free & sufficient delay between commands
-	if ((MDM_tx_ptr != NULL) && !U2STAbits.UTXBF && (MDM_tx_delay_timer_x20ms == 0))
+	// If we have a string to tx, start TX interrupt after sufficient delay between commands
+	if ((MDM_tx_ptr != NULL) && !mdm_tx_active && (MDM_tx_delay_timer_x20ms == 0))
 	{
 		if (HDW_MODEM_DTR_N)						// modem UART currently in standby
 		{
@@ -907,17 +962,21 @@ void MDM_task(void)
 		}
 		else
 		{
-			U2TXREG = *MDM_tx_ptr++;
-			if (*MDM_tx_ptr == '\0')				// finished transmitting string
-			{
-				MDM_tx_ptr = NULL;
-				if (MDM_cmd_timer_x20ms < MDM_CMD_TIMEOUT_X20MS)
-					MDM_cmd_timer_x20ms = MDM_CMD_TIMEOUT_X20MS;
-				// else leave timeout as-is
-				MDM_cmd_status = MDM_CMD_BUSY;
-			}
+			mdm_tx_isr_ptr = MDM_tx_ptr;
+			mdm_tx_active = true;
+			_U2TXIF = true;							// interrupt fills the FIFO
+			_U2TXIE = true;
 		}
 	}
+	else if (mdm_tx_active && (mdm_tx_isr_ptr == NULL))	// finished transmitting string
+	{
+		mdm_tx_active = false;
+		MDM_tx_ptr = NULL;
+		if (MDM_cmd_timer_x20ms < MDM_CMD_TIMEOUT_X20MS)
+			MDM_cmd_timer_x20ms = MDM_CMD_TIMEOUT_X20MS;
+		// else leave timeout as-is
+		MDM_cmd_status = MDM_CMD_BUSY;
+	}
 #endif
 }
 
@@ -934,6 +993,8 @@ void MDM_init(void)
 	CNEN4bits.CN48IE = 0;														// disengage CN48 interrupt
 	HDW_MODEM_IGNITION = false;
 	U2MODEbits.UARTEN = false;
+	_U2TXIE = false;
+	mdm_tx_active = false;
 	SLP_set_required_clock_speed();
 	mdm_total_use = 0;
 	MDM_tx_ptr = NULL;
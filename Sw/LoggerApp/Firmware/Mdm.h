@@ -14,6 +14,8 @@
 ** V2.90 090811 PB  DEL152 - new modem ready state MDM_TEST_WAIT for a delay before ready for sigtst and nwtst
 **
 ** V3.01 140612 PB  removed MDM_retry()
+**
+** V6.03 171026     new fn MDM_send_data()
 */
 
 #ifndef HDW_PRIMELOG_PLUS
@@ -71,6 +73,7 @@ void MDM_recalc_wakeup(void);
 void MDM_task(void);
 void MDM_clear_rx_buffer(void);
 void MDM_send_cmd(char *p);
+void MDM_send_data(char *p);
 bool MDM_clear_to_send(void);
 bool MDM_do_command_file(char *filename);
 bool MDM_can_sleep(void);
@@ -25,10 +25,16 @@
 ** V3.17 091012 PB  Waste Water - bring up to date with Xilog+ V3.06 - use return value of CFS_open() in MSG_remove()
 **
 ** V3.26 180613 PB  Remove CFS_FAILED_TO_OPEN state 
+**
+** V6.03 171026     sequence-numbered outboxes - messages numbered in the order queued, head & tail numbers kept in
+**					\Outbox\SMS.IDX & \Outbox\FTP.IDX, so msg_find_next(), MSG_remove() & purging the oldest message
+**					don't scan the outbox directory. Index rebuilt from the directory if missing or bad.
+**					part data message merged into youngest ftp message if it carries on from it - one upload per day
 */
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "custom.h"
 #include "compiler.h"
@@ -47,43 +53,174 @@
 #include "log.h"
 
 #define MSG_MAX_OUTBOX_SIZE		20		// files
+#define MSG_MAX_INDEX_SPAN		1000	// more than this between head & tail of index means index is bad
+
+// Outbox index: messages are named MSGnnnnn.MSG, numbered from head to tail - 1 in the order queued.
+// Saved in \Outbox\SMS.IDX & \Outbox\FTP.IDX as "head,tail", so next message to send or oldest to purge
+// is named without scanning the outbox directory.
+typedef struct
+{
+	uint16 head;						// number of oldest message
+	uint16 tail;						// number given to next message queued
+} msg_index_type;
 
-uint16 msg_new_msg_number;
+msg_index_type msg_index[2];			// [FTP_OUTBOX], [SMS_OUTBOX]
+bool msg_index_valid[2];
+uint16 msg_out_number;					// number of message in msg_out_filename
 
 char msg_in_filename[CFS_FILE_NAME_SIZE];
 char msg_out_filename[CFS_FILE_NAME_SIZE];
 char msg_outbox_buffer[MSG_BUFFER_LENGTH];		// buffer for message going into outbox
 
+const char msg_outbox_root_path[] = "\\Outbox";
 const char msg_sms_outbox_path[] = "\\Outbox\\sms";
 const char msg_ftp_outbox_path[] = "\\Outbox\\ftp";
 
 /******************************************************************************
-** Function:	Find youngest or oldest message in given outbox, according to config
+** Function:	Get path of given outbox
 **
-** Notes:		Returns true for success, false if file system unavailable.
-**				Result in msg_out_filename.
+** Notes:
 */
-bool msg_find_next(bool outbox)
+char * msg_outbox_path(bool outbox)
 {
-	char * outbox_path;
-	int  * files_in_outbox_p;
+	return (outbox == SMS_OUTBOX) ? (char *)msg_sms_outbox_path : (char *)msg_ftp_outbox_path;
+}
 
-	if (outbox == SMS_OUTBOX)
+/******************************************************************************
+** Function:	Save index of given outbox to its index file, and update number of files in outbox
+**
+** Notes:		File system must be open
+*/
+void msg_save_index(bool outbox)
+{
+	msg_index_type * p = &msg_index[outbox ? 1 : 0];
+	char buffer[16];
+
+	*(outbox ? &MSG_files_in_sms_outbox : &MSG_files_in_ftp_outbox) = (int)(uint16)(p->tail - p->head);
+	sprintf(buffer, "%u,%u\r\n", p->head, p->tail);
+	CFS_write_file((char *)msg_outbox_root_path, (outbox ? "SMS.IDX" : "FTP.IDX"), "w", buffer, strlen(buffer));
+}
+
+/******************************************************************************
+** Function:	Rebuild index of given outbox from message files in it
+**
+** Notes:		Numbers wrap from 65535 to 0, so if there are numbers near both ends the
+**				oldest is the lowest in the top half. File system must be open.
+*/
+void msg_rebuild_index(bool outbox)
+{
+	msg_index_type * p = &msg_index[outbox ? 1 : 0];
+	SearchRec rec;
+	uint16 n, lo_min, lo_max, hi_min, hi_max;
+	bool lo, hi;
+
+	lo = false;
+	hi = false;
+	lo_min = 0xFFFF;
+	lo_max = 0;
+	hi_min = 0xFFFF;
+	hi_max = 0;
+	if ((FSchdir(msg_outbox_path(outbox)) == 0) && (FindFirst("*.*", ATTR_MASK & ~ATTR_DIRECTORY, &rec) == 0))
 	{
-		outbox_path = (char *)msg_sms_outbox_path;
-		files_in_outbox_p = &MSG_files_in_sms_outbox;
+		do
+		{
+			if (!STR_match(rec.filename, "msg") || (sscanf(&rec.filename[3], "%u", &n) != 1))
+				continue;
+			if (n < 0x8000)
+			{
+				lo = true;
+				if (n < lo_min) lo_min = n;
+				if (n > lo_max) lo_max = n;
+			}
+			else
+			{
+				hi = true;
+				if (n < hi_min) hi_min = n;
+				if (n > hi_max) hi_max = n;
+			}
+		} while (FindNext(&rec) == 0);
+	}
+
+	if (lo && hi && ((uint16)(hi_max - lo_min) > 0x8000))		// numbers have wrapped
+	{
+		p->head = hi_min;
+		p->tail = lo_max + 1;
+	}
+	else if (lo || hi)
+	{
+		p->head = lo ? lo_min : hi_min;
+		p->tail = (hi ? hi_max : lo_max) + 1;
 	}
 	else
 	{
-		outbox_path = (char *)msg_ftp_outbox_path;
-		files_in_outbox_p = &MSG_files_in_ftp_outbox;
+		p->head = 0;
+		p->tail = 0;
 	}
+}
+
+/******************************************************************************
+** Function:	Load index of given outbox if not already loaded
+**
+** Notes:		Rebuilds it from the outbox directory if no index file or it is bad.
+**				Returns false if file system unavailable.
+*/
+bool msg_load_index(bool outbox)
+{
+	msg_index_type * p = &msg_index[outbox ? 1 : 0];
+	char buffer[16];
+
+	if (msg_index_valid[outbox ? 1 : 0])
+		return true;
+
+	if (!CFS_open() || (CFS_state != CFS_OPEN))
+		return false;
+
+	if (!CFS_read_file((char *)msg_outbox_root_path, (outbox ? "SMS.IDX" : "FTP.IDX"), buffer, sizeof(buffer)) ||
+		(sscanf(buffer, "%u,%u", &p->head, &p->tail) != 2) || ((uint16)(p->tail - p->head) > MSG_MAX_INDEX_SPAN))
+		msg_rebuild_index(outbox);
+
+	msg_index_valid[outbox ? 1 : 0] = true;
+	msg_save_index(outbox);
+	return true;
+}
+
+/******************************************************************************
+** Function:	Drop message number n from index of given outbox
+**
+** Notes:		Only the oldest or youngest can be dropped. A gap left by any other is
+**				dropped when it reaches the head or tail. File system must be open.
+*/
+void msg_drop(bool outbox, uint16 n)
+{
+	msg_index_type * p = &msg_index[outbox ? 1 : 0];
+
+	if (p->head == p->tail)
+		return;
 
-	*files_in_outbox_p = COM_schedule.tx_oldest_first ?
-						 CFS_find_oldest_file(outbox_path, msg_out_filename) :
-						 CFS_find_youngest_file(outbox_path, msg_out_filename);
+	if (n == p->head)
+		p->head++;
+	else if (n == (uint16)(p->tail - 1))
+		p->tail--;
+	msg_save_index(outbox);
+}
+
+/******************************************************************************
+** Function:	Find youngest or oldest message in given outbox, according to config
+**
+** Notes:		Returns true for success, false if file system unavailable.
+**				Result in msg_out_filename & msg_out_number. Updates number of files in outbox.
+*/
+bool msg_find_next(bool outbox)
+{
+	msg_index_type * p = &msg_index[outbox ? 1 : 0];
 
-	return (*files_in_outbox_p >= 0);
+	if (!msg_load_index(outbox))
+		return false;
+
+	*(outbox ? &MSG_files_in_sms_outbox : &MSG_files_in_ftp_outbox) = (int)(uint16)(p->tail - p->head);
+	msg_out_number = COM_schedule.tx_oldest_first ? p->head : p->tail - 1;
+	sprintf(msg_out_filename, "MSG%05u.msg", msg_out_number);
+	return true;
 }
 
 /******************************************************************************
@@ -91,29 +228,31 @@ bool msg_find_next(bool outbox)
 **
 ** Notes:		If file system not available returns false.
 **				If no message to send, MSG_tx_buffer becomes empty string.
+**				Message files which have gone are dropped from the index.
 */
 bool MSG_get_message_to_tx(bool outbox)
 {
 	int i;
-	char * outbox_path;
 
-	if (!msg_find_next(outbox))
-		return false;
+	do
+	{
+		if (!msg_find_next(outbox))
+			return false;
 
-	MSG_tx_buffer[0] = '\0';					// default: nothing to Tx.
+		MSG_tx_buffer[0] = '\0';					// default: nothing to Tx.
+		if (*(outbox ? &MSG_files_in_sms_outbox : &MSG_files_in_ftp_outbox) == 0)
+		{
+			msg_out_filename[0] = '\0';
+			return true;
+		}
 
-	if (outbox == SMS_OUTBOX)
-	{
-		outbox_path = (char *)msg_sms_outbox_path;
-	}
-	else
-	{
-		outbox_path = (char *)msg_ftp_outbox_path;
-	}
+		if (CFS_read_file(msg_outbox_path(outbox), msg_out_filename, MSG_tx_buffer, sizeof(MSG_tx_buffer)))
+			break;
+		if (CFS_state != CFS_OPEN)
+			return false;							// leave tx buffer empty
 
-	if (!CFS_read_file((char *)outbox_path, msg_out_filename, MSG_tx_buffer, sizeof(MSG_tx_buffer)))
-		return false;							// leave tx buffer empty
-	// else:
+		msg_drop(outbox, msg_out_number);			// no such file
+	} while (true);
 
 	// string-terminate destination field
 	for (MSG_body_index = 3; MSG_body_index < sizeof(MSG_tx_buffer); MSG_body_index++)
@@ -169,40 +308,20 @@ bool MSG_remove(bool outbox)
 	if (!CFS_open())															// wait for file system
 		return false;
 
-	if (CFS_state == CFS_OPEN)
+	if ((CFS_state == CFS_OPEN) && (msg_out_filename[0] != '\0'))
 	{
-		if (outbox == SMS_OUTBOX)
+		if (FSchdir(msg_outbox_path(outbox)) != 0)								// select outbox directory
 		{
-			if (FSchdir((char *)msg_sms_outbox_path) != 0)							// select sms outbox directory
-			{
-				MSG_init();															// cannot find outbox - major fault - remake outboxes
-				return true;
-			}
-			if (FSremove(msg_out_filename) == 0)									// Remove file
-			{
-				sprintf(STR_buffer, "File removed from sms outbox: %s", msg_out_filename);
-				USB_monitor_string(STR_buffer);
-				MSG_files_in_sms_outbox--;
-			}
-			else
-				MSG_files_in_sms_outbox = -1;
+			MSG_init();															// cannot find outbox - major fault - remake outboxes
+			return true;
 		}
-		else
+		if (FSremove(msg_out_filename) == 0)									// Remove file
 		{
-			if (FSchdir((char *)msg_ftp_outbox_path) != 0)							// select ftp outbox directory
-			{
-				MSG_init();															// cannot find outbox - major fault - remake outboxes
-				return true;
-			}
-			if (FSremove(msg_out_filename) == 0)									// Remove file
-			{
-				sprintf(STR_buffer, "File removed from ftp outbox: %s", msg_out_filename);
-				USB_monitor_string(STR_buffer);
-				MSG_files_in_ftp_outbox--;
-			}
-			else
-				MSG_files_in_ftp_outbox = -1;
+			sprintf(STR_buffer, "File removed from %s outbox: %s", (outbox == SMS_OUTBOX) ? "sms" : "ftp", msg_out_filename);
+			USB_monitor_string(STR_buffer);
 		}
+		if (msg_load_index(outbox))												// file gone either way
+			msg_drop(outbox, msg_out_number);
 	}
 
 	MSG_tx_buffer[0] = '\0';													// clear tx buffer
@@ -226,6 +345,69 @@ void MSG_send(char type, char *msg, char *destination)
 	sprintf(&msg_outbox_buffer[1], "\r\n%s\r\n%s\r\n", destination, msg);
 }
 
+/******************************************************************************
+** Function:	Get pointer to body of message in buffer
+**
+** Notes:		Message is type\r\nDestination\r\nMessage\r\n. Returns NULL if not found.
+*/
+char * msg_body(char * p)
+{
+	p = strstr(&p[3], "\r\n");
+	return (p == NULL) ? NULL : p + 2;
+}
+
+/******************************************************************************
+** Function:	Merge part data message in outbox in buffer into youngest message in ftp outbox
+**
+** Notes:		Only if youngest is part data for the same day and channels, each channel
+**				carries on from where it ended, and it is not being transmitted. The merged
+**				message keeps the old seek positions & timestamps with the new end positions,
+**				so the data goes up in one file. Uses STR_buffer.
+**				Returns true if merged - in buffer can then be discarded.
+*/
+bool msg_merge_part_data(void)
+{
+	msg_index_type * p = &msg_index[0];
+	char * old_body;
+	char * new_body;
+	int i, len;
+
+	if ((msg_outbox_buffer[0] != MSG_TYPE_FTP_PART_DATA) || (p->head == p->tail))
+		return false;
+
+	if ((msg_out_filename[0] != '\0') && (msg_out_number == (uint16)(p->tail - 1)))
+		return false;											// youngest is being transmitted
+
+	sprintf(msg_in_filename, "MSG%05u.msg", p->tail - 1);
+	if (!CFS_read_file((char *)msg_ftp_outbox_path, msg_in_filename, STR_buffer, MSG_BUFFER_LENGTH) ||
+		(STR_buffer[0] != MSG_TYPE_FTP_PART_DATA) || (memcmp(&STR_buffer[3], &msg_outbox_buffer[3], 6) != 0))
+		return false;											// not part data for same day
+
+	old_body = msg_body(STR_buffer);
+	new_body = msg_body(msg_outbox_buffer);
+	if ((old_body == NULL) || (new_body == NULL) || (memcmp(old_body, new_body, 5) != 0))
+		return false;											// not same channel flags
+
+	len = strlen(old_body);
+	if (len != strlen(new_body))
+		return false;
+
+	// body is "ffff ssssssss eeeeeeee ..." - each new seek pos must follow on from old end pos
+	for (i = 5; i + 18 <= len; i += 18)
+	{
+		if (strtoul(&new_body[i], NULL, 16) != strtoul(&old_body[i + 9], NULL, 16) + 1)
+			return false;
+	}
+	for (i = 5; i + 18 <= len; i += 18)
+		memcpy(&old_body[i + 9], &new_body[i + 9], 8);
+
+	if (!CFS_write_file((char *)msg_ftp_outbox_path, msg_in_filename, "w", STR_buffer, strlen(STR_buffer)))
+		return false;
+
+	USB_monitor_string("Part data merged into ftp outbox");
+	return true;
+}
+
 /******************************************************************************
 ** Function:	Flush outbox in buffer to file in outbox directory
 **
@@ -259,21 +441,19 @@ void MSG_flush_outbox_buffer(bool initiate_tx)
 		return;
 	}
 
-	sprintf(msg_in_filename, "MSG%05u.msg", msg_new_msg_number++);
-	if (is_sms)
+	if (msg_load_index(is_sms))
 	{
-		if (CFS_write_file((char *)msg_sms_outbox_path, msg_in_filename, "w", msg_outbox_buffer, strlen(msg_outbox_buffer)))
-		{
+		if (!is_sms && msg_merge_part_data())
 			msg_outbox_buffer[0] = '\0';				// buffer now empty
-			MSG_files_in_sms_outbox++;
-		}
-	}
-	else
-	{
-		if (CFS_write_file((char *)msg_ftp_outbox_path, msg_in_filename, "w", msg_outbox_buffer, strlen(msg_outbox_buffer)))
+		else
 		{
-			msg_outbox_buffer[0] = '\0';				// buffer now empty
-			MSG_files_in_ftp_outbox++;
+			sprintf(msg_in_filename, "MSG%05u.msg", msg_index[is_sms ? 1 : 0].tail);
+			if (CFS_write_file(msg_outbox_path(is_sms), msg_in_filename, "w", msg_outbox_buffer, strlen(msg_outbox_buffer)))
+			{
+				msg_outbox_buffer[0] = '\0';			// buffer now empty
+				msg_index[is_sms ? 1 : 0].tail++;
+				msg_save_index(is_sms);
+			}
 		}
 	}
 
@@ -283,6 +463,27 @@ void MSG_flush_outbox_buffer(bool initiate_tx)
 #endif
 }
 
+/******************************************************************************
+** Function:	Remove oldest message from given outbox
+**
+** Notes:		Returns false if file system unavailable
+*/
+bool msg_purge_oldest(bool outbox)
+{
+	msg_index_type * p = &msg_index[outbox ? 1 : 0];
+
+	if (!msg_load_index(outbox))
+		return false;
+
+	if ((p->head != p->tail) && (FSchdir(msg_outbox_path(outbox)) == 0))
+	{
+		sprintf(msg_in_filename, "MSG%05u.msg", p->head);
+		FSremove(msg_in_filename);								// ignore whether file exists
+	}
+	msg_drop(outbox, p->head);
+	return true;
+}
+
 /******************************************************************************
 ** Function:	Manage size of outbox buffers, and update number of messages
 **
@@ -293,10 +494,8 @@ void MSG_task(void)
 	// sms outbox
 	if (MSG_files_in_sms_outbox > MSG_MAX_OUTBOX_SIZE)	// delete oldest
 	{
-		if (!CFS_purge_oldest_file((char *)msg_sms_outbox_path))
+		if (!msg_purge_oldest(SMS_OUTBOX))
 			return;
-
-		MSG_files_in_sms_outbox--;
 	}
 	else if (MSG_files_in_sms_outbox < 0)
 	{
@@ -306,10 +505,8 @@ void MSG_task(void)
 	// ftp outbox
 	if (MSG_files_in_ftp_outbox > MSG_MAX_OUTBOX_SIZE)	// delete oldest
 	{
-		if (!CFS_purge_oldest_file((char *)msg_ftp_outbox_path))
+		if (!msg_purge_oldest(FTP_OUTBOX))
 			return;
-
-		MSG_files_in_ftp_outbox--;
 	}
 	else if (MSG_files_in_ftp_outbox < 0)
 	{
@@ -326,6 +523,8 @@ void MSG_init(void)
 {
 	MSG_files_in_sms_outbox = -1;
 	MSG_files_in_ftp_outbox = -1;							// indeterminate for now...
+	msg_index_valid[0] = false;								// index files read when first needed
+	msg_index_valid[1] = false;
 
 	(void)CFS_open();										// keep file system awake
 	if (CFS_state == CFS_OPEN)
@@ -333,12 +532,18 @@ void MSG_init(void)
 		if (FSchdir((char *)msg_sms_outbox_path) != 0)			// can't set sms working directory
 		{
 			FSmkdir((char *)msg_sms_outbox_path);				// so create it
-			MSG_files_in_sms_outbox = 0;
+			msg_index[1].head = 0;								// new empty outbox
+			msg_index[1].tail = 0;
+			msg_index_valid[1] = true;
+			msg_save_index(SMS_OUTBOX);
 		}
 		if (FSchdir((char *)msg_ftp_outbox_path) != 0)			// can't set ftp working directory
 		{
 			FSmkdir((char *)msg_ftp_outbox_path);				// so create it
-			MSG_files_in_ftp_outbox = 0;
+			msg_index[0].head = 0;
+			msg_index[0].tail = 0;
+			msg_index_valid[0] = true;
+			msg_save_index(FTP_OUTBOX);
 		}
 	}
 }
@@ -59,6 +59,9 @@
 ** V3.30 011113 PB  new code in PDU_time_for_batch() to deal with subchannel event value logging transmission enable flag and SMS types
 **
 ** V4.00 220114 PB  if HDW_GPS disable all analogue calls and functions
+**
+** V6.03 171026     read sms data files through a CFS session - pdu_file_seek_pos removed, file stays open between blocks
+**					pdu_fetch_sms_data() uses day file time index to start at the block holding the first reading wanted
 */
 
 #include <float.h>
@@ -137,7 +140,7 @@ FAR uint16 pdu_sms_to_send_flags;
 FAR uint16 pdu_derived_sms_to_send_flags;
 FAR uint16 pdu_block_offset;
 FAR uint8  pdu_block;
-FAR long   pdu_file_seek_pos;
+FAR CFS_session_type pdu_session;						// read session on current sms data file
 
 // memory for extracting data from file system to be sent in an SMS PDU transmission
 FAR char  pdu_file_buffer[PDU_FILE_BUFFER_SIZE];		// buffer for reading raw data from a file
@@ -905,9 +908,9 @@ void pdu_increment_file_buffer_pointer(void)
 		pdu_block++;
 		pdu_block_offset = 0;
 		pdu_p_file = pdu_file_buffer;
-		// get next block of file
-		CFS_read_block(pdu_path_str, pdu_filename_str, pdu_file_buffer, pdu_file_seek_pos, PDU_FILE_BUFFER_SIZE);
-		pdu_file_seek_pos += PDU_FILE_BUFFER_SIZE;
+		// get next block of file - if can't, treat as end of file
+		if (CFS_session_read(&pdu_session, pdu_file_buffer, PDU_FILE_BUFFER_SIZE) < 0)
+			pdu_file_buffer[0] = '\0';
 	}
 }
 
@@ -1224,7 +1227,7 @@ bool pdu_extract_header(PDU_sms_header_type * p_header)
  * Side Effects:    None
  *
  * Overview:        creates path in pdu_path_str and filename in pdu_filename_str
- *					initialises file extraction pointers
+ *					initialises file extraction pointers and starts read session on file
  *
  * Note:
  *
@@ -1244,6 +1247,7 @@ void pdu_create_path_and_filename(RTC_type * p_when)
 	pdu_p_file = pdu_file_buffer;
 	pdu_block_offset = 0;
 	pdu_block = 0;
+	CFS_session_open(&pdu_session, pdu_path_str, pdu_filename_str);
 }
 
 /********************************************************************
@@ -1287,6 +1291,9 @@ bool pdu_fetch_sms_data(float * p_buffer, RTC_type * p_when)
 	uint8  y_data_index_limit = 0;
 	char   peek;
 	RTC_type yesterday;
+#ifdef LOG_TIME_INDEX
+	long   pos;
+#endif
 
 	// fill totaliser with "no value" value
 	data_index = 0;
@@ -1310,11 +1317,15 @@ bool pdu_fetch_sms_data(float * p_buffer, RTC_type * p_when)
 	// check we have a directory and file for the required channel
 	if (CFS_file_exists(pdu_path_str, pdu_filename_str))
 	{
+#ifdef LOG_TIME_INDEX
+		// go straight to block holding first reading of the 96, if there is one after the first block
+		pos = LOG_index_find(pdu_path_str, pdu_filename_str, sms_time_secs, 95);
+		if ((pos > 0) && CFS_session_seek(&pdu_session, pos))
+			first_line_of_file = false;							// data all from today - don't need yesterday's file
+#endif
 		// get first block of file
-		pdu_file_seek_pos = 0;
-		if (!CFS_read_block(pdu_path_str, pdu_filename_str, pdu_file_buffer, pdu_file_seek_pos, PDU_FILE_BUFFER_SIZE))
+		if (CFS_session_read(&pdu_session, pdu_file_buffer, PDU_FILE_BUFFER_SIZE) < 0)
 			 return false;
-		pdu_file_seek_pos += PDU_FILE_BUFFER_SIZE;
 /*****************************************************************************************
 		do
 		{
@@ -1579,11 +1590,15 @@ bool pdu_fetch_sms_data(float * p_buffer, RTC_type * p_when)
 	// check we have a directory and file for the required channel
 	// if we don't return have_file_today
 	if (CFS_file_exists(pdu_path_str, pdu_filename_str) == false) return have_data;
+#ifdef LOG_TIME_INDEX
+	// go straight to block holding yesterday's target time, if there is one after the first block
+	pos = LOG_index_find(pdu_path_str, pdu_filename_str, y_target_time_secs, 0);
+	if ((pos > 0) && CFS_session_seek(&pdu_session, pos))
+		first_line_of_file = false;
+#endif
 
 	// get first block of file - if any faults with this file return have_file_today
-	pdu_file_seek_pos = 0;
-	if (CFS_read_block(pdu_path_str, pdu_filename_str, pdu_file_buffer, pdu_file_seek_pos, PDU_FILE_BUFFER_SIZE) == false) return have_data;
-	pdu_file_seek_pos += PDU_FILE_BUFFER_SIZE;
+	if (CFS_session_read(&pdu_session, pdu_file_buffer, PDU_FILE_BUFFER_SIZE) < 0) return have_data;
 
 	// set data index for yesterday's file start to zero as we are gathering the first part of the data
 	data_index = 0;
@@ -2206,6 +2221,7 @@ uint8 PDU_retrieve_data(bool to_host)
 			return CMD_ERR_FILE_READ_LINE_FAILED;
 		}
 	}
+	CFS_session_close(&pdu_session);
 
 	// calculate time stamps
 	memcpy(&pdu_rtc_time_stamp, &PDU_rsd_retrieve.when, sizeof(RTC_type));
@@ -36,6 +36,8 @@
 **
 ** V4.11 260814 PB	line 234 - requires '~' to invert sum of flags for clearing
 **
+** V6.03 171026     write back file system sector cache when internal battery goes flat
+**
 */
 
 #include "custom.h"
@@ -414,7 +416,9 @@ void PWR_task(void)
 		if (LOG_state != LOG_BATT_DEAD)											// need to stop now
 		{
 			LOG_entry("Internal battery flat. Logging disabled until reset.");	// Write event before we permanently disable SD writes
-			LOG_state = LOG_BATT_DEAD;											// power down transducers:
+			LOG_state = LOG_BATT_DEAD;
+			CFS_flush();														// no more SD writes after this
+																				// power down transducers:
 #ifndef HDW_RS485
 			DIG_start_stop_logging();
 #endif
@@ -7,6 +7,9 @@
 **
 ** V3.29 161013 PB  correction to output string in SCF_execute_next_line() to "....%s\\%s"
 **					use strcpy instead of memcpy for path and filename - ensures null termination
+**
+** V6.03 171026     read script through a CFS session, so each line follows on from the last
+**					instead of scanning the file from the start for every line
 */
 
 #include <string.h>
@@ -35,6 +38,8 @@ int scf_size;
 int scf_processed;
 int scf_line_number;
 
+FAR CFS_session_type scf_session;		// position in script file
+
 FAR char scf_line_buffer[CMD_MAX_LENGTH];
 
 /******************************************************************************
@@ -57,6 +62,7 @@ bool SCF_execute(char *path, char *filename, bool output)
 	scf_size = CFS_search_filesize();
 	scf_processed = 0;
 	scf_line_number = 1;
+	CFS_session_open(&scf_session, SCF_path, SCF_filename);
 
 	return SCF_execute_next_line();
 }
@@ -79,12 +85,13 @@ bool SCF_execute_next_line(void)
 	// read next line until find command or end of file
 	do
 	{
-		i = CFS_read_line(SCF_path, SCF_filename, scf_line_number++,
-						  scf_line_buffer, sizeof(scf_line_buffer));
+		i = CFS_session_read_line(&scf_session, scf_line_buffer, sizeof(scf_line_buffer));
+		scf_line_number++;
 
 		if (i < 0)
 		{
 			// end of file
+			CFS_session_close(&scf_session);
 			scf_processed = scf_size;
 			SCF_filename[0] = '\0';				// execution complete
 			USB_monitor_string("Script execution terminated.");
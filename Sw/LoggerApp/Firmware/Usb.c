@@ -21,6 +21,20 @@
 ** V3.31 141113 PB  use CFS_open() != CFS_OPEN test to keep file system awake in USB_task() states READ_FILE and WRITE_FILE
 **
 ** V3.32 201113 PB  revise use of CFS_open() in READ_FILE and WRITE_FILE states
+**
+** V6.03 171026     READ_FILE state reads sectors through a CFS session - file stays open between sectors
+**					file written by WRITE_FILE state discarded from CFS small file cache
+**					READ_FILE state streams the file: next sector read while current one is sent, packets queued in both
+**					ping-pong buffers of the IN endpoint. Rate of last read kept in USB_read_rate.
+**					new state ARCHIVE streams every file in a directory tree, each with a header line, using READ_FILE's buffering
+**					new state SYNC streams data logged since the USB client's sync watermarks, from FTP_sync_fill()
+**					new state UPLOAD receives a file of announced size into a write session with clusters preallocated.
+**					Both ping-pong OUT buffers kept armed with 64-byte slots of the two sector buffers, so packets
+**					arrive while the other sector is written. CRC-16 of data kept in USB_upload_crc.
+**					UPLOAD error or timeout cancels OUT buffers still armed & ends at once, partial file removed,
+**					also removed if host disconnects during upload
+**					Second sector buffer is the CFS shared sector buffer, claimed for READ_FILE, ARCHIVE, SYNC & UPLOAD.
+**					If FTP upload has it, sectors are single-buffered in usb_tx_buffer
 */
 
 #include "Custom.h"
@@ -43,6 +57,7 @@
 #include "msg.h"
 #include "com.h"
 #include "alm.h"
+#include "ftp.h"
 
 #include "usb_config.h"
 #include "USB/usb_device.h"                         // Required
@@ -53,6 +68,8 @@
 #include "Usb.h"
 #undef extern
 
+extern volatile BDT_ENTRY *pBDTEntryOut[];			// next OUT buffer descriptor of each endpoint, in usb_device.c
+
 #ifdef HDW_ATEX
 #define USB_ATEX_TIMEOUT_X20MS	(2 * 60 * 50)
 #endif
@@ -62,7 +79,15 @@
 #define USB_PENDING_READ		1
 #define USB_PENDING_WRITE		2
 #define USB_PENDING_DIR			3
-#define USB_NUM_ACTIONS			4
+#define USB_PENDING_ARCHIVE		4
+#define USB_PENDING_SYNC		5
+#define USB_PENDING_UPLOAD		6
+#define USB_NUM_ACTIONS			7
+
+#define USB_ARCHIVE_DEPTH		4		// directory levels searched by archive
+
+#define USB_UPLOAD_SLOTS		(2 * 512 / USBGEN_EP_SIZE)	// OUT packet slots in the two sector buffers, half if single-buffered
+#define USB_UPLOAD_TIMEOUT_X20MS	(5 * 50)
 
 #ifndef WIN32
 #pragma udata USB_VARS
@@ -80,6 +105,10 @@ BITFIELD usb_flags;
 #define usb_pc_detected					usb_flags.b1
 #define usb_pending_disconnect_alarm	usb_flags.b2
 #define usb_pending_ext_pwr_connected	usb_flags.b3
+#define usb_fill_ready					usb_flags.b4
+#define usb_up_check_crc				usb_flags.b5
+#define usb_up_failed					usb_flags.b6	// upload abandoned
+#define usb_up_first					usb_flags.b7	// first packet of upload is in usb_rx_buffer
 
 int usb_action;
 
@@ -90,19 +119,49 @@ int usb_monitor_index;
 int usb_timer_x20ms;
 int usb_ext_pwr_debounce;
 
-uint32 usb_file_pos;
+uint32 usb_file_pos;						// bytes of file sent to host
+uint16 usb_read_ticks;						// 20ms ticks since file read started
+int usb_fill_len;							// bytes read into usb_fill_ptr, -1 if read failed
+char * usb_fill_ptr;						// buffer next sector of file is read into, NULL before first
+char * usb_send_ptr;						// sector being sent to host
+char * usb_file_buffer;						// file sectors alternate between this & usb_tx_buffer, NULL if single-buffered
+
+SearchRec usb_archive_srch[USB_ARCHIVE_DEPTH];	// search in each directory level of archive
+int usb_archive_depth;						// current level, -1 when all done
+uint16 usb_archive_from_date;				// FAT dates of files to include
+uint16 usb_archive_to_date;
+uint32 usb_archive_remaining;				// bytes of current file still to send
+int usb_archive_header_index;				// next char of header to send, -1 if none
+char usb_archive_header[112];				// "path,size,dd/mm/yy,hh:mm:ss\r\n" before each file
+
+uint32 usb_up_remaining;					// bytes of upload still to receive
+uint32 usb_up_to_arm;						// bytes of upload not yet given an OUT buffer
+uint16 usb_up_expected_crc;
+uint16 usb_up_ticks;						// 20ms ticks since last upload packet
+uint8 usb_up_arm_slot;						// next packet slot to give to OUT endpoint
+uint8 usb_up_rx_slot;						// next packet slot expected from OUT endpoint
+uint8 usb_up_slots;							// packet slots in use - USB_UPLOAD_SLOTS or half if single-buffered
+int usb_up_fill;							// bytes received into sector being filled
+USB_HANDLE usb_up_handle[2];				// OUT handle of each ping-pong buffer, by slot parity
+
+const uint16 usb_crc_nibble[16] =			// CRC-16 (MODBUS, reflected 0xA001) of each nibble
+{
+	0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+	0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+};
 
 USB_HANDLE USBOutHandle;
 USB_HANDLE USBInHandle;
 
 SearchRec usb_srch;
+CFS_session_type usb_session;				// read session on file being sent to host
 
 FAR char usb_path[80];
 FAR char usb_monitor_buffer[512];
 
 const uint8 usb_next_state[USB_NUM_ACTIONS] =
 {
-	USB_RX_COMMAND, USB_READ_FILE, USB_WRITE_FILE, USB_DIR
+	USB_RX_COMMAND, USB_READ_FILE, USB_WRITE_FILE, USB_DIR, USB_ARCHIVE, USB_SYNC, USB_UPLOAD
 };
 
 /******************************************************************************
@@ -164,6 +223,159 @@ void USB_dir(char *path)
 	usb_action = USB_PENDING_DIR;
 }
 
+/******************************************************************************
+** Function:	Start streaming all files in a directory tree to the host
+**
+** Notes:		Only files with FAT date from_date to to_date inclusive
+*/
+void USB_archive(char *path, uint16 from_date, uint16 to_date)
+{
+	strncpy(usb_path, path, sizeof(usb_path));
+	usb_archive_from_date = from_date;
+	usb_archive_to_date = to_date;
+	usb_archive_depth = 0;
+	usb_archive_srch[0].searchname[0] = '\0';				// haven't started search yet
+	usb_archive_header_index = -1;
+	usb_archive_remaining = 0;
+	usb_action = USB_PENDING_ARCHIVE;
+}
+
+/******************************************************************************
+** Function:	Start streaming data logged since sync watermarks to the host
+**
+** Notes:		FTP_sync_start() must have been called
+*/
+void USB_sync(void)
+{
+	usb_action = USB_PENDING_SYNC;
+}
+
+/******************************************************************************
+** Function:	Find next file of archive, open it and make its header
+**
+** Notes:		Walks directory tree depth first from usb_path, which holds path of current level.
+**				Returns false when no more files.
+*/
+bool usb_archive_next_file(void)
+{
+	SearchRec * r;
+	char * p;
+	int found;
+
+	while (usb_archive_depth >= 0)
+	{
+		r = &usb_archive_srch[usb_archive_depth];
+		if (!CFS_chdir(usb_path, false))						// search must continue in its own directory
+			return false;
+
+		if (r->searchname[0] == '\0')							// haven't started search yet
+			found = FindFirst("*.*", ATTR_MASK & ~ATTR_VOLUME, r);
+		else
+			found = FindNext(r);
+
+		if (found != 0)											// end of this directory - back up a level
+		{
+			if (--usb_archive_depth >= 0)
+			{
+				p = strrchr(usb_path, '\\');
+				if (p == usb_path)
+					p++;										// keep root
+				*p = '\0';
+			}
+		}
+		else if (r->filename[0] == '.')							// skip . and ..
+			continue;
+		else if ((r->attributes & ATTR_DIRECTORY) != 0)			// go down into directory
+		{
+			if ((usb_archive_depth < USB_ARCHIVE_DEPTH - 1) && (strlen(usb_path) + strlen(r->filename) + 2 < sizeof(usb_path)))
+			{
+				if (usb_path[1] != '\0')
+					strcat(usb_path, "\\");
+				strcat(usb_path, r->filename);
+				usb_archive_srch[++usb_archive_depth].searchname[0] = '\0';
+			}
+		}
+		else if ((HIGH16(r->timestamp) >= usb_archive_from_date) && (HIGH16(r->timestamp) <= usb_archive_to_date))
+		{
+			CFS_session_open(&usb_session, usb_path, r->filename);
+			usb_archive_remaining = r->filesize;
+			STR_print_file_timestamp(r->timestamp);
+			sprintf(usb_archive_header, "%s\\%s,%lu,%s\r\n",
+				(usb_path[1] == '\0') ? "" : usb_path, r->filename, r->filesize, STR_buffer);
+			usb_archive_header_index = 0;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/******************************************************************************
+** Function:	Fill buffer with next part of archive stream
+**
+** Notes:		Stream is header line then contents of each file in turn.
+**				Returns bytes put in buffer, < 512 at end of stream with '\0' after the last byte.
+*/
+int usb_archive_fill(char * buffer)
+{
+	int n, i;
+
+	n = 0;
+	while (n < 512)
+	{
+		if (usb_archive_header_index >= 0)						// header
+		{
+			buffer[n++] = usb_archive_header[usb_archive_header_index++];
+			if (usb_archive_header[usb_archive_header_index] == '\0')
+				usb_archive_header_index = -1;
+		}
+		else if (usb_archive_remaining != 0)					// file contents
+		{
+			i = 512 - n;
+			if (usb_archive_remaining < (uint32)i)
+				i = (int)usb_archive_remaining;
+			i = CFS_session_read(&usb_session, &buffer[n], i);
+			if (i <= 0)											// file has gone short - pad to size in header
+			{
+				buffer[n] = ' ';
+				i = 1;
+			}
+			n += i;
+			usb_archive_remaining -= i;
+			if (usb_archive_remaining == 0)
+				CFS_session_close(&usb_session);
+		}
+		else if (!usb_archive_next_file())						// end of stream
+		{
+			usb_archive_depth = -1;
+			buffer[n] = '\0';
+			break;
+		}
+	}
+
+	return n;
+}
+
+/******************************************************************************
+** Function:	Read next sector of file being sent to host into the buffer not being sent
+**
+** Notes:		usb_fill_len < 512 at EOF, with '\0' after the last byte. -1 if file can't be read.
+*/
+void usb_read_sector(void)
+{
+	if (CFS_state != CFS_OPEN)												// file system died
+		usb_fill_len = -1;
+	else if (USB_state == USB_ARCHIVE)
+		usb_fill_len = (usb_archive_depth < 0) ? 0 : usb_archive_fill(usb_fill_ptr);
+	else if (USB_state == USB_SYNC)
+		usb_fill_len = FTP_sync_fill(usb_fill_ptr, 512);
+	else if (usb_srch.filename[0] == '\0')								// no file
+		usb_fill_len = -1;
+	else
+		usb_fill_len = CFS_session_read(&usb_session, usb_fill_ptr, 512);	// string-terminates the file if EOF in this block
+	usb_fill_ready = true;
+}
+
 /******************************************************************************
 ** Function:	Poll for an OUT packet from host
 **
@@ -178,6 +390,233 @@ void usb_rx(void)
 #endif
 }
 
+/******************************************************************************
+** Function:	Add bytes to a CRC-16
+**
+** Notes:		Same CRC as MODBUS in Ser.c - start with 0xFFFF. Nibble table, 2 lookups per byte.
+*/
+uint16 usb_crc16(uint16 crc, char * p, int n)
+{
+	uint8 c;
+
+	while (n-- > 0)
+	{
+		c = (uint8)*p++;
+		crc = (crc >> 4) ^ usb_crc_nibble[(crc ^ c) & 0x0F];
+		crc = (crc >> 4) ^ usb_crc_nibble[(crc ^ (c >> 4)) & 0x0F];
+	}
+
+	return crc;
+}
+
+/******************************************************************************
+** Function:	Start receiving a file of known size from the host
+**
+** Notes:		Creates file with clusters preallocated. Host then sends exactly size bytes, in full packets
+**				apart from the last. A zero-length packet aborts. First packet arrives in usb_rx_buffer,
+**				as the OUT endpoint was armed for the next command. Returns false if can't create file.
+*/
+bool USB_upload(char *path, char *filename, uint32 size, uint16 crc, bool check_crc)
+{
+	strncpy(usb_path, path, sizeof(usb_path));
+	strncpy(usb_srch.filename, filename, sizeof(usb_srch.filename));
+	USB_upload_ok = false;
+	USB_upload_bytes = 0;
+	USB_upload_crc = 0xFFFF;
+	if ((size == 0) || !CFS_session_create(&usb_session, usb_path, usb_srch.filename, (long)size))
+		return false;
+
+	usb_up_remaining = size;
+	usb_up_to_arm = (size > USBGEN_EP_SIZE) ? size - USBGEN_EP_SIZE : 0;
+	usb_up_expected_crc = crc;
+	usb_up_check_crc = check_crc;
+	usb_up_failed = false;
+	usb_up_first = true;
+	usb_up_handle[0] = USBOutHandle;
+	usb_up_rx_slot = 0;
+	usb_up_arm_slot = 1;
+	usb_up_fill = 0;
+	usb_up_ticks = 0;
+	usb_action = USB_PENDING_UPLOAD;
+	return true;
+}
+
+/******************************************************************************
+** Function:	Get address of an upload packet slot
+**
+** Notes:		First half of slots in usb_tx_buffer, second half in usb_file_buffer
+*/
+char * usb_upload_slot(uint8 slot)
+{
+	if (slot < USB_UPLOAD_SLOTS / 2)
+		return &usb_tx_buffer[slot * USBGEN_EP_SIZE];
+
+	return &usb_file_buffer[(slot - (USB_UPLOAD_SLOTS / 2)) * USBGEN_EP_SIZE];
+}
+
+/******************************************************************************
+** Function:	Keep both ping-pong OUT buffers armed for upload
+**
+** Notes:		Never arms more than the bytes still expected. Single-buffered, the first slot is not
+**				armed until the sector in usb_tx_buffer has been written.
+*/
+void usb_upload_arm(void)
+{
+	while ((usb_up_to_arm != 0) && (((usb_up_arm_slot + usb_up_slots - usb_up_rx_slot) % usb_up_slots) < 2))
+	{
+		if ((usb_file_buffer == NULL) && (usb_up_arm_slot == 0) && (usb_up_fill != 0))
+			break;
+
+		usb_up_handle[usb_up_arm_slot & 1] =
+			USBTransferOnePacket(USBGEN_EP_NUM, OUT_FROM_HOST, (BYTE *)usb_upload_slot(usb_up_arm_slot), USBGEN_EP_SIZE);
+		usb_up_to_arm -= (usb_up_to_arm < USBGEN_EP_SIZE) ? usb_up_to_arm : USBGEN_EP_SIZE;
+		usb_up_arm_slot = (usb_up_arm_slot + 1) % usb_up_slots;
+	}
+}
+
+/******************************************************************************
+** Function:	Take back OUT buffers armed for upload but not yet filled
+**
+** Notes:		Buffers are cancelled newest first, stepping the endpoint's ping-pong pointer back over each,
+**				so the next USBTransferOnePacket() uses the buffer descriptor the SIE will fill next.
+**				Data toggle is fixed per buffer descriptor in this ping-pong mode, so needs no correction.
+*/
+void usb_upload_cancel(void)
+{
+	USB_HANDLE h;
+
+	while (usb_up_arm_slot != usb_up_rx_slot)
+	{
+		usb_up_arm_slot = (usb_up_arm_slot + usb_up_slots - 1) % usb_up_slots;
+		h = usb_up_handle[usb_up_arm_slot & 1];
+		if (!USBHandleBusy(h))											// already filled - SIE has moved past it
+			break;
+		// else:
+
+		h->STAT.UOWN = 0;
+		((BYTE_VAL*)&pBDTEntryOut[USBGEN_EP_NUM])->Val ^= USB_NEXT_PING_PONG;
+	}
+	usb_up_arm_slot = usb_up_rx_slot;
+	usb_up_to_arm = 0;
+}
+
+/******************************************************************************
+** Function:	Remove file of unfinished or failed upload
+**
+** Notes:		Its preallocated clusters are freed with it
+*/
+void usb_upload_remove(void)
+{
+	CFS_session_close(&usb_session);
+	if (CFS_chdir(usb_path, false))
+		FSremove(usb_srch.filename);
+}
+
+/******************************************************************************
+** Function:	Finish upload
+**
+** Notes:		Removes file if incomplete, not written or CRC doesn't match. Re-arms OUT endpoint for commands.
+*/
+void usb_upload_end(void)
+{
+	USB_upload_ok = !usb_up_failed && (usb_up_remaining == 0) &&
+					(!usb_up_check_crc || (USB_upload_crc == usb_up_expected_crc));
+	if (USB_upload_ok)
+		CFS_session_close(&usb_session);
+	else
+		usb_upload_remove();
+	usb_srch.filename[0] = '\0';
+
+	usb_rx_index = 0;
+	usb_rx();
+	usb_prompt = true;
+	USB_state = USB_RX_COMMAND;
+}
+
+/******************************************************************************
+** Function:	Abandon upload after an error or timeout
+**
+** Notes:		Does not wait for packets already armed for - host may have stopped sending
+*/
+void usb_upload_fail(void)
+{
+	usb_up_failed = true;
+	usb_upload_cancel();
+	usb_upload_end();
+}
+
+/******************************************************************************
+** Function:	Receive next packet of upload
+**
+** Notes:		Each full sector is written while the OUT endpoint fills the other sector buffer.
+**				Error or 5s without data ends the upload at once & removes the file.
+*/
+void usb_upload_task(void)
+{
+	USB_HANDLE h;
+	char * p;
+	uint8 slot;
+	int n;
+
+	if (TIM_20ms_tick)
+		usb_up_ticks++;
+	if (USBSuspendControl || USBHandleBusy(USBInHandle))				// reply may still be going from usb_tx_buffer
+		return;
+	// else:
+
+	usb_upload_arm();
+	if (usb_up_arm_slot == usb_up_rx_slot)								// nothing armed - upload over
+	{
+		usb_upload_end();
+		return;
+	}
+	// else:
+
+	slot = usb_up_rx_slot;
+	h = usb_up_handle[slot & 1];
+	if (USBHandleBusy(h))
+	{
+		if (usb_up_ticks > USB_UPLOAD_TIMEOUT_X20MS)					// host has stopped sending
+			usb_upload_fail();
+		return;
+	}
+	// else:
+
+	usb_up_ticks = 0;
+	usb_up_rx_slot = (slot + 1) % usb_up_slots;
+	n = USBHandleGetLength(h);
+	p = usb_upload_slot(slot);
+	if (usb_up_first)
+	{
+		memcpy(p, usb_rx_buffer, USBGEN_EP_SIZE);
+		usb_up_first = false;
+	}
+	if ((uint32)n > usb_up_remaining)
+		n = (int)usb_up_remaining;
+	if ((n == 0) || ((n < USBGEN_EP_SIZE) && ((uint32)n != usb_up_remaining)))	// abort, or short packet before end
+	{
+		usb_upload_fail();
+		return;
+	}
+	// else:
+
+	USB_upload_crc = usb_crc16(USB_upload_crc, p, n);
+	USB_upload_bytes += n;
+	usb_up_remaining -= n;
+	usb_up_fill += n;
+	if ((usb_up_fill >= 512) || (usb_up_remaining == 0))				// sector complete
+	{
+		usb_upload_arm();												// keep packets coming during write
+		p = (slot < USB_UPLOAD_SLOTS / 2) ? usb_tx_buffer : usb_file_buffer;
+		if (!CFS_session_write(&usb_session, p, usb_up_fill))
+		{
+			usb_upload_fail();
+			return;
+		}
+		usb_up_fill = 0;
+	}
+}
+
 /******************************************************************************
 ** Function:	send "external power disconnected" alarm
 **
@@ -244,6 +683,9 @@ void usb_host_disconnected(void)
 	usb_monitor_buffer[0] = '\0';
 	usb_monitor_index = 0;
 
+	if (USB_state == USB_UPLOAD)		// upload incomplete - remove file & its preallocated clusters
+		usb_upload_remove();
+
 	if (USB_state >= USB_RX_COMMAND)	// USB was definitely connected
 	{
 		LOG_entry("USB disconnected");	// ...so file system already open
@@ -428,6 +870,13 @@ void USB_task(void)
 
 	USBDeviceTasks();
 
+	if ((usb_file_buffer != NULL) &&
+		(USB_state != USB_READ_FILE) && (USB_state != USB_ARCHIVE) && (USB_state != USB_SYNC) && (USB_state != USB_UPLOAD))
+	{
+		CFS_block_release(CFS_BLOCK_USB);			// transfer over - free shared buffer for FTP
+		usb_file_buffer = NULL;
+	}
+
 	switch (USB_state)
 	{
 	case USB_DISCONNECTED:
@@ -468,7 +917,8 @@ void USB_task(void)
 			LOG_entry("USB connected");
 
 			usb_rx_index = 0;
-			usb_rx();
+			if (!USBHandleBusy(USBOutHandle))		// armed by USBCBInitEP() - with ping-pong don't arm other buffer too
+				usb_rx();
 			USBInHandle = USBTransferOnePacket(USBGEN_EP_NUM, IN_TO_HOST, (BYTE *)usb_tx_buffer, 0);
 			USB_state = USB_RX_COMMAND;
 			usb_action = USB_NO_ACTION;
@@ -558,12 +1008,18 @@ void USB_task(void)
 			{
 				// check if any pending actions:
 				usb_file_pos = 0;
+				usb_fill_ptr = NULL;
 				usb_eof_index = -1;
 				usb_srch.searchname[0] = '\0';
 				usb_tx_index = 0;
 				if (usb_action >= USB_NUM_ACTIONS)	// safety check
 					usb_action = USB_NO_ACTION; 
 				USB_state = usb_next_state[usb_action];
+				if ((USB_state == USB_READ_FILE) || (USB_state == USB_ARCHIVE) || (USB_state == USB_SYNC) || (USB_state == USB_UPLOAD))
+				{
+					usb_file_buffer = CFS_block_claim(CFS_BLOCK_USB);
+					usb_up_slots = (usb_file_buffer != NULL) ? USB_UPLOAD_SLOTS : USB_UPLOAD_SLOTS / 2;
+				}
 				usb_prompt = (usb_action == USB_NO_ACTION);
 				usb_action = USB_NO_ACTION;
 				break;
@@ -572,8 +1028,12 @@ void USB_task(void)
 		// else usb_tx_index += 64;
 		break;
 
+	case USB_ARCHIVE:													// stream of files sent like one file
+	case USB_SYNC:
 	case USB_READ_FILE:
-		if (USBInHandle->STAT.UOWN || USBSuspendControl)				// USB tx busy
+		if (TIM_20ms_tick)
+			usb_read_ticks++;												// time the read
+		if (USBSuspendControl)
 			break;
 		// else:
 
@@ -581,55 +1041,52 @@ void USB_task(void)
 		usb_timer_x20ms = USB_ATEX_TIMEOUT_X20MS;						// keep USB connection alive
 #endif
 
-		if (CFS_state == CFS_OPEN)											// if file system awake (it should be)
+		if (usb_fill_ptr == NULL)										// first sector
 		{
-			if ((usb_file_pos == 0) || (usb_tx_index > 511))				// get next sector of file
+			usb_read_ticks = 0;
+			usb_send_ptr = NULL;
+			usb_fill_ptr = usb_tx_buffer;
+			if ((CFS_state == CFS_OPEN) && (usb_srch.filename[0] != '\0') && (USB_state == USB_READ_FILE))
+				CFS_session_open(&usb_session, usb_path, usb_srch.filename);
+			usb_read_sector();
+		}
+		else if (!usb_fill_ready && (usb_eof_index < 0) && (usb_tx_index >= 2 * USBGEN_EP_SIZE) &&
+				 ((usb_file_buffer != NULL) || ((usb_tx_index >= 512) && !USBHandleBusy(USBInHandle))))
+			usb_read_sector();											// both ping-pong buffers have moved on from the other sector - read next
+
+		while (!pBDTEntryIn[USBGEN_EP_NUM]->STAT.UOWN)					// while a ping-pong buffer is free
+		{
+			if ((usb_send_ptr == NULL) || (usb_tx_index >= 512))		// start sending next sector
 			{
-				if ((usb_srch.filename[0] == '\0') || FSchdir(usb_path) != 0)	// can't set working directory
-					usb_srch.filename[0] = '\0';
-				else
+				if (!usb_fill_ready)
+					break;
+
+				if (usb_fill_len < 0)									// send a packet starting '\0'
 				{
-					f = FSfopen(usb_srch.filename, "r");
-					if (f == NULL)											// can't open file
-						usb_srch.filename[0] = '\0';
-					else
-					{
-						// MUST close file from here on
-						if (FSfseek(f, usb_file_pos, SEEK_SET) != 0)		// can't find next block
-							usb_srch.filename[0] = '\0';
-						else
-						{
-							FSfread(usb_tx_buffer, 512, 1, f);
-							usb_tx_index = 0;
-							usb_file_pos += 512;
-							if (usb_file_pos > f->size)						// EOF somewhere in this block
-							{
-								usb_eof_index = f->size & 0x1FF;			// = 0 to 511
-								usb_tx_buffer[usb_eof_index] = '\0';		// string-terminate the file
-							}
-						}
-						CFS_close_file(f);
-					}
+					usb_fill_ptr[0] = '\0';
+					usb_fill_len = 0;
 				}
+				usb_send_ptr = usb_fill_ptr;
+				usb_eof_index = (usb_fill_len < 512) ? usb_fill_len : -1;	// EOF somewhere in this block = 0 to 511
+				usb_tx_index = 0;
+				if (usb_file_buffer != NULL)
+					usb_fill_ptr = (usb_fill_ptr == usb_tx_buffer) ? usb_file_buffer : usb_tx_buffer;
+				usb_fill_ready = false;
 			}
-		}
-		else
-			usb_srch.filename[0] = '\0';									// default zero length packet if file system died
-
-		if (usb_srch.filename[0] == '\0')								// send a packet starting '\0'
-		{
-			usb_tx_buffer[0] = '\0';
-			usb_tx_index  = 0;
-			usb_eof_index = 0;
-		}
 
-		USBInHandle = USBTransferOnePacket(USBGEN_EP_NUM, IN_TO_HOST, (BYTE *)&usb_tx_buffer[usb_tx_index], 64);
-		usb_tx_index += 64;
-		if ((usb_eof_index >= 0) && (usb_tx_index > usb_eof_index))		// EOF sent
-		{
-			usb_srch.filename[0] = '\0';
-			USB_state = USB_RX_COMMAND;
-			usb_prompt = true;
+			USBInHandle = USBTransferOnePacket(USBGEN_EP_NUM, IN_TO_HOST, (BYTE *)&usb_send_ptr[usb_tx_index], 64);
+			usb_tx_index += 64;
+			usb_file_pos += 64;
+			if ((usb_eof_index >= 0) && (usb_tx_index > usb_eof_index))		// EOF sent
+			{
+				usb_file_pos -= usb_tx_index - usb_eof_index;				// bytes of file sent
+				USB_read_rate = (usb_file_pos * 50) / ((usb_read_ticks == 0) ? 1 : usb_read_ticks);
+				CFS_session_close(&usb_session);
+				usb_srch.filename[0] = '\0';
+				USB_state = USB_RX_COMMAND;
+				usb_prompt = true;
+				break;
+			}
 		}
 		break;
 
@@ -665,6 +1122,7 @@ void USB_task(void)
 			{
 				if (FSchdir(usb_path) == 0)				// working directory OK
 				{
+					CFS_cache_invalidate(usb_path, usb_srch.filename);
 					f = FSfopen(usb_srch.filename, "a");
 					if (f != NULL)
 					{
@@ -688,6 +1146,10 @@ void USB_task(void)
 		usb_rx();
 		break;
 
+	case USB_UPLOAD:
+		usb_upload_task();
+		break;
+
 	case USB_DIR:
 		if (USBInHandle->STAT.UOWN || USBSuspendControl)	// USB tx busy
 			break;
@@ -16,6 +16,9 @@
 #define USB_WRITE_FILE				8
 #define USB_DIR						9
 #define USB_MONITOR					10
+#define USB_ARCHIVE					11		// streaming directory tree to host
+#define USB_SYNC					12		// streaming data logged since sync watermarks to host
+#define USB_UPLOAD					13		// receiving file of announced size from host
 
 #define USB_SUB_TASK()	if (USB_active) USBDeviceTasks()
 
@@ -25,11 +28,18 @@ extern bool USB_active;
 extern int USB_state;
 
 extern uint32 USB_wakeup_time;
+extern uint32 USB_read_rate;				// bytes/s of last file read by host
+extern uint32 USB_upload_bytes;				// bytes received by last upload
+extern uint16 USB_upload_crc;				// CRC-16 (MODBUS) of bytes received by last upload
+extern bool USB_upload_ok;					// last upload complete, written and CRC matched
 
 void USB_task(void);
 void USBDeviceTasks(void);
 void USB_transfer_file(char *path, char *filename, bool write);
 void USB_dir(char *path);
+void USB_archive(char *path, uint16 from_date, uint16 to_date);
+void USB_sync(void);
+bool USB_upload(char *path, char *filename, uint32 size, uint16 crc, bool check_crc);
 void USB_monitor_string(char *s);
 void USB_monitor_prompt(char *s);
 
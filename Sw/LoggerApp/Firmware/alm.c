@@ -57,6 +57,13 @@
 ** V3.33 261113 PB  wait for logging and pdu to complete and file system open in states ALM_MESSAGE_PENDING, ALM_GET_NEXT_LEVELS and ALM_SCRIPT_PENDING
 **
 ** V4.00 220114 PB  if HDW_GPS disable all analogue calls and functions
+**
+** V6.03 171026     units names read through CFS small file cache
+**					profile & envelope quarter files loaded into 24-timeslot tables when the quarter changes,
+**					or when ALM_update_profile() called, so next levels are looked up without waking the SD card
+**					every 15 minutes.
+**					No table kept if card not available - levels then read from file each timeslot.
+**					Tables also cleared when a file in \PROFILES is written, by CFS_cache_invalidate()
 */
 
 #include <float.h>
@@ -115,6 +122,18 @@ int FS_read_line(FSFILE *stream, int line_number, char *ptr, size_t max_bytes);
 #define ALM_MASK_PENDING_MESSAGE	(ALM_MASK_ENTER_HIGH_ALARM | ALM_MASK_EXIT_HIGH_ALARM | \
 									 ALM_MASK_ENTER_LOW_ALARM | ALM_MASK_EXIT_LOW_ALARM)
 
+// profile & envelope file types
+#define ALM_FILE_PROFILE		0
+#define ALM_FILE_ENVELOPE_HIGH	1
+#define ALM_FILE_ENVELOPE_LOW	2
+
+// Threshold tables: levels for the 24 15-minute timeslots of the quarter file of one type for a channel.
+// Reloaded when the next timeslot is in another quarter. Channels which don't get a table read the file every timeslot.
+#define ALM_NUM_TABLES			4
+#define ALM_TIMESLOTS			24
+#define ALM_NO_TABLE			0xFF		// table owner if free
+#define ALM_NO_LEVEL			0xFF		// MS byte of level if no file
+
 bool alm_read_next_thresholds;
 
 char *alm_char_ptr;
@@ -134,72 +153,178 @@ ALM_channel_type *alm_p_channel;
 FAR	char  alm_filename_str[16];
 FAR	char  alm_path_str[32];
 
+FAR uint8 alm_table[ALM_NUM_TABLES][ALM_TIMESLOTS * 3];		// 21-bit levels, LS byte first
+uint8 alm_table_owner[ALM_NUM_TABLES];						// channel | (file type << 5)
+uint8 alm_table_quarter[ALM_NUM_TABLES];					// quarter file loaded, 0..3
+
+const char * const alm_file_prefix[3] = { "P", "EH", "EL" };
+
 //*******************************************************************
 // private functions
 //*******************************************************************
 
 /******************************************************************************
-** Function:	read an alarm profile or envelope value from file
+** Function:	parse a 21-bit alarm profile or envelope value from 6 hex chars
 **
-** Notes:		provide filename in alm_filename_str. Index = 0..23
+** Notes:		Assumes correct syntax
 */
-float alm_extract_threshold(uint8 index)
+uint32 alm_parse_threshold(char * p)
 {
-	uint8 j;
+	uint8 i;
 	uint32 w;
 
-	if (!CFS_read_file((char *)ALM_PROFILES_PATH, alm_filename_str, STR_buffer, sizeof(STR_buffer)))
-		return FLT_MAX;		// no value
-	// else:
-
-	// shift value into mask w 1 hex byte at a time. Assumes correct syntax in file
-	index *= 6;		// character index
-	j = index + 6;
+	// shift value into mask w 1 hex byte at a time
 	w = 0;
-	do
+	for (i = 0; i < 3; i++)
 	{
 		// NB byte order is reversed. Nibbles are not.
 		w >>= 8;
 
 		// don't amalgamate the next 2 lines, or the order of the auto-inc may be wrong
-		HIGH16(w) = (STR_parse_hex_digit(STR_buffer[index++]) << 4);
-		HIGH16(w) |= STR_parse_hex_digit(STR_buffer[index++]);
-	} while (index < j);
+		HIGH16(w) = (STR_parse_hex_digit(*p++) << 4);
+		HIGH16(w) |= STR_parse_hex_digit(*p++);
+	}
 
-	return STR_float_21_to_32(w);
+	return w;
 }
 
 /******************************************************************************
-** Function:	get alarm profiles and envelope thresholds for the next timeslot from files
+** Function:	read an alarm profile or envelope value from file
 **
-** Notes:		if no file(s) exist(s) next level remains at default NO VALUE level FLT_MAX
+** Notes:		provide filename in alm_filename_str. Index = 0..23
 */
-void alm_get_next_levels(uint8 channel)
+float alm_extract_threshold(uint8 index)
 {
-	uint8   index, quarter;
-
-	// if channel alarm is enabled and type is not fixed thresholds
-	if (!ALM_config[channel].enabled || (ALM_config[channel].type == ALM_FIXED_ALARM))
-		return;
+	if (!CFS_read_file((char *)ALM_PROFILES_PATH, alm_filename_str, STR_buffer, sizeof(STR_buffer)))
+		return FLT_MAX;		// no value
 	// else:
 
-	// calculate quarter and index into file for required timeslot
-	quarter = (alm_next_timeslot / 24) + 1;			// quarter range is 1 to 4
-	index = alm_next_timeslot % 24;					// index of 15-minute timeslot in file
+	return STR_float_21_to_32(alm_parse_threshold(&STR_buffer[index * 6]));
+}
 
-	if (ALM_config[channel].type == ALM_PROFILE_ALARM)
+/******************************************************************************
+** Function:	free all threshold tables
+**
+** Notes:		so they are reloaded from file when next needed
+*/
+void alm_clear_tables(void)
+{
+	uint8 i;
+
+	for (i = 0; i < ALM_NUM_TABLES; i++)
+		alm_table_owner[i] = ALM_NO_TABLE;
+}
+
+/******************************************************************************
+** Function:	load the quarter file of one type for a channel into a threshold table
+**
+** Notes:		file system must be open. Timeslots of a missing file have no level.
+**				Returns false, leaving table free, if the file can't be read because the card has failed.
+*/
+bool alm_load_table(uint8 channel, uint8 type, uint8 quarter, uint8 table)
+{
+	uint8 index;
+	uint8 * p;
+	uint32 w;
+
+	alm_table_owner[table] = ALM_NO_TABLE;
+	p = alm_table[table];
+	sprintf(alm_filename_str, "%s%u%s.TXT", alm_file_prefix[type], quarter + 1, LOG_channel_id[channel + 1]);
+	if (CFS_read_file((char *)ALM_PROFILES_PATH, alm_filename_str, STR_buffer, sizeof(STR_buffer)))
 	{
-		sprintf(alm_filename_str, "P%u%s.TXT", quarter, LOG_channel_id[channel + 1]);
-		ALM_profile_levels[channel] = alm_extract_threshold(index);
+		for (index = 0; index < ALM_TIMESLOTS; index++)
+		{
+			w = alm_parse_threshold(&STR_buffer[index * 6]);
+			*p++ = (uint8)w;
+			*p++ = (uint8)(w >> 8);
+			*p++ = (uint8)(w >> 16);
+		}
 	}
-	else	// ALM_config[channel].type == ALM_ENVELOPE_ALARM
+	else if ((CFS_state != CFS_OPEN) || CFS_file_exists((char *)ALM_PROFILES_PATH, alm_filename_str))
+		return false;												// card failed, not file missing
+	else
+		memset(p, ALM_NO_LEVEL, ALM_TIMESLOTS * 3);
+
+	alm_table_owner[table] = channel | (type << 5);
+	alm_table_quarter[table] = quarter;
+	return true;
+}
+
+/******************************************************************************
+** Function:	get level for the next timeslot from a channel's profile or envelope files
+**
+** Notes:		Looks it up in the channel's table for this file type, loading the table from the next
+**				timeslot's quarter file if the table holds another quarter, or there is a free table and the
+**				card is working, else reads it from file. Level is FLT_MAX if no file.
+**				Returns false if file system needed but not open yet.
+*/
+bool alm_get_next_level(uint8 channel, uint8 type, float * level)
+{
+	uint8 owner, quarter, table;
+	uint8 * p;
+
+	owner = channel | (type << 5);
+	quarter = alm_next_timeslot / ALM_TIMESLOTS;
+	for (table = 0; table < ALM_NUM_TABLES; table++)
 	{
-		sprintf(alm_filename_str, "EH%u%s.TXT", quarter, LOG_channel_id[channel + 1]);
-		ALM_envelope_high[channel] = alm_extract_threshold(index);
-	
-		sprintf(alm_filename_str, "EL%u%s.TXT", quarter, LOG_channel_id[channel + 1]);
-		ALM_envelope_low[channel] = alm_extract_threshold(index);
+		if (alm_table_owner[table] == owner)
+			break;
 	}
+
+	if ((table == ALM_NUM_TABLES) || (alm_table_quarter[table] != quarter))	// no table for this quarter file yet
+	{
+		if (!CFS_open())
+			return false;
+
+		if (table == ALM_NUM_TABLES)
+		{
+			for (table = 0; table < ALM_NUM_TABLES; table++)
+			{
+				if (alm_table_owner[table] == ALM_NO_TABLE)
+					break;
+			}
+		}
+		if ((table != ALM_NUM_TABLES) &&						// CFS_open() is also true if card failed
+			((CFS_state != CFS_OPEN) || !alm_load_table(channel, type, quarter, table)))
+		{
+			alm_table_owner[table] = ALM_NO_TABLE;
+			table = ALM_NUM_TABLES;
+		}
+		if (table == ALM_NUM_TABLES)							// no table: read file for this timeslot
+		{
+			sprintf(alm_filename_str, "%s%u%s.TXT", alm_file_prefix[type], quarter + 1, LOG_channel_id[channel + 1]);
+			*level = alm_extract_threshold(alm_next_timeslot % ALM_TIMESLOTS);
+			return true;
+		}
+	}
+
+	p = &alm_table[table][(alm_next_timeslot % ALM_TIMESLOTS) * 3];
+	if (p[2] == ALM_NO_LEVEL)
+		*level = FLT_MAX;
+	else
+		*level = STR_float_21_to_32(((uint32)p[2] << 16) | ((uint32)p[1] << 8) | p[0]);
+	return true;
+}
+
+/******************************************************************************
+** Function:	get alarm profiles and envelope thresholds for the next timeslot
+**
+** Notes:		if no file(s) exist(s) next level remains at default NO VALUE level FLT_MAX
+**				Returns false if file system needed but not open yet - call again.
+*/
+bool alm_get_next_levels(uint8 channel)
+{
+	// if channel alarm is enabled and type is not fixed thresholds
+	if (!ALM_config[channel].enabled || (ALM_config[channel].type == ALM_FIXED_ALARM))
+		return true;
+	// else:
+
+	if (ALM_config[channel].type == ALM_PROFILE_ALARM)
+		return alm_get_next_level(channel, ALM_FILE_PROFILE, &ALM_profile_levels[channel]);
+	// else ALM_config[channel].type == ALM_ENVELOPE_ALARM
+
+	return alm_get_next_level(channel, ALM_FILE_ENVELOPE_HIGH, &ALM_envelope_high[channel]) &&
+		   alm_get_next_level(channel, ALM_FILE_ENVELOPE_LOW, &ALM_envelope_low[channel]);
 }
 
 /******************************************************************************
@@ -265,13 +390,13 @@ char * alm_get_units_string(uint8 channel_index)
 {
 #ifndef HDW_RS485
 	if (channel_index < ALM_ANA_ALARM_CHANNEL0)
-		CFS_read_line("\\Config", "Units.txt", alm_get_digital_units_index(channel_index) + 1, alm_filename_str, 8);
+		CFS_cache_read_line("\\Config", "Units.txt", alm_get_digital_units_index(channel_index) + 1, alm_filename_str, 8);
   #ifndef HDW_GPS
 	else
   #endif
 #endif
 #ifndef HDW_GPS
-		CFS_read_line("\\Config", "Units.txt", ANA_config[channel_index - ALM_ANA_ALARM_CHANNEL0].units_index + 1, alm_filename_str, 8);
+		CFS_cache_read_line("\\Config", "Units.txt", ANA_config[channel_index - ALM_ANA_ALARM_CHANNEL0].units_index + 1, alm_filename_str, 8);
 #endif
 	return alm_filename_str;
 }
@@ -956,6 +1081,7 @@ void ALM_process_event(int index, bool value_is_high)
 */
 void ALM_update_profile(void)
 {
+	alm_clear_tables();															// files or channel setup may have changed
 	alm_read_next_thresholds = true;											// force immediate fetch of next profile and envelope values
 	alm_set_wakeup_time();														// recalc next wakeup time for profile AND scripts
 }
@@ -985,6 +1111,7 @@ void ALM_task(void)
 	{
 		ALM_wakeup_time = 0;													// force recalc of wakeup times
 		alm_day_bcd = RTC_now.day_bcd;
+		alm_clear_tables();														// reload profiles once a day
 	}
 
 	if (ALM_wakeup_time <= RTC_time_sec)										// If wakeup time has passed, ensure it is updated.
@@ -1067,11 +1194,14 @@ void ALM_task(void)
 		break;
 
 	case ALM_GET_NEXT_LEVELS:
-		if (!LOG_busy() && !PDU_busy() && CFS_open())
+		if (!LOG_busy() && !PDU_busy())											// file system only opened if a table needs loading
 		{
 			// for each channel
 			if (alm_info_channel < ALM_NUM_ALARM_CHANNELS)
-				alm_get_next_levels(alm_info_channel++);
+			{
+				if (alm_get_next_levels(alm_info_channel))
+					alm_info_channel++;
+			}
 			else
 			{
 				alm_state = ALM_IDLE;
@@ -1116,6 +1246,7 @@ void ALM_init(void)
 		ALM_envelope_high[i] = FLT_MAX;
 		ALM_envelope_low[i] = FLT_MAX;
 	}
+	alm_clear_tables();
 	alm_day_bcd = RTC_now.day_bcd;
 }
 
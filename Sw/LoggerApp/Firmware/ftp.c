@@ -19,6 +19,13 @@
 ** V3.36 140114 PB  FTP_reset_active_retrieval_info() to clear ftp flags, makes FTP_deactivate_retrieval_info() redundant
 **
 ** V4.00 220114 PB  if HDW_GPS disable all analogue calls and functions
+**
+** V6.03 171026     incremental sync - watermark of date & bytes delivered of each channel's day file, one set per client
+**					in \CONFIG\SYNCUSB.TXT and SYNCFTP.TXT. FTP_sync_fill() streams data appended since the watermarks,
+**					FTP_sync_ack() commits them. FTP client gets the stream as an uploaded file, copied by FTP_task.
+**					ftp_day_file_name() shared by FTP_set_filename_and_path() and sync, which keeps its own path buffers
+**					sync sends .BIN day files of channels switched to binary by #LBF, with a second watermark
+**					position for them, as a day can have both a .TXT and a .BIN file if the mask changed during it
 */
 
 #include "custom.h"
@@ -49,11 +56,47 @@
 // Local FTP task states:
 #define FTP_IDLE			0
 #define FTP_TX_RESPONSE		1
+#define FTP_SYNC_COPY		2
 
 uint8  ftp_state;
 bool   ftp_to_send;
 uint16 ftp_files_present;
 
+// Incremental sync watermark of a channel - date of day file and bytes of it delivered to the client
+typedef struct
+{
+	uint8	day_bcd;															// 0 if no watermark
+	uint8	mth_bcd;
+	uint8	yr_bcd;
+	uint8	spare;
+	long	pos;
+#ifdef LOG_BINARY_RECORDS
+	long	bin_pos;															// bytes of .BIN day file delivered
+#endif
+} ftp_sync_mark_type;
+
+const char * const ftp_sync_mark_filename[FTP_SYNC_NUM_CLIENTS] = { "SYNCUSB.TXT", "SYNCFTP.TXT" };
+const char ftp_sync_data_filename[] = "SYNCDATA.TXT";
+
+FAR ftp_sync_mark_type ftp_sync_mark[FTP_NUM_FTPR_CHANNELS];		// watermarks of client being synced, advanced as stream is made
+uint8    ftp_sync_client;											// client whose watermarks are loaded, FTP_SYNC_NONE if none
+uint8    ftp_sync_channel;											// channel being streamed, FTP_NUM_FTPR_CHANNELS when done
+bool     ftp_sync_done;												// end of stream reached - watermarks ready to commit
+#ifdef LOG_BINARY_RECORDS
+bool     ftp_sync_binary;											// .BIN file of ftp_sync_date to be looked for next
+#endif
+bool     ftp_sync_to_send;											// FTP client sync requested
+bool     ftp_sync_append;											// appending to sync data file
+RTC_type ftp_sync_today;											// date stream started
+RTC_type ftp_sync_date;												// date of day file being streamed, 0 at start of channel
+RTC_type ftp_sync_from;												// date to restart FTP client sync from, 0 if from watermarks
+long     ftp_sync_remaining;										// bytes of current day file still to stream
+int      ftp_sync_header_index;										// next char of header to stream, -1 if none
+FAR char ftp_sync_header[80];										// "path\name,offset,length\r\n" before each day file
+FAR char ftp_sync_path[32];
+FAR char ftp_sync_filename[16];
+CFS_session_type ftp_sync_session;
+
 FAR char ftp_rx_buffer[162];
 FAR char ftp_tx_buffer[162];
 FAR unsigned char ftp_input_string[18];
@@ -218,6 +261,170 @@ bool ftp_channel_messaging(int ftp_channel)
 	else return false;
 }
 
+/******************************************************************************
+** Function:	Create path and filename of a channel's day file
+**
+** Notes:		path needs 32 chars, filename 16
+*/
+void ftp_day_file_name(uint8 channel, RTC_type * date_p, char * path, char * filename)
+{
+	strcpy(path, "\\LOGDATA\\");
+	strcat(path, &LOG_channel_id[channel + 1][0]);
+	// use filename temporarily
+	sprintf(filename, "\\20%02x\\%02x", date_p->yr_bcd, date_p->mth_bcd);
+	strcat(path, filename);
+	sprintf(filename, "%s-%02x%02x.TXT", &LOG_channel_id[channel + 1][0], date_p->day_bcd, date_p->mth_bcd);
+}
+
+/******************************************************************************
+** Function:	Load a sync client's watermarks
+**
+** Notes:		One line per channel "ddmmyy,pos" or "ddmmyy,pos,bin_pos". Missing file or line is no watermark.
+**				Read a line at a time, as the file can be longer than STR_buffer.
+*/
+void ftp_sync_load(uint8 client)
+{
+	CFS_session_type session;
+	unsigned int dd, mm, yy;
+	long pos, bin_pos;
+	int i;
+
+	memset(ftp_sync_mark, 0, sizeof(ftp_sync_mark));
+	CFS_session_open(&session, (char *)CFS_config_path, (char *)ftp_sync_mark_filename[client]);
+	for (i = 0; i < FTP_NUM_FTPR_CHANNELS; i++)
+	{
+		if (CFS_session_read_line(&session, STR_buffer, sizeof(STR_buffer)) < 0)	// missing file or end of file
+			break;
+		bin_pos = 0;
+		if ((sscanf(STR_buffer, "%02x%02x%02x,%ld,%ld", &dd, &mm, &yy, &pos, &bin_pos) >= 4) && (pos >= 0) && (bin_pos >= 0))
+		{
+			ftp_sync_mark[i].day_bcd = (uint8)dd;
+			ftp_sync_mark[i].mth_bcd = (uint8)mm;
+			ftp_sync_mark[i].yr_bcd = (uint8)yy;
+			ftp_sync_mark[i].pos = pos;
+#ifdef LOG_BINARY_RECORDS
+			ftp_sync_mark[i].bin_pos = bin_pos;
+#endif
+		}
+	}
+	CFS_session_close(&session);
+}
+
+/******************************************************************************
+** Function:	Save a sync client's watermarks
+**
+** Notes:		Returns false if can't. .BIN position only added to the line if not 0.
+**				Written in parts, as the file can be longer than STR_buffer.
+*/
+bool ftp_sync_save(uint8 client)
+{
+	char * mode;
+	int i, len;
+
+	mode = "w";
+	len = 0;
+	for (i = 0; i < FTP_NUM_FTPR_CHANNELS; i++)
+	{
+		len += sprintf(&STR_buffer[len], "%02x%02x%02x,%ld",
+			ftp_sync_mark[i].day_bcd, ftp_sync_mark[i].mth_bcd, ftp_sync_mark[i].yr_bcd, ftp_sync_mark[i].pos);
+#ifdef LOG_BINARY_RECORDS
+		if (ftp_sync_mark[i].bin_pos != 0)
+			len += sprintf(&STR_buffer[len], ",%ld", ftp_sync_mark[i].bin_pos);
+#endif
+		len += sprintf(&STR_buffer[len], "\r\n");
+		if ((len > sizeof(STR_buffer) - 40) || (i == FTP_NUM_FTPR_CHANNELS - 1))	// no room for another line, or last
+		{
+			if (!CFS_write_file((char *)CFS_config_path, (char *)ftp_sync_mark_filename[client], mode, STR_buffer, len))
+				return false;
+			mode = "a";
+			len = 0;
+		}
+	}
+	return true;
+}
+
+/******************************************************************************
+** Function:	Find next day file with data past its watermark, open it and make its header
+**
+** Notes:		Each channel runs from its watermark's day file, or today's if none, up to the date sync started.
+**				Watermark moves to end of each file as it is found. Returns false when no more files.
+**				Each day's .TXT file is followed by its .BIN file, which has its own watermark position.
+*/
+bool ftp_sync_next_file(void)
+{
+	ftp_sync_mark_type * p;
+	long * pos_p;
+	SearchRec srch;
+
+	while (ftp_sync_channel < FTP_NUM_FTPR_CHANNELS)
+	{
+		p = &ftp_sync_mark[ftp_sync_channel];
+		pos_p = &p->pos;
+#ifdef LOG_BINARY_RECORDS
+		if (ftp_sync_binary)													// .TXT file of this day done - now its .BIN file
+			pos_p = &p->bin_pos;
+		else
+#endif
+		if (ftp_sync_date.reg32[1] == 0)										// start of channel
+		{
+			ftp_sync_date.day_bcd = p->day_bcd;
+			ftp_sync_date.mth_bcd = p->mth_bcd;
+			ftp_sync_date.yr_bcd = p->yr_bcd;
+			if ((p->day_bcd == 0) || (ftp_sync_date.reg32[1] > ftp_sync_today.reg32[1]))	// no watermark, or clock put back
+			{
+				ftp_sync_date.reg32[1] = ftp_sync_today.reg32[1];
+				p->pos = 0;
+#ifdef LOG_BINARY_RECORDS
+				p->bin_pos = 0;
+#endif
+			}
+		}
+		else if ((ftp_sync_date.reg32[1] < ftp_sync_today.reg32[1]) && RTC_get_next_day(&ftp_sync_date))
+		{
+			p->pos = 0;															// next day's file from the start
+#ifdef LOG_BINARY_RECORDS
+			p->bin_pos = 0;
+#endif
+		}
+		else																	// channel up to date
+		{
+			p->day_bcd = ftp_sync_today.day_bcd;
+			p->mth_bcd = ftp_sync_today.mth_bcd;
+			p->yr_bcd = ftp_sync_today.yr_bcd;
+			ftp_sync_channel++;
+			ftp_sync_date.reg32[1] = 0;
+			continue;
+		}
+
+		ftp_day_file_name(ftp_sync_channel, &ftp_sync_date, ftp_sync_path, ftp_sync_filename);
+#ifdef LOG_BINARY_RECORDS
+		if (ftp_sync_binary)
+			strcpy(&ftp_sync_filename[strlen(ftp_sync_filename) - 3], "BIN");
+		ftp_sync_binary = !ftp_sync_binary;										// .BIN file of same day next
+#endif
+		if (!CFS_chdir(ftp_sync_path, false))
+			continue;
+		srch.attributes = ATTR_DIRECTORY;
+		if (FindFirst(ftp_sync_filename, ATTR_MASK, &srch) != 0)
+			continue;
+		if ((long)srch.filesize < *pos_p)										// file has been replaced - send it all
+			*pos_p = 0;
+		if ((long)srch.filesize == *pos_p)										// nothing new
+			continue;
+
+		CFS_session_open(&ftp_sync_session, ftp_sync_path, ftp_sync_filename);
+		CFS_session_seek(&ftp_sync_session, *pos_p);
+		ftp_sync_remaining = (long)srch.filesize - *pos_p;
+		sprintf(ftp_sync_header, "%s\\%s,%ld,%ld\r\n", ftp_sync_path, ftp_sync_filename, *pos_p, ftp_sync_remaining);
+		ftp_sync_header_index = 0;
+		*pos_p = (long)srch.filesize;
+		return true;
+	}
+
+	ftp_sync_done = true;
+	return false;
+}
+
 /*********************************************************************************************************
  * Function:        void ftp_report_now(void)
  *
@@ -492,15 +699,7 @@ bool FTP_get_logon_string(char * logon_string)
  *******************************************************************/
 void   FTP_set_filename_and_path(uint8 channel, RTC_type * date_p)
 {
-	// get path and filename from retrieve data
-	// create path of required file
-	strcpy(FTP_path_str, "\\LOGDATA\\");
-	strcat(FTP_path_str, &LOG_channel_id[channel + 1][0]);
-	// use FTP_filename_str temporarily
-	sprintf(FTP_filename_str, "\\20%02x\\%02x", date_p->yr_bcd, date_p->mth_bcd);
-	strcat(FTP_path_str, FTP_filename_str);
-	// create filename of required file
-	sprintf(FTP_filename_str, "%s-%02x%02x.TXT", &LOG_channel_id[channel + 1][0], date_p->day_bcd, date_p->mth_bcd);
+	ftp_day_file_name(channel, date_p, FTP_path_str, FTP_filename_str);
 }
 
 /********************************************************************
@@ -853,6 +1052,169 @@ void FTP_schedule(void)
 	ftp_to_send = true;
 }
 
+/********************************************************************
+ * Function:        bool FTP_sync_start(uint8 client, RTC_type * from_date_p)
+ *
+ * PreCondition:    None
+ *
+ * Input:           sync client, date to restart from or NULL to use client's watermarks
+ *
+ * Output:          false if file system not available
+ *
+ * Side Effects:    abandons any sync stream in progress
+ *
+ * Overview:        loads watermarks and starts a stream of all data logged since them
+ *
+ * Note:            read stream with FTP_sync_fill()
+ *******************************************************************/
+bool FTP_sync_start(uint8 client, RTC_type * from_date_p)
+{
+	int i;
+
+	CFS_session_close(&ftp_sync_session);
+	ftp_sync_client = FTP_SYNC_NONE;
+	if (!CFS_open())
+		return false;
+
+	if (from_date_p == NULL)
+		ftp_sync_load(client);
+	else
+	{
+		for (i = 0; i < FTP_NUM_FTPR_CHANNELS; i++)
+		{
+			ftp_sync_mark[i].day_bcd = from_date_p->day_bcd;
+			ftp_sync_mark[i].mth_bcd = from_date_p->mth_bcd;
+			ftp_sync_mark[i].yr_bcd = from_date_p->yr_bcd;
+			ftp_sync_mark[i].pos = 0;
+#ifdef LOG_BINARY_RECORDS
+			ftp_sync_mark[i].bin_pos = 0;
+#endif
+		}
+	}
+
+	ftp_sync_client = client;
+	ftp_sync_today.reg32[1] = RTC_now.reg32[1] & 0x00ffffff;
+	ftp_sync_date.reg32[1] = 0;
+	ftp_sync_channel = 0;
+#ifdef LOG_BINARY_RECORDS
+	ftp_sync_binary = false;
+#endif
+	ftp_sync_remaining = 0;
+	ftp_sync_header_index = -1;
+	ftp_sync_done = false;
+	return true;
+}
+
+/********************************************************************
+ * Function:        int FTP_sync_fill(char * buffer, int size)
+ *
+ * PreCondition:    FTP_sync_start()
+ *
+ * Input:           buffer of size chars
+ *
+ * Output:          bytes put in buffer, less than size at end of stream
+ *
+ * Side Effects:    None
+ *
+ * Overview:        fills buffer with next part of sync stream: for each day file with new data,
+ *					header line "path\name,offset,length\r\n" then length bytes from offset
+ *
+ * Note:            adds '\0' after the last byte of the stream
+ *******************************************************************/
+int FTP_sync_fill(char * buffer, int size)
+{
+	int n, i;
+
+	n = 0;
+	while (n < size)
+	{
+		if (ftp_sync_header_index >= 0)											// header
+		{
+			buffer[n++] = ftp_sync_header[ftp_sync_header_index++];
+			if (ftp_sync_header[ftp_sync_header_index] == '\0')
+				ftp_sync_header_index = -1;
+		}
+		else if (ftp_sync_remaining != 0)										// file contents
+		{
+			i = size - n;
+			if (ftp_sync_remaining < (long)i)
+				i = (int)ftp_sync_remaining;
+			i = CFS_session_read(&ftp_sync_session, &buffer[n], i);
+			if (i <= 0)															// file has gone short - pad to length in header
+			{
+				buffer[n] = ' ';
+				i = 1;
+			}
+			n += i;
+			ftp_sync_remaining -= i;
+			if (ftp_sync_remaining == 0)
+				CFS_session_close(&ftp_sync_session);
+		}
+		else if (ftp_sync_done || (ftp_sync_client == FTP_SYNC_NONE) || !ftp_sync_next_file())
+			break;
+	}
+
+	if (n < size)
+		buffer[n] = '\0';
+	return n;
+}
+
+/********************************************************************
+ * Function:        bool FTP_sync_ack(uint8 client)
+ *
+ * PreCondition:    None
+ *
+ * Input:           sync client
+ *
+ * Output:          false if no complete stream sent to the client, or can't save
+ *
+ * Side Effects:    None
+ *
+ * Overview:        commits watermarks at the end of the last stream sent to the client
+ *
+ * Note:            None
+ *******************************************************************/
+bool FTP_sync_ack(uint8 client)
+{
+	if ((ftp_sync_client != client) || !ftp_sync_done)
+		return false;
+
+	ftp_sync_client = FTP_SYNC_NONE;
+	return ftp_sync_save(client);
+}
+
+/********************************************************************
+ * Function:        void FTP_sync_send(RTC_type * from_date_p)
+ *
+ * PreCondition:    None
+ *
+ * Input:           date to restart from or NULL to use FTP client's watermarks
+ *
+ * Output:          None
+ *
+ * Side Effects:    None
+ *
+ * Overview:        schedule sync stream for FTP client - FTP_task writes it to a file and sends it
+ *
+ * Note:            needs to flush the log
+ *******************************************************************/
+void FTP_sync_send(RTC_type * from_date_p)
+{
+	ftp_sync_from.reg32[1] = (from_date_p == NULL) ? 0 : (from_date_p->reg32[1] & 0x00ffffff);
+	LOG_flush();
+	ftp_sync_to_send = true;
+}
+
+/******************************************************************************
+** Function:	Sync stream in progress
+**
+** Notes:		To either client
+*/
+bool FTP_sync_busy(void)
+{
+	return (ftp_sync_to_send || (ftp_state == FTP_SYNC_COPY) || (USB_state == USB_SYNC));
+}
+
 /******************************************************************************
 ** Function:	FTP busy report
 **
@@ -860,7 +1222,7 @@ void FTP_schedule(void)
 */
 bool FTP_busy(void)
 {
-	return ((ftp_state != FTP_IDLE) || ftp_to_send);
+	return ((ftp_state != FTP_IDLE) || ftp_to_send || ftp_sync_to_send);
 }
 
 /******************************************************************************
@@ -870,6 +1232,9 @@ bool FTP_busy(void)
 */
 void FTP_task(void)
 {
+	int n;
+	bool end;
+
 	switch (ftp_state)
 	{
 		case FTP_IDLE:
@@ -881,6 +1246,34 @@ void FTP_task(void)
 					ftp_to_send = false;
 				}
 			}
+			else if (ftp_sync_to_send)
+			{
+				if (CFS_open() && !LOG_busy())
+				{
+					ftp_sync_to_send = false;
+					ftp_sync_append = false;
+					if (FTP_sync_start(FTP_SYNC_FTP, (ftp_sync_from.reg32[1] == 0) ? NULL : &ftp_sync_from))
+						ftp_state = FTP_SYNC_COPY;
+				}
+			}
+			break;
+
+		case FTP_SYNC_COPY:															// copy a block of sync stream to file
+			n = FTP_sync_fill(STR_buffer, sizeof(STR_buffer) - 1);
+			end = (n < (int)sizeof(STR_buffer) - 1);
+			if (end)
+				n++;																// '\0' ends stream, as over USB
+			if (!CFS_write_file((char *)CFS_config_path, (char *)ftp_sync_data_filename, ftp_sync_append ? "a" : "w", STR_buffer, n))
+			{
+				ftp_state = FTP_IDLE;												// give up
+				break;
+			}
+			ftp_sync_append = true;
+			if (end)																// send file
+			{
+				(void)FTP_frd_send((char *)CFS_config_path, (char *)ftp_sync_data_filename);
+				ftp_state = FTP_IDLE;
+			}
 			break;
 
 		case FTP_TX_RESPONSE:
@@ -920,6 +1313,8 @@ void FTP_init(void)
 
 	ftp_state = FTP_IDLE;
 	ftp_to_send = false;
+	ftp_sync_to_send = false;
+	ftp_sync_client = FTP_SYNC_NONE;
 	for (i=0; i<FTP_NUM_FTPR_CHANNELS; i++)
 	{
 		FTP_channel_data_retrieve[i].flags = 0x00;
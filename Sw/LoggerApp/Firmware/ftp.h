@@ -6,6 +6,8 @@
 ** Notes:	FTP message coding
 **
 ** V3.36 140114 PB  remove FTP_deactivate_retrieval_info()
+**
+** V6.03 171026     FTP_sync_xxx() - incremental sync of logged data to a client since its last acknowledged watermark
 */
 
 // Configuration of ftp file retrieval - stuff to be remembered between message creations
@@ -35,6 +37,12 @@ typedef struct
 	long  	 seek_pos;															// byte count into file of next item to be transmitted
 } FTP_file_retrieve_type;
 
+// Incremental sync clients - each has its own watermarks
+#define FTP_SYNC_USB				0
+#define FTP_SYNC_FTP				1
+#define FTP_SYNC_NUM_CLIENTS		2
+#define FTP_SYNC_NONE				0xFF
+
 extern FAR FTP_file_retrieve_type FTP_channel_data_retrieve[FTP_NUM_FTPR_CHANNELS];
 extern FAR char 				  FTP_path_str[32];
 extern FAR char 				  FTP_filename_str[32];
@@ -59,6 +67,11 @@ void   FTP_retrieve_data(uint16 file_flags, RTC_type * file_date_p);
 void   FTP_act_on_ftp_command(void);
 uint8  FTP_set_logon(void);
 void   FTP_schedule(void);
+bool   FTP_sync_start(uint8 client, RTC_type * from_date_p);
+int    FTP_sync_fill(char * buffer, int size);
+bool   FTP_sync_ack(uint8 client);
+void   FTP_sync_send(RTC_type * from_date_p);
+bool   FTP_sync_busy(void);
 bool   FTP_busy(void);
 void   FTP_task(void);
 void   FTP_init(void);
@@ -444,6 +444,22 @@ typedef struct {
 // Description: A macro for the FAT32 boot sector file system type string offset
 #define  BSI_FAT32_FSTYPE  82
 
+// Description: Macros for the boot sector volume ID offsets (V6.03)
+#define  BSI_VOLID         39
+#define  BSI_FAT32_VOLID   67
+
+// Description: A macro for the FAT32 boot sector FSINFO sector number offset (V6.03)
+#define  BSI_FSINFO        48
+
+// Description: Macros for the FAT32 FSINFO sector signatures and field offsets (V6.03)
+#define  FSI_LEADSIG_OFS   0
+#define  FSI_STRUCSIG_OFS  484
+#define  FSI_FREE_COUNT    488
+#define  FSI_NXT_FREE      492
+#define  FSI_LEADSIG       0x41615252
+#define  FSI_STRUCSIG      0x61417272
+#define  FSI_UNKNOWN       0xFFFFFFFF
+
 
 
 // Summary: A partition table entry structure.
@@ -249,6 +249,10 @@ typedef struct
     WORD            attributes;     // The file attributes
     DWORD           dirclus;        // The base cluster of the file's directory
     DWORD           dirccls;        // The current cluster of the file's directory
+#ifdef FS_SEEK_INDEX_SIZE
+    WORD            seekIndexCount; // Number of valid entries in seekIndex
+    DWORD           seekIndex[FS_SEEK_INDEX_SIZE];  // Cluster at ordinal (i + 1) * FS_SEEK_INDEX_INTERVAL in the chain
+#endif
 } FSFILE;
 
 /* Summary: Possible results of the FSGetDiskProperties() function.
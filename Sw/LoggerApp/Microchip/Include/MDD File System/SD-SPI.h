@@ -45,6 +45,7 @@
 extern DWORD MDD_SDSPI_finalLBA;
 extern WORD gMediaSectorSize;
 extern BYTE gSDMode;
+extern BYTE gSDStream;
 extern MEDIA_INFORMATION mediaInformation;
 
 #ifdef __18CXX
@@ -97,6 +98,10 @@ extern MEDIA_INFORMATION mediaInformation;
 // Description: This macro represents an SD card data accepted token
 #define DATA_ACCEPTED               0x05
 
+// Description: These macros represent the start and stop tokens for a multi-block write
+#define DATA_MULTI_START_TOKEN      0xFC
+#define DATA_STOP_TRAN_TOKEN        0xFD
+
 // Description: This macro indicates that the SD card expects to transmit or receive more data
 #define MOREDATA    !0
 
@@ -135,6 +140,8 @@ extern MEDIA_INFORMATION mediaInformation;
 #define     cmdWRITE_SINGLE_BLOCK   24    
 // Description: This macro defines the command code to write multiple blocks to the card
 #define     cmdWRITE_MULTI_BLOCK    25
+// Description: This macro defines the command code to pre-erase blocks before a multi-block write (ACMD23)
+#define     cmdSET_WR_BLK_ERASE_COUNT   23
 // Description: This macro defines the command code to set the address of the start of an erase operation
 #define     cmdTAG_SECTOR_START     32
 // Description: This macro defines the command code to set the address of the end of an erase operation
@@ -437,13 +444,19 @@ typedef enum
     ERASE,
     APP_CMD,
     READ_OCR,
-    CRC_ON_OFF
+    CRC_ON_OFF,
+    SET_WR_BLK_ERASE_COUNT
 }sdmmc_cmd;
 
 
 #define SD_MODE_NORMAL  0
 #define SD_MODE_HC      1
 
+// Values of gSDStream - multi-block transfer in progress
+#define SD_STREAM_NONE  0
+#define SD_STREAM_READ  1
+#define SD_STREAM_WRITE 2
+
 
 /***************************************************************************/
 /*                               Macros                                    */
@@ -470,6 +483,9 @@ BYTE MDD_SDSPI_MediaDetect(void);
 MEDIA_INFORMATION * MDD_SDSPI_MediaInitialize(void);
 BYTE MDD_SDSPI_SectorRead(DWORD sector_addr, BYTE* buffer);
 BYTE MDD_SDSPI_SectorWrite(DWORD sector_addr, BYTE* buffer, BYTE allowWriteToZero);
+void MDD_SDSPI_StreamStop(void);
+void MDD_SDSPI_WriteHint(WORD count);
+void MDD_SDSPI_ReadHint(WORD count);
 
 BYTE MDD_SDSPI_WriteProtectState(void);
 BYTE MDD_SDSPI_ShutdownMedia(void);
@@ -54,6 +54,24 @@
           Add some error recovery for FAT32 systems when there is
             corruption in the boot sector.
   V4.06   gLastFreeCluster added for faster creation of new files and avoidance of file system corruption
+  V6.03   gDirGeneration bumped whenever the directory tree may have changed, FS_get_cwd() & FS_set_cwd()
+          added for the CFS directory cache
+  V6.03   Sparse cluster seek index per FSFILE used by FSfseek(), seek statistics
+  V6.03   LRU write-back sector cache under MDD_SectorRead/MDD_SectorWrite, flushed by FSfclose()
+          and FS_cache_flush(), discarded by FSInit() & FSformat()
+  V6.03   FS_cache_flush() writes dirty sectors in ascending order, with a count of each run of
+          consecutive sectors for the media driver, then completes any multi-block transfer
+  V6.03   Free-space map of full FAT sectors skipped by FATfindEmptyCluster(), kept while the same card
+          is mounted. Free cluster count maintained by WriteFAT(). FAT32 FSINFO free count & next free
+          cluster read at mount and written back by FS_flush(), called from CFS_flush() & CFS_power_down().
+          FSfclose() only writes back the sector cache, so a close doesn't cost an FSINFO read & write.
+  V6.03   FS_preallocate() & FS_trim(). FSfwrite() at end of file follows any clusters already
+          in the chain before allocating a new one, and does not read sectors beyond end of file.
+  V6.03   gDirGeneration no longer bumped by every FSInit(), only when the card mounted is not the one
+          last mounted (volume ID & FAT geometry), or its FAT32 FSINFO free count has been changed
+          elsewhere, so the CFS directory cache is kept while the card is powered down between uses
+  V6.03   FSfread() hints the card driver with the sectors it is about to read in the current cluster,
+          and ends any multi-block read before it returns
 
 ********************************************************************/
 
@@ -141,6 +159,40 @@ FSFILE  tempCWDobj;                 // Global variable used to preserve the curr
 FSFILE  gFileTemp;                  // Global variable used for file operations.
 
 DWORD	gLastFreeCluster;			// Added by MA May 2014
+WORD	gDirGeneration;				// Incremented by mount of changed card, FSformat, FSrename, FSmkdir & FSrmdir - CFS directory cache invalid if changed
+DWORD	gSeekCount;					// Number of FSfseek() calls
+DWORD	gSeekClusterHops;			// FAT links followed by FSfseek()
+DWORD	gSeekClustersSkipped;		// FAT links not followed because of the seek index
+
+#ifdef FS_SECTOR_CACHE_SIZE
+typedef struct
+{
+	DWORD	sector;					// sector address on card
+	WORD	used;					// value of fs_cache_tick when last accessed
+	BYTE	valid;					// data holds sector
+	BYTE	dirty;					// data not yet written to card
+} FS_cache_slot_type;
+
+BYTE __attribute__ ((far)) fs_cache_data[FS_SECTOR_CACHE_SIZE][MEDIA_SECTOR_SIZE];	// far: FS_SECTOR_CACHE_SIZE * 512 bytes
+FS_cache_slot_type fs_cache_slot[FS_SECTOR_CACHE_SIZE];
+WORD	fs_cache_tick;
+#endif
+DWORD	gSectorCacheHits;			// Sector reads satisfied from cache
+DWORD	gSectorCacheMisses;			// Sector reads from card
+DWORD	gSectorCacheWrites;			// Sector writes by FSIO
+DWORD	gSectorCacheWriteBacks;		// Sector writes to card
+
+#ifdef FS_FREE_MAP_BYTES
+BYTE	gFreeMap[FS_FREE_MAP_BYTES];	// bit set if FAT sector has no free clusters
+#endif
+DWORD	gFreeMapFat;				// FAT start sector, cluster count & volume ID of the card gFreeMap,
+DWORD	gFreeMapMaxcls;				// gLastFreeCluster & gFreeClusterCount apply to
+DWORD	gFreeMapVolID;
+DWORD	gFreeClusterCount = FSI_UNKNOWN;	// free clusters on card, FSI_UNKNOWN if not known
+DWORD	gFSInfoSector;				// FAT32 FSINFO sector, 0 if none
+BYTE	gFSInfoDirty;				// gFreeClusterCount or gLastFreeCluster changed since FSINFO written
+DWORD	gFreeMapSkips;				// FAT sectors skipped by FATfindEmptyCluster()
+DWORD	gFreeScanReads;				// FAT entries read by FATfindEmptyCluster()
 
 #ifdef ALLOW_DIRS
     FSFILE   cwd;               // Global current working directory
@@ -257,6 +309,15 @@ BYTE ValidateChars (char * FileName, BYTE mode);
 BYTE FormatFileName( const char* fileName, char* fN2, BYTE mode);
 CETYPE FILEfind( FILEOBJ foDest, FILEOBJ foCompareTo, BYTE cmd, BYTE mode);
 BYTE FILEget_next_cluster(FILEOBJ fo, DWORD n);
+BYTE FILEseek_cluster(FILEOBJ fo, DWORD n);
+BYTE FS_cache_flush(void);
+void FS_cache_invalidate(void);
+BYTE FS_flush(void);
+void fs_free_map_mount(DISK *dsk);
+void fs_free_map_clear(void);
+DWORD fs_free_map_entries(DISK *dsk);
+BYTE fs_free_map_bit(DWORD n, BYTE mode);
+void fs_read_hint(FSFILE *stream, DWORD seek, WORD pos, DWORD len);
 CETYPE FILEopen (FILEOBJ fo, WORD *fHandle, char type);
 
 // Write functions
@@ -341,6 +402,7 @@ DWORD GetFullClusterNumber(DIRENTRY entry);
 int FSInit(void)
 {
     int fIndex;
+
 #ifndef FS_DYNAMIC_MEM
     for( fIndex = 0; fIndex < FS_MAX_FILES_OPEN; fIndex++ )
         gFileSlotOpen[fIndex] = TRUE;
@@ -354,6 +416,7 @@ int FSInit(void)
     gNeedFATWrite = FALSE;
     gLastFATSectorRead = 0xFFFFFFFF;
     gLastDataSectorRead = 0xFFFFFFFF;
+    FS_cache_invalidate();                  // card may have been changed
 
     MDD_InitIO();
 
@@ -789,6 +852,300 @@ BYTE FILEget_next_cluster(FILEOBJ fo, DWORD n)
 } // get next cluster
 
 
+/******************************************************************************
+** Function:	Set current cluster of a file to the n'th cluster in its chain
+**
+** Notes:		Starts from the nearest seek index entry at or below n, or from the
+**				first cluster, and records new index entries as it goes. Appending to
+**				the file never changes existing links, so entries stay valid until the
+**				FSFILE is reopened. n == 0 selects the first cluster.
+**				Return values as FILEget_next_cluster().
+*/
+BYTE FILEseek_cluster(FILEOBJ fo, DWORD n)
+{
+    BYTE    error = CE_GOOD;
+#ifdef FS_SEEK_INDEX_SIZE
+    DWORD   ord, step;
+    WORD    k;
+
+    k = (WORD)(n / FS_SEEK_INDEX_INTERVAL);
+    if (k > fo->seekIndexCount)
+        k = fo->seekIndexCount;
+    fo->ccls = (k > 0) ? fo->seekIndex[k - 1] : fo->cluster;
+    ord = (DWORD)k * FS_SEEK_INDEX_INTERVAL;
+    gSeekClustersSkipped += ord;
+
+    while (ord < n)
+    {
+        // go to the next index boundary, or n if that is nearer
+        step = FS_SEEK_INDEX_INTERVAL - (ord % FS_SEEK_INDEX_INTERVAL);
+        if (step > n - ord)
+            step = n - ord;
+        gSeekClusterHops += step;
+        error = FILEget_next_cluster(fo, step);
+        if (error != CE_GOOD)
+            break;
+        ord += step;
+
+        // remember it if it is the next entry due
+        if ((ord == (DWORD)(fo->seekIndexCount + 1) * FS_SEEK_INDEX_INTERVAL) &&
+            (fo->seekIndexCount < FS_SEEK_INDEX_SIZE))
+            fo->seekIndex[fo->seekIndexCount++] = fo->ccls;
+    }
+#else
+    fo->ccls = fo->cluster;
+    if (n > 0)
+    {
+        gSeekClusterHops += n;
+        error = FILEget_next_cluster(fo, n);
+    }
+#endif
+
+    return error;
+}
+
+
+#ifdef FS_SECTOR_CACHE_SIZE
+/******************************************************************************
+** Function:	Find cache slot holding sector
+**
+** Notes:		Returns slot index, or -1 if not cached
+*/
+int fs_cache_find(DWORD sector_addr)
+{
+	int i;
+
+	for (i = 0; i < FS_SECTOR_CACHE_SIZE; i++)
+	{
+		if (fs_cache_slot[i].valid && (fs_cache_slot[i].sector == sector_addr))
+			return i;
+	}
+
+	return -1;
+}
+
+/******************************************************************************
+** Function:	Get a slot for a new sector
+**
+** Notes:		Returns an empty slot, else the least recently used one after writing
+**				it back if dirty. Returns -1 if write-back fails.
+*/
+int fs_cache_victim(void)
+{
+	int i, lru;
+
+	lru = 0;
+	for (i = 0; i < FS_SECTOR_CACHE_SIZE; i++)
+	{
+		if (!fs_cache_slot[i].valid)
+			return i;
+		if ((WORD)(fs_cache_tick - fs_cache_slot[i].used) > (WORD)(fs_cache_tick - fs_cache_slot[lru].used))
+			lru = i;
+	}
+
+	if (fs_cache_slot[lru].dirty)
+	{
+		if (!MDD_MediaSectorWrite(fs_cache_slot[lru].sector, fs_cache_data[lru], TRUE))
+			return -1;
+		gSectorCacheWriteBacks++;
+		fs_cache_slot[lru].dirty = FALSE;
+	}
+	fs_cache_slot[lru].valid = FALSE;
+
+	return lru;
+}
+
+/******************************************************************************
+** Function:	Read sector via cache
+**
+** Notes:		Replaces MDD_SectorRead for FSIO. Same return value.
+*/
+BYTE FS_cache_sector_read(DWORD sector_addr, BYTE* buffer)
+{
+	int i;
+
+	fs_cache_tick++;
+	i = fs_cache_find(sector_addr);
+	if (i >= 0)
+		gSectorCacheHits++;
+	else
+	{
+		gSectorCacheMisses++;
+		i = fs_cache_victim();
+		if (i < 0)
+			return FALSE;
+		if (!MDD_MediaSectorRead(sector_addr, fs_cache_data[i]))
+			return FALSE;
+		fs_cache_slot[i].sector = sector_addr;
+		fs_cache_slot[i].valid = TRUE;
+		fs_cache_slot[i].dirty = FALSE;
+	}
+
+	fs_cache_slot[i].used = fs_cache_tick;
+	if (buffer != NULL)
+		memcpy(buffer, fs_cache_data[i], MEDIA_SECTOR_SIZE);
+
+	return TRUE;
+}
+
+/******************************************************************************
+** Function:	Write sector via cache
+**
+** Notes:		Replaces MDD_SectorWrite for FSIO. Same return value.
+**				Sector 0 (MBR or boot sector) is always written through to the card.
+*/
+BYTE FS_cache_sector_write(DWORD sector_addr, BYTE* buffer, BYTE allowWriteToZero)
+{
+	int i;
+
+	gSectorCacheWrites++;
+	fs_cache_tick++;
+	i = fs_cache_find(sector_addr);
+	if (sector_addr == 0)
+	{
+		if (i >= 0)
+			fs_cache_slot[i].valid = FALSE;
+		gSectorCacheWriteBacks++;
+		return MDD_MediaSectorWrite(sector_addr, buffer, allowWriteToZero);
+	}
+
+	if (i < 0)
+	{
+		i = fs_cache_victim();
+		if (i < 0)
+			return FALSE;
+		fs_cache_slot[i].sector = sector_addr;
+		fs_cache_slot[i].valid = TRUE;
+	}
+
+	memcpy(fs_cache_data[i], buffer, MEDIA_SECTOR_SIZE);
+	fs_cache_slot[i].dirty = TRUE;
+	fs_cache_slot[i].used = fs_cache_tick;
+
+	return TRUE;
+}
+#endif
+
+/******************************************************************************
+** Function:	Write all dirty sectors in cache to card
+**
+** Notes:		Returns FALSE if any write failed - those sectors stay dirty.
+**				Lowest sector first, so consecutive sectors go in one multi-block write.
+*/
+BYTE FS_cache_flush(void)
+{
+	BYTE result = TRUE;
+#ifdef FS_SECTOR_CACHE_SIZE
+	int i, lowest, next;
+	WORD run;
+	DWORD after = 0;
+	BYTE first = TRUE;
+
+	do
+	{
+		// find lowest dirty sector above the last one written
+		lowest = -1;
+		for (i = 0; i < FS_SECTOR_CACHE_SIZE; i++)
+		{
+			if (fs_cache_slot[i].valid && fs_cache_slot[i].dirty &&
+				(first || (fs_cache_slot[i].sector > after)) &&
+				((lowest < 0) || (fs_cache_slot[i].sector < fs_cache_slot[lowest].sector)))
+				lowest = i;
+		}
+		if (lowest < 0)
+			break;
+
+		// count the run of consecutive dirty sectors starting there
+		run = 1;
+		while ((next = fs_cache_find(fs_cache_slot[lowest].sector + run)) >= 0)
+		{
+			if (!fs_cache_slot[next].dirty)
+				break;
+			run++;
+		}
+		if (run > 1)
+			MDD_MediaWriteHint(run);
+
+		if (MDD_MediaSectorWrite(fs_cache_slot[lowest].sector, fs_cache_data[lowest], TRUE))
+		{
+			gSectorCacheWriteBacks++;
+			fs_cache_slot[lowest].dirty = FALSE;
+		}
+		else
+			result = FALSE;
+		after = fs_cache_slot[lowest].sector;
+		first = FALSE;
+	} while (TRUE);
+#endif
+	MDD_MediaSync();
+
+	return result;
+}
+
+/******************************************************************************
+** Function:	Empty sector cache without writing anything
+**
+** Notes:		Any unflushed writes are lost
+*/
+void FS_cache_invalidate(void)
+{
+#ifdef FS_SECTOR_CACHE_SIZE
+	int i;
+
+	for (i = 0; i < FS_SECTOR_CACHE_SIZE; i++)
+	{
+		fs_cache_slot[i].valid = FALSE;
+		fs_cache_slot[i].dirty = FALSE;
+	}
+#endif
+}
+
+/******************************************************************************
+** Function:	Write back everything pending - FSINFO, then sector cache
+**
+** Notes:		Returns FALSE if any write failed.
+**				FSINFO is read into the data buffer, so the buffer is released first.
+*/
+BYTE FS_flush(void)
+{
+	BYTE result = TRUE;
+
+#ifdef ALLOW_WRITES
+	if (gFSInfoDirty && (gFSInfoSector != 0) && gDiskData.mount)
+	{
+		if (gNeedDataWrite)
+			if (flushData())
+				return FALSE;
+		gBufferOwner = NULL;
+		gBufferZeroed = FALSE;
+		gLastDataSectorRead = 0xFFFFFFFF;
+
+		if (MDD_SectorRead(gFSInfoSector, gDataBuffer) &&
+			(ReadDWord(gDataBuffer, FSI_LEADSIG_OFS) == FSI_LEADSIG) &&
+			(ReadDWord(gDataBuffer, FSI_STRUCSIG_OFS) == FSI_STRUCSIG))
+		{
+			gDataBuffer[FSI_FREE_COUNT]     = (BYTE)gFreeClusterCount;
+			gDataBuffer[FSI_FREE_COUNT + 1] = (BYTE)(gFreeClusterCount >> 8);
+			gDataBuffer[FSI_FREE_COUNT + 2] = (BYTE)(gFreeClusterCount >> 16);
+			gDataBuffer[FSI_FREE_COUNT + 3] = (BYTE)(gFreeClusterCount >> 24);
+			gDataBuffer[FSI_NXT_FREE]     = (BYTE)gLastFreeCluster;
+			gDataBuffer[FSI_NXT_FREE + 1] = (BYTE)(gLastFreeCluster >> 8);
+			gDataBuffer[FSI_NXT_FREE + 2] = (BYTE)(gLastFreeCluster >> 16);
+			gDataBuffer[FSI_NXT_FREE + 3] = (BYTE)(gLastFreeCluster >> 24);
+			if (!MDD_SectorWrite(gFSInfoSector, gDataBuffer, FALSE))
+				result = FALSE;
+		}
+		gFSInfoDirty = FALSE;					// don't keep trying if sector is bad
+	}
+#endif
+
+	if (!FS_cache_flush())
+		result = FALSE;
+
+	return result;
+}
+
+
 /**************************************************************************
   Function:
     BYTE DISKmount ( DISK *dsk)
@@ -1272,6 +1629,9 @@ BYTE LoadBootSector(DISK *dsk)
             break;
         }
         while(1);
+
+        if (error == CE_GOOD)
+            fs_free_map_mount(dsk);             // boot sector still in buffer
     }
 
     if(error != CE_GOOD)
@@ -1508,11 +1868,14 @@ int FSformat (char mode, long int serialNumber, char * volumeID)
 #endif
 
     FSerrno = CE_GOOD;
+    gDirGeneration++;
 
     gBufferZeroed = FALSE;
     gNeedFATWrite = FALSE;
     gLastFATSectorRead = 0xFFFFFFFF;
     gLastDataSectorRead = 0xFFFFFFFF;
+    FS_cache_invalidate();                  // contents are about to be overwritten
+    gFreeMapFat = 0;                        // free space info re-read at next mount
 
     disk->buffer = gDataBuffer;
 
@@ -3069,16 +3432,132 @@ BYTE FILEallocate_new_cluster( FILEOBJ fo, BYTE mode)
     Should not be called by user
   ***********************************************/
 
+/******************************************************************************
+** Function:	Check free-space info still applies to mounted card
+**
+** Notes:		Called when boot sector has been loaded into dsk->buffer.
+**				On a different card (or after FSformat) the map is cleared, and on FAT32
+**				gLastFreeCluster & gFreeClusterCount are taken from the FSINFO sector.
+**				gDirGeneration is bumped on a different card, or if the FSINFO free count shows
+**				the card has been written elsewhere, e.g. by a PC, since it was last mounted here.
+*/
+void fs_free_map_mount(DISK *dsk)
+{
+	DWORD vol_id;
+	BYTE same_card;
+
+	vol_id = ReadDWord(dsk->buffer, (dsk->type == FAT32) ? BSI_FAT32_VOLID : BSI_VOLID);
+	same_card = (gFreeMapFat == dsk->fat) && (gFreeMapMaxcls == dsk->maxcls) && (gFreeMapVolID == vol_id);
+	gFSInfoSector = 0;
+	gFSInfoDirty = FALSE;
+	if (!same_card)
+	{
+		gDirGeneration++;								// directory cache not for this card
+		fs_free_map_clear();
+		gFreeMapFat = dsk->fat;
+		gFreeMapMaxcls = dsk->maxcls;
+		gFreeMapVolID = vol_id;
+		gLastFreeCluster = 2;
+		gFreeClusterCount = FSI_UNKNOWN;
+	}
+
+#ifdef SUPPORT_FAT32
+	if (dsk->type == FAT32)
+	{
+		gFSInfoSector = dsk->firsts + ReadWord(dsk->buffer, BSI_FSINFO);
+		if (gFSInfoSector == dsk->firsts)				// 0 means no FSINFO
+			gFSInfoSector = 0;
+		else if (MDD_SectorRead(gFSInfoSector, dsk->buffer) &&
+				 (ReadDWord(dsk->buffer, FSI_LEADSIG_OFS) == FSI_LEADSIG) &&
+				 (ReadDWord(dsk->buffer, FSI_STRUCSIG_OFS) == FSI_STRUCSIG))
+		{
+			// take count even on same card, in case a PC has changed it
+			vol_id = ReadDWord(dsk->buffer, FSI_FREE_COUNT);
+			if (same_card && (gFreeClusterCount != FSI_UNKNOWN) && (vol_id != gFreeClusterCount))
+			{
+				gDirGeneration++;						// written elsewhere - tree & free space may have changed
+				fs_free_map_clear();
+			}
+			gFreeClusterCount = vol_id;
+			if (gFreeClusterCount > dsk->maxcls)
+				gFreeClusterCount = FSI_UNKNOWN;
+			vol_id = ReadDWord(dsk->buffer, FSI_NXT_FREE);
+			if (!same_card && (vol_id >= 2) && (vol_id <= dsk->maxcls))
+				gLastFreeCluster = vol_id;
+		}
+		else
+			gFSInfoSector = 0;
+	}
+#endif
+}
+
+/******************************************************************************
+** Function:	Forget which FAT sectors are full
+**
+** Notes:	
+*/
+void fs_free_map_clear(void)
+{
+#ifdef FS_FREE_MAP_BYTES
+	memset(gFreeMap, 0, sizeof(gFreeMap));
+#endif
+}
+
+/******************************************************************************
+** Function:	Number of FAT entries per FAT sector covered by free-space map
+**
+** Notes:		0 if map not used - FAT12 entries can cross sector boundaries
+*/
+DWORD fs_free_map_entries(DISK *dsk)
+{
+#ifdef FS_FREE_MAP_BYTES
+	if (dsk->type == FAT16)
+		return dsk->sectorSize / 2;
+  #ifdef SUPPORT_FAT32
+	if (dsk->type == FAT32)
+		return dsk->sectorSize / 4;
+  #endif
+#endif
+	return 0;
+}
+
+/******************************************************************************
+** Function:	Test, set or clear bit in free-space map for FAT sector n
+**
+** Notes:		mode 0 = test, 1 = set (sector full), 2 = clear (sector has a free cluster).
+**				FAT sectors beyond the map always test FALSE.
+*/
+BYTE fs_free_map_bit(DWORD n, BYTE mode)
+{
+#ifdef FS_FREE_MAP_BYTES
+	BYTE mask;
+
+	if (n >= (DWORD)FS_FREE_MAP_BYTES * 8)
+		return FALSE;
+
+	mask = 1 << (n & 7);
+	n >>= 3;
+	if (mode == 1)
+		gFreeMap[n] |= mask;
+	else if (mode == 2)
+		gFreeMap[n] &= ~mask;
+
+	return ((gFreeMap[n] & mask) != 0);
+#else
+	return FALSE;
+#endif
+}
+
 #ifdef ALLOW_WRITES
 DWORD FATfindEmptyCluster(FILEOBJ fo)
 {
     DISK *   disk;
     DWORD    value = 0x0;
-    DWORD    c,curcls, EndClusterLimit, ClusterFailValue;
+    DWORD    c, EndClusterLimit, ClusterFailValue;
+    DWORD    per, start, remaining;
+    BYTE     skipped, retry = TRUE;
 
     disk = fo->dsk;
-    //c = fo->ccls;				// REPLACED for speedup MA May 2014
-	c = gLastFreeCluster;
 
     /* Settings based on FAT type */
     switch (disk->type)
@@ -3100,38 +3579,76 @@ DWORD FATfindEmptyCluster(FILEOBJ fo)
             break;
     }
 
-    // just in case
-    if(c < 2)
-        c = 2;
+    per = fs_free_map_entries(disk);
 
-    curcls = c;
-
-    // sequentially scan through the FAT looking for an empty cluster
 	do
-    {
-		value = ReadFAT(disk, c);
-
-		// check if empty cluster found
-        if (value == CLUSTER_EMPTY)
-		{
-			gLastFreeCluster = c;
-            break;
+	{
+	    //c = fo->ccls;				// REPLACED for speedup MA May 2014
+		c = gLastFreeCluster;
+
+	    // just in case
+	    if ((c < 2) || (c > disk->maxcls))
+	        c = 2;
+
+		remaining = disk->maxcls - 1;	// clusters 2 to maxcls
+		start = c;						// where scan of this FAT sector began
+		skipped = FALSE;
+
+	    // sequentially scan through the FAT looking for an empty cluster,
+		// skipping FAT sectors known to be full
+		while (remaining != 0)
+	    {
+			if ((per != 0) && fs_free_map_bit(c / per, 0))
+			{
+				skipped = TRUE;
+				gFreeMapSkips++;
+				value = (c / per + 1) * per;				// start of next FAT sector
+				if (value > disk->maxcls + 1)
+					value = disk->maxcls + 1;
+				value -= c;
+				remaining = (value < remaining) ? remaining - value : 0;
+				c += value;
+				if (c > disk->maxcls)
+					c = 2;
+				start = c;
+				continue;
+			}
+
+			value = ReadFAT(disk, c);
+			gFreeScanReads++;
+
+			// check if empty cluster found
+	        if (value == CLUSTER_EMPTY)
+			{
+				if (gLastFreeCluster != c)
+					gFSInfoDirty = TRUE;
+				gLastFreeCluster = c;
+	            return(c);
+			}
+
+	        if (value == ClusterFailValue)
+				return 0;
+
+			remaining--;
+
+	        // check next cluster in FAT, noting FAT sectors found to be full
+			c++;
+	        if ((c > disk->maxcls) || (value == EndClusterLimit) || ((per != 0) && ((c % per) == 0)))
+			{
+				if ((per != 0) && (value != EndClusterLimit) && (((start % per) == 0) || (start == 2)))
+					fs_free_map_bit((c - 1) / per, 1);
+				if ((c > disk->maxcls) || (value == EndClusterLimit))
+	            	c = 2;					// re-start from top
+				start = c;
+			}
 		}
 
-        if (value == ClusterFailValue)
+		// full circle done - disk full, unless map was out of date
+		if (!skipped || !retry)
 			return 0;
-
-        // check next cluster in FAT
-        if ((++c >= disk->maxcls + 1) || (value == EndClusterLimit))
-            c = 2;					// re-start from top
-
-        // check if full circle done, disk full
-        if (c == curcls)
-			return 0;
-
-	} while (c != 0);				// scanning for an empty cluster
-
-	return(c);
+		fs_free_map_clear();
+		retry = FALSE;
+	} while (TRUE);
 }
 #endif
 
@@ -3447,6 +3964,14 @@ int FSfclose(FSFILE   *fo)
     }
 #endif
 
+    // write back anything held in the sector cache, including changes by FSmkdir etc.
+    // FSINFO is left to FS_flush(), called when the card is flushed or powered down
+    if (!FS_cache_flush())
+    {
+        FSerrno = CE_WRITE_ERROR;
+        error = EOF;
+    }
+
 #ifdef FS_DYNAMIC_MEM
     FS_free((unsigned char *)fo);
 #else
@@ -3909,6 +4434,7 @@ int FSrename (const char * fileName, FSFILE * fo)
     DIRENTRY    dir;
 
     FSerrno = CE_GOOD;
+    gDirGeneration++;
 
     if (fo == NULL)
     {
@@ -4113,6 +4639,9 @@ FSFILE * FSfopen( const char * fileName, const char *mode )
     filePtr->dsk = &gDiskData;
     filePtr->cluster = 0;
     filePtr->ccls    = 0;
+#ifdef FS_SEEK_INDEX_SIZE
+    filePtr->seekIndexCount = 0;
+#endif
     filePtr->entry = 0;
     filePtr->attributes = ATTR_ARCHIVE;
 
@@ -5201,13 +5730,23 @@ size_t FSfwrite(const void *ptr, size_t size, size_t n, FSFILE *stream)
 
                 if(stream->flags.FileWriteEOF)
                 {
-                    error = FILEallocate_new_cluster(stream, 0);    // add new cluster to the file
-                    needRead = FALSE;
+                    // use next cluster if preallocated, else add new cluster to the file
+                    l = stream->ccls;
+                    error = FILEget_next_cluster( stream, 1);
+                    if (error == CE_FAT_EOF)
+                    {
+                        stream->ccls = l;
+                        error = FILEallocate_new_cluster(stream, 0);
+                    }
                 }
                 else
                     error = FILEget_next_cluster( stream, 1);
             }
 
+            // nothing worth reading beyond end of file
+            if (stream->flags.FileWriteEOF)
+                needRead = FALSE;
+
             if (error == CE_DISK_FULL)
             {
                 FSerrno = CE_DISK_FULL;
@@ -5350,6 +5889,27 @@ int FSfeof( FSFILE * stream )
 }
 
 
+/******************************************************************************
+** Function:	Tell media driver how many sectors of the current cluster a read will need
+**
+** Notes:		seek & pos are where the read starts, len is the bytes wanted. Only sent if more than
+**				one sector, so a single sector is read without starting a multi-block read.
+*/
+void fs_read_hint(FSFILE *stream, DWORD seek, WORD pos, DWORD len)
+{
+	DISK *dsk = (DISK *)stream->dsk;
+	DWORD n;
+
+	n = stream->size - seek;								// not beyond end of file
+	if (n > len)
+		n = len;
+	n = (pos + n + dsk->sectorSize - 1) / dsk->sectorSize;
+	if (n > (DWORD)(dsk->SecPerClus - stream->sec))		// not beyond end of cluster
+		n = dsk->SecPerClus - stream->sec;
+	if (n > 1)
+		MDD_MediaReadHint((WORD)n);
+}
+
 /**************************************************************************
   Function:
     size_t FSfread(void *ptr, size_t size, size_t n, FSFILE *stream)
@@ -5419,6 +5979,7 @@ size_t FSfread (void *ptr, size_t size, size_t n, FSFILE *stream)
         sec_sel += (WORD)stream->sec;      // add the sector number to it
 
         gBufferZeroed = FALSE;
+        fs_read_hint(stream, seek, pos, len);
         if( !MDD_SectorRead( sec_sel, dsk->buffer) )
         {
             FSerrno = CE_BAD_SECTOR_READ;
@@ -5460,6 +6021,7 @@ size_t FSfread (void *ptr, size_t size, size_t n, FSFILE *stream)
             sec_sel = Cluster2Sector(dsk,stream->ccls);
             sec_sel += (WORD)stream->sec;      // add the sector number to it
 
+            fs_read_hint(stream, seek, 0, len);
 
             gBufferOwner = stream;
             gBufferZeroed = FALSE;
@@ -5485,6 +6047,8 @@ size_t FSfread (void *ptr, size_t size, size_t n, FSFILE *stream)
     // save off the seek
     stream->seek = seek;
 
+    MDD_MediaSync();            // no multi-block read left open between calls
+
     return(readCount / size);
 } // fread
 
@@ -5914,6 +6478,8 @@ int FSfseek(FSFILE *stream, long offset, int whence)
         }
 #endif
 
+    gSeekCount++;
+
     // start from the beginning
     temp = stream->cluster;
     stream->ccls = temp;
@@ -5950,7 +6516,7 @@ int FSfseek(FSFILE *stream, long offset, int whence)
         // if we are in the current cluster stay there
         if (temp > 0)
         {
-            test = FILEget_next_cluster(stream, temp);
+            test = FILEseek_cluster(stream, temp);
             if (test != CE_GOOD)
             {
                 if (test == CE_FAT_EOF)
@@ -5959,10 +6525,7 @@ int FSfseek(FSFILE *stream, long offset, int whence)
                     if (stream->flags.write)
                     {
                         // load the previous cluster
-                        stream->ccls = stream->cluster;
-                        // Don't perform this operation if there's only one cluster
-                        if (temp != 1)
-                        test = FILEget_next_cluster(stream, temp - 1);
+                        test = FILEseek_cluster(stream, temp - 1);
                         if (FILEallocate_new_cluster(stream, 0) != CE_GOOD)
                         {
                             FSerrno = CE_COULD_NOT_GET_CLUSTER;
@@ -5973,8 +6536,7 @@ int FSfseek(FSFILE *stream, long offset, int whence)
                     else
                     {
 #endif
-                        stream->ccls = stream->cluster;
-                        test = FILEget_next_cluster(stream, temp - 1);
+                        test = FILEseek_cluster(stream, temp - 1);
                         if (test != CE_GOOD)
                         {
                             FSerrno = CE_COULD_NOT_GET_CLUSTER;
@@ -6478,6 +7040,28 @@ DWORD WriteFAT (DISK *dsk, DWORD ccls, DWORD value, BYTE forceWrite)
         }
     }
 
+    // keep free cluster count & free-space map up to date
+    if (dsk->type != FAT12)
+    {
+        if (dsk->type == FAT16)
+            c = (RAMread(gFATBuffer, p) | RAMread(gFATBuffer, p + 1)) == 0;
+        else
+            c = (RAMread(gFATBuffer, p) | RAMread(gFATBuffer, p + 1) | RAMread(gFATBuffer, p + 2) | (RAMread(gFATBuffer, p + 3) & 0x0F)) == 0;
+        if (c != (value == CLUSTER_EMPTY))       // changing between free & used
+        {
+            if (gFreeClusterCount != FSI_UNKNOWN)
+            {
+                if (c)
+                    gFreeClusterCount--;
+                else
+                    gFreeClusterCount++;
+            }
+            if (!c)                             // freed
+                fs_free_map_bit(l - dsk->fat, 2);
+            gFSInfoDirty = TRUE;
+        }
+    }
+
 #ifdef SUPPORT_FAT32 // If FAT32 supported.
     if (dsk->type == FAT32)  // Refer page 16 of FAT requirement.
     {
@@ -7022,6 +7606,152 @@ int chdirhelper (BYTE mode, char * ramptr, char * romptr)
     } // loop
 }
 
+#ifdef ALLOW_WRITES
+/******************************************************************************
+** Function:	Preallocate clusters so file can grow to a given size
+**
+** Notes:		File must be open for writing. Size is unchanged - FSfwrite() at end of file
+**				uses the extra clusters, which are consecutive if the free space allows.
+**				Returns 0 if OK, else EOF.
+*/
+int FS_preallocate(FSFILE * fo, DWORD bytes)
+{
+	DWORD cluster_bytes, needed, n, c, ccls;
+	BYTE error = CE_GOOD;
+
+	if (!fo->flags.write || (fo->cluster == 0))
+		return EOF;
+
+	cluster_bytes = (DWORD)fo->dsk->SecPerClus * fo->dsk->sectorSize;
+	needed = (bytes + cluster_bytes - 1) / cluster_bytes;
+	ccls = fo->ccls;
+
+	// find last cluster in chain so far
+	fo->ccls = fo->cluster;
+	n = 1;
+	while ((n < needed) && (error == CE_GOOD))
+	{
+		c = fo->ccls;
+		error = FILEget_next_cluster(fo, 1);
+		if (error == CE_GOOD)
+			n++;
+		else
+			fo->ccls = c;
+	}
+	if (error == CE_FAT_EOF)
+		error = CE_GOOD;
+
+	// add clusters to it
+	while ((n < needed) && (error == CE_GOOD))
+	{
+		error = FILEallocate_new_cluster(fo, 0);
+		n++;
+	}
+
+	fo->ccls = ccls;
+	if (error != CE_GOOD)
+	{
+		FSerrno = (error == CE_DISK_FULL) ? CE_DISK_FULL : CE_COULD_NOT_GET_CLUSTER;
+		return EOF;
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+** Function:	Free any clusters beyond the end of a file
+**
+** Notes:		File must be open for writing, and should be closed straight afterwards.
+**				Size is unchanged, so the file is then treated as read-only - closing it
+**				doesn't rewrite the directory entry or change the file's modified time.
+**				Returns 0 if OK, else EOF.
+*/
+int FS_trim(FSFILE * fo)
+{
+	DWORD cluster_bytes, n, c, ccls, LastClustervalue, eoc;
+	BYTE error;
+
+	if (!fo->flags.write || (fo->cluster == 0))
+		return EOF;
+
+	switch (fo->dsk->type)
+	{
+#ifdef SUPPORT_FAT32
+		case FAT32:
+			LastClustervalue = LAST_CLUSTER_FAT32;
+			eoc = LAST_CLUSTER_FAT32;
+			break;
+#endif
+		case FAT12:
+			LastClustervalue = LAST_CLUSTER_FAT12;
+			eoc = LAST_CLUSTER_FAT12;
+			break;
+		case FAT16:
+		default:
+			LastClustervalue = LAST_CLUSTER_FAT16;
+			eoc = LAST_CLUSTER_FAT16;
+			break;
+	}
+
+	cluster_bytes = (DWORD)fo->dsk->SecPerClus * fo->dsk->sectorSize;
+	n = (fo->size + cluster_bytes - 1) / cluster_bytes;
+	if (n == 0)
+		n = 1;									// keep first cluster
+	ccls = fo->ccls;
+
+	error = FILEseek_cluster(fo, n - 1);
+	if (error == CE_GOOD)
+	{
+		c = ReadFAT(fo->dsk, fo->ccls);
+		if ((c >= 2) && (c < LastClustervalue))	// chain continues
+		{
+			if ((WriteFAT(fo->dsk, fo->ccls, eoc, FALSE) != 0) || !FAT_erase_cluster_chain(c, fo->dsk))
+				error = CE_ERASE_FAIL;
+		}
+#ifdef FS_SEEK_INDEX_SIZE
+		if (fo->seekIndexCount > (n - 1) / FS_SEEK_INDEX_INTERVAL)	// forget entries for freed clusters
+			fo->seekIndexCount = (WORD)((n - 1) / FS_SEEK_INDEX_INTERVAL);
+#endif
+	}
+
+	fo->ccls = ccls;
+	fo->flags.write = FALSE;
+	if (error != CE_GOOD)
+	{
+		FSerrno = error;
+		return EOF;
+	}
+
+	return 0;
+}
+#endif
+
+/******************************************************************************
+** Function:	Get cluster and name of current working directory
+**
+** Notes:		name must have room for FILE_NAME_SIZE chars (not null-terminated).
+**				Used with FS_set_cwd() to return to a directory without walking the path.
+*/
+DWORD FS_get_cwd(char * name)
+{
+	memcpy(name, cwdptr->name, FILE_NAME_SIZE);
+	return cwdptr->dirclus;
+}
+
+/******************************************************************************
+** Function:	Set current working directory from cluster and name
+**
+** Notes:		cluster & name must come from FS_get_cwd() since gDirGeneration last changed.
+**				Equivalent to a successful FSchdir() to the same directory, with no sector reads.
+*/
+void FS_set_cwd(DWORD cluster, char * name)
+{
+	FSerrno = CE_GOOD;
+	cwdptr->dirclus = cluster;
+	cwdptr->dirccls = cluster;
+	memcpy(cwdptr->name, name, FILE_NAME_SIZE);
+}
+
 
 
 // This string is used by FSgetcwd to return the cwd name if the path
@@ -7442,6 +8172,7 @@ BYTE GetPreviousEntry (FSFILE * fo)
 #ifdef ALLOW_WRITES
 int FSmkdir (char * path)
 {
+    gDirGeneration++;
     return mkdirhelper (0, path, NULL);
 }
 
@@ -8144,6 +8875,7 @@ BYTE writeDotEntries (DISK * disk, DWORD dotAddress, DWORD dotdotAddress)
 
 int FSrmdir (char * path, unsigned char rmsubdirs)
 {
+    gDirGeneration++;
     return rmdirhelper (0, path, NULL, rmsubdirs);
 }
 
@@ -39,6 +39,14 @@
   Rev     Description
   -----   -----------
   1.2.5   Fixed bug in the calculation of the capacity for v1.0 devices
+  V6.03   gSectorReadCount - count of sector reads from the card, for file system statistics
+  V6.03   Consecutive sector reads & writes continue an open-ended READ_MULTI_BLOCK or
+          WRITE_MULTI_BLOCK transfer instead of a new command per sector. MDD_SDSPI_StreamStop()
+          ends it, MDD_SDSPI_WriteHint() gives a pre-erase count for the next write.
+          Command, sector write & streamed sector counts for file system statistics
+  V6.03   READ_MULTI_BLOCK only started on MDD_SDSPI_ReadHint() from FSIO, not on any read of the
+          sector after the last one, and stopped when the hinted sectors have been read, so a read
+          stream never stays open between FSIO calls
 
 ********************************************************************/
 
@@ -62,6 +70,16 @@ DWORD MDD_SDSPI_finalLBA;
 WORD gMediaSectorSize;
 BYTE gSDMode;
 MEDIA_INFORMATION mediaInformation;
+DWORD gSectorReadCount;			// sectors read from card since reset
+DWORD gSectorWriteCount;		// sectors written to card since reset
+DWORD gSDCommandCount;			// commands sent to card since reset
+DWORD gSDStreamSectors;			// sectors transferred without a command, as part of a multi-block transfer
+BYTE gSDStream;					// SD_STREAM_xxx - set to SD_STREAM_NONE whenever card is reset
+DWORD sd_stream_next;			// next sector of current multi-block transfer
+DWORD sd_last_write;			// last sector written, to detect sequential writes
+WORD sd_write_hint;				// number of sectors about to be written, 0 if unknown
+WORD sd_read_hint;				// number of sectors about to be read, 0 if unknown
+WORD sd_stream_left;			// sectors of current multi-block read still to be read
 
 #ifdef __18CXX
     // Summary: Table of SD card commands and parameters
@@ -91,7 +109,8 @@ MEDIA_INFORMATION mediaInformation;
     {cmdERASE,                  0xDF,   R1b,    NODATA},
     {cmdAPP_CMD,                0x73,   R1,     NODATA},
     {cmdREAD_OCR,               0x25,   R7,     NODATA},
-    {cmdCRC_ON_OFF,             0x25,   R1,     NODATA}
+    {cmdCRC_ON_OFF,             0x25,   R1,     NODATA},
+    {cmdSET_WR_BLK_ERASE_COUNT, 0xFF,   R1,     NODATA}
 };
 
 
@@ -394,6 +413,7 @@ MMC_RESPONSE SendMMCCmd(BYTE cmd, DWORD address)
     CMD_PACKET  CmdPacket;
 
     SD_CS = 0;                           //Card Select
+    gSDCommandCount++;
 
     // Copy over data
     CmdPacket.cmd        = sdmmc_cmdtable[cmd].CmdCode;
@@ -603,21 +623,45 @@ BYTE MDD_SDSPI_SectorRead(DWORD sector_addr, BYTE* buffer)
     BYTE data_token;
     BYTE status = TRUE;
     DWORD   new_addr;
+    BYTE    cmd;
+    WORD    hint;
 
-    // send the cmd
-    if (gSDMode == SD_MODE_NORMAL)
-        new_addr = sector_addr << 9;
+    gSectorReadCount++;
+    hint = sd_read_hint;
+    sd_read_hint = 0;                                   // only applies to this read
+    if ((gSDStream == SD_STREAM_READ) && (sector_addr == sd_stream_next))
+    {
+        // next block of multi-block read follows without a command
+        gSDStreamSectors++;
+        SD_CS = 0;
+    }
     else
-        new_addr = sector_addr;
-    response = SendMMCCmd(READ_SINGLE_BLOCK,new_addr);
-
-    // Make sure the command was accepted
-    if(response.r1._byte != 0x00)
     {
-        response = SendMMCCmd (READ_SINGLE_BLOCK,new_addr);
+        MDD_SDSPI_StreamStop();
+
+        // send the cmd - multi-block if FSIO is about to read the following sectors too
+        if (gSDMode == SD_MODE_NORMAL)
+            new_addr = sector_addr << 9;
+        else
+            new_addr = sector_addr;
+        cmd = (hint > 1) ? READ_MULTI_BLOCK : READ_SINGLE_BLOCK;
+        response = SendMMCCmd(cmd,new_addr);
+
+        // Make sure the command was accepted
         if(response.r1._byte != 0x00)
         {
-            return FALSE;
+            response = SendMMCCmd (cmd,new_addr);
+            if(response.r1._byte != 0x00)
+            {
+                SD_CS = 1;
+                return FALSE;
+            }
+        }
+
+        if (cmd == READ_MULTI_BLOCK)
+        {
+            gSDStream = SD_STREAM_READ;
+            sd_stream_left = hint;
         }
     }
 
@@ -676,10 +720,19 @@ BYTE MDD_SDSPI_SectorRead(DWORD sector_addr, BYTE* buffer)
         //status = mmcCardCRCError;
     }
 
-    mSend8ClkCycles();            //Required clocking (see spec)
+    if (gSDStream != SD_STREAM_READ)
+        mSend8ClkCycles();        //Required clocking (see spec) - not in a multi-block read, as it could clock out the next block
 
     SD_CS = 1;
 
+    if (gSDStream == SD_STREAM_READ)
+    {
+        if (status && (--sd_stream_left != 0))
+            sd_stream_next = sector_addr + 1;
+        else                                            // hinted sectors all read, or failed
+            MDD_SDSPI_StreamStop();
+    }
+
     return(status);
 }//end SectorRead
 
@@ -719,24 +772,56 @@ BYTE MDD_SDSPI_SectorWrite(DWORD sector_addr, BYTE* buffer, BYTE allowWriteToZer
     BYTE            data_response;
     MMC_RESPONSE    response;
     BYTE            status = TRUE;
+    BYTE            cmd;
+    BYTE            token;
 
     if (sector_addr == 0 && allowWriteToZero == FALSE)
         status = FALSE;
     else
     {
-        // send the cmd
-
-        if (gSDMode == SD_MODE_NORMAL)
-            response = SendMMCCmd(WRITE_SINGLE_BLOCK,(sector_addr << 9));
+        gSectorWriteCount++;
+        response.r1._byte = 0x00;
+        token = DATA_MULTI_START_TOKEN;
+        if ((gSDStream == SD_STREAM_WRITE) && (sector_addr == sd_stream_next))
+        {
+            // next block of multi-block write - no command needed
+            gSDStreamSectors++;
+            SD_CS = 0;
+        }
         else
-            response = SendMMCCmd(WRITE_SINGLE_BLOCK,(sector_addr));
+        {
+            MDD_SDSPI_StreamStop();
+
+            // send the cmd - multi-block if more sectors are expected, or this follows on from the last write
+            cmd = WRITE_SINGLE_BLOCK;
+            if ((sd_write_hint > 1) || (sector_addr == sd_last_write + 1))
+            {
+                if (sd_write_hint > 1)                  // pre-erase - response ignored, as it is only a hint
+                {
+                    SendMMCCmd(APP_CMD, 0);
+                    SendMMCCmd(SET_WR_BLK_ERASE_COUNT, sd_write_hint);
+                }
+                cmd = WRITE_MULTI_BLOCK;
+            }
+            else
+                token = DATA_START_TOKEN;
+
+            if (gSDMode == SD_MODE_NORMAL)
+                response = SendMMCCmd(cmd,(sector_addr << 9));
+            else
+                response = SendMMCCmd(cmd,(sector_addr));
+
+            if ((response.r1._byte == 0x00) && (cmd == WRITE_MULTI_BLOCK))
+                gSDStream = SD_STREAM_WRITE;
+        }
+        sd_write_hint = 0;                              // only applies to this write
 
         // see if it was accepted
         if(response.r1._byte != 0x00)
             status = FALSE;
         else
         {
-            WriteSPIM(DATA_START_TOKEN);                 //Send data start token
+            WriteSPIM(token);                           //Send data start token
 
             for(index = 0; index < gMediaSectorSize; index++)      //Send 512 bytes
             {
@@ -807,12 +892,100 @@ BYTE MDD_SDSPI_SectorWrite(DWORD sector_addr, BYTE* buffer, BYTE allowWriteToZer
 
         SD_CS = 1;
 
+        sd_last_write = sector_addr;
+        if (gSDStream == SD_STREAM_WRITE)
+        {
+            if (status)
+                sd_stream_next = sector_addr + 1;
+            else
+                MDD_SDSPI_StreamStop();
+        }
+
     } // Not writing to 0 sector
 
     return(status);
 } //end SectorWrite
 
 
+/******************************************************************************
+** Function:	End any multi-block transfer in progress
+**
+** Notes:		Must be called before anything relies on a multi-block write being complete.
+**				Called automatically before any other command is sent. Also drops any read hint not used.
+*/
+void MDD_SDSPI_StreamStop(void)
+{
+    BYTE    data_response;
+    DWORD   counter;
+
+    sd_read_hint = 0;
+    switch (gSDStream)
+    {
+    case SD_STREAM_READ:
+        SD_CS = 0;
+        gSDCommandCount++;
+        WriteSPIM(0x40 | cmdSTOP_TRANSMISSION);
+        WriteSPIM(0);
+        WriteSPIM(0);
+        WriteSPIM(0);
+        WriteSPIM(0);
+        WriteSPIM(sdmmc_cmdtable[STOP_TRANSMISSION].CRC);
+        MDD_SDSPI_ReadMedia();                  // stuff byte - may be part of next data block
+        counter = 0x10;
+        do                                      // wait for R1 response
+        {
+            data_response = MDD_SDSPI_ReadMedia();
+            counter--;
+        } while ((data_response & 0x80) && (counter != 0));
+        break;
+
+    case SD_STREAM_WRITE:
+        SD_CS = 0;
+        WriteSPIM(DATA_STOP_TRAN_TOKEN);
+        MDD_SDSPI_ReadMedia();                  // one byte before busy
+        break;
+
+    default:
+        return;
+    }
+
+    // wait for not busy
+    counter = GetInstructionClock() / 44;
+    do
+    {
+        data_response = MDD_SDSPI_ReadMedia();
+        counter--;
+    } while ((data_response == 0x00) && (counter != 0));
+
+    mSend8ClkCycles();
+    SD_CS = 1;
+    gSDStream = SD_STREAM_NONE;
+}
+
+
+/******************************************************************************
+** Function:	Tell card how many consecutive sectors are about to be written
+**
+** Notes:		Sent as ACMD23 before the next write, if it has to start a new transfer
+*/
+void MDD_SDSPI_WriteHint(WORD count)
+{
+    sd_write_hint = count;
+}
+
+
+/******************************************************************************
+** Function:	Tell card driver how many consecutive sectors are about to be read
+**
+** Notes:		The next read starts a READ_MULTI_BLOCK if count is more than 1, and it is stopped
+**				after count sectors. Dropped by MDD_SDSPI_StreamStop() if not used.
+*/
+void MDD_SDSPI_ReadHint(WORD count)
+{
+    sd_read_hint = count;
+}
+
+
 /*****************************************************************************
   Function:
     BYTE MDD_SDSPI_WriteProtectState